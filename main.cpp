@@ -12,17 +12,144 @@
      - Scaling: object sizing (buildings, trees, etc.)
 
    Controls:
-     D -> Day mode
-     N -> Night mode
+     D -> Jump the day clock to 10:00
+     N -> Jump the day clock to 22:00
+     C -> Capture next frame's draw calls to frame.mtrace
+     H -> Toggle platform crowd density heatmap
+     W -> What-if: branch the live sim (hold the next train, close a gate,
+          open an escalator), run 30 minutes ahead and print the KPIs
      ESC -> Exit
 
+   Command line:
+     --taps <file.csv>  Spawn passengers from smart-card tap records
+                        (first column: tap time in seconds, time-ordered)
+     --network <file>   Station graph, one "<from>,<to>,<seconds>" per line
+     --segment <i> <s>  Change segment i's run time (incremental matrix update)
+     --travel-times     Print the all-pairs station travel-time matrix and exit
+     --delay-bench <n>  Push n random delays through the timetable event graph
+                        incrementally and check against full propagation
+     --circulation      Link the day's trips into trainset circulations (min-cost
+                        flow) and print the fleet needed (--turnaround <s>,
+                        --fleet-limit <n> checks a fleet size)
+     --station-bench <pax/h>  Run the station interior queueing network for
+                        one simulated hour at the given arrival rate
+     --surrogate <pax/h>  Instant queueing-formula estimate of the station's
+                        waits, dwell, headway and platform crowding
+     --surrogate-check  Compare the estimate with the headless sim over a
+                        demand sweep and flag where it breaks down
+     --batch <n>        Load the scenario once, fork --workers processes that
+                        share it copy-on-write and run n headless replications
+                        (--batch-rate pax/h, --batch-seconds each)
+     --target <kpi>=<pct>  With --batch: run in waves until the KPI's confidence
+                        interval is within +-pct of its mean (n = run limit);
+                        --precision <pct> targets every KPI, --confidence <c>
+                        sets the level (default 95)
+     --stress <n>       Estimate P(platform crowd > --capacity riders in a
+                        --stress-window) by importance sampling: demand scaled
+                        by --stress-demand, one stop held for Exp(--stress-hold),
+                        outcomes reweighted; compared with plain Monte Carlo
+     --what-if <min>    Run --ticks of the scene, then branch it per intervention
+                        and compare KPIs over the next <min> minutes
+     --task-graph       Run each frame as a task graph on a thread pool and
+                        report the critical path every 300 frames
+     --task-graph-bench <n>  Same, headless into the software backend
+     --cloud-bench <n>  Bake the noise cloud sprites, then time n clouds drawn
+                        as sprites vs vector clouds in the software backend
+     --crowd-bench <n>  Time crowd grid binning + heatmap refresh for n agents
+     --threads <n>      Worker threads (default: hardware threads)
+     --soft-window      Render in software straight into double-buffered MIT-SHM
+                        XImages (build with -DMETRO_XSHM, link -lX11 -lXext)
+     --frames <n>       With --soft-window: draw n frames flat out, report timings
+     --layers           With --soft-window: cache each scene layer in its own
+                        surface, re-rendered only when it moved a whole pixel
+     --compositor-bench <n>  Time n frames drawn directly vs through the layer
+                        compositor in the software backend
+     --aa <off|coverage|ssaa4>  With --soft-window: analytic-coverage anti-aliasing
+                        or 4x supersampling
+     --aa-bench <n>     Time and compare aliased, analytic-coverage and 4x
+                        supersampled frames against a 16x supersampled reference
+     --clock <hh:mm>    Start time of the 24-hour day clock (default 10:00)
+     --day-length <s>   Real seconds per simulated day (default 240, 0 freezes)
+     --no-warmup        Build caches lazily on first use instead of as parallel
+                        startup jobs behind a directly drawn first frame
+     --warmup-bench     Headless startup: time to first frame / to full speed
+     --always-redraw    Redraw every tick even when nothing visible changed
+     --capture-trace <file>  Record the first frame's draw calls to a trace
+     --replay-trace <file>   Replay a trace against each backend and time it
+     --iterations <n>        Replay count per backend (default 500)
+     --fleet-bench <n>  Step n trains with the scalar and branch-free SoA state
+                        machines (--ticks, default 2000), check they agree
+     --verify <threads|simd|events>  Run one scenario two ways (serial vs
+                        task graph, scalar vs SIMD fleet, per-tick vs batched
+                        event engine), hash every entity each tick and report
+                        the first divergent tick and entity (--ticks)
+     --asset-cache <dir>  Where baked sprites persist across runs
+                        (default ~/.cache/metro-sim); --asset-cache-mb <n>
+                        bounds it (default 64, least recently used evicted)
+     --no-asset-cache   Bake everything in memory only
+     --hash-log <file>  Write per-tick state hashes (live run, or side A of --verify)
+     --compare-logs <a> <b>  First tick where two hash logs differ
+
    Build (Code::Blocks + GLUT):
      - Link with: opengl32, glu32, freeglut (or glut32 depending on your setup)
 */
 
+#ifndef METRO_LIBRARY
 #include <GL/glut.h>
+#endif
+#if defined(METRO_XSHM) && !defined(METRO_LIBRARY)
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/keysym.h>
+#include <X11/extensions/XShm.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#endif
+#include "metro_sim.h"
+
 #include <cmath>
 #include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <ctime>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define METRO_SSE2 1
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#if !defined(_WIN32)
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define METRO_MMAP 1
+#define METRO_FORK 1
+#endif
+#ifndef METRO_MMAP
+#include <filesystem>
+#endif
 
 // --------------------------- Canvas / Timing ---------------------------
 static const int W = 1000;
@@ -31,8 +158,505 @@ static const int H = 600;
 static const int TIMER_MS = 16;   // ~60 FPS
 static const float DT = 0.016f;
 
-// --------------------------- Modes ---------------------------
-static bool gNight = false;
+// --------------------------- Simulation State ---------------------------
+// Everything that evolves over time lives in one Sim instance, so the window,
+// the C API and batch tools can each run independent copies.
+enum TrainState
+{
+    TS_MOVING_TO_STATION,
+    TS_ARRIVING,
+    TS_STOPPED_SIGNAL_RED,
+    TS_DOORS_OPENING,
+    TS_PASSENGERS_BOARDING,
+    TS_DOORS_CLOSING,
+    TS_SIGNAL_GREEN_WAIT,
+    TS_MOVING_AWAY
+};
+
+static const float TRAIN_Y = 135.0f;
+static const float STATION_STOP_X = 420.0f;     // stop target for train front alignment
+static const float TRAIN_LENGTH = 520.0f;       // approximate total
+
+// Passenger system (pool; riders wait on the platform until a train boards)
+struct Passenger
+{
+    bool active = true;
+    bool boarding = false;   // set when doors open; late arrivals wait for next train
+    float x = 0;
+    float y = 0;
+    float speed = 90.0f;
+    float legPhase = 0.0f;   // for walking animation
+    int32_t cell = -1;       // crowd grid cell it is counted in
+};
+
+struct TapRecord
+{
+    double t;        // seconds relative to first record
+    uint32_t card;   // hash of card id (spawn position/speed variety)
+};
+
+static const size_t TAP_WINDOW = 16u << 20;      // bytes mapped at once
+static const size_t TAP_QUEUE_MAX = 4096;        // spawn queue bound
+static const double TAP_LOOKAHEAD = 2.0;         // seconds parsed ahead of clock
+
+struct TapStream
+{
+    int fd = -1;
+    FILE* fp = nullptr;
+    uint64_t fileSize = 0;
+
+    uint64_t winOff = 0;         // file offset of window start
+    const char* win = nullptr;   // window bytes
+    size_t winLen = 0;
+    size_t cur = 0;              // parse cursor within window
+    std::vector<char> buf;       // fallback window storage
+
+    bool haveBase = false;
+    double baseT = 0.0;
+    bool eof = true;
+    uint64_t records = 0, skipped = 0;
+
+    std::deque<TapRecord> queue;
+};
+
+// Station interior: a network of servers (gates, escalators, stairs) and
+// walking links, simulated event by event. See "Station Interior" below.
+struct QNode
+{
+    const char* name = "";
+    int servers = 0;        // parallel servers; 0 = walking link (no queue)
+    float serviceMean = 0;  // seconds per passenger per server
+    float serviceCv = 0;    // 0 deterministic .. 1 exponential
+    float transit = 0;      // walk/ride time after service
+    int next[2] = { -1, -1 };  // successor nodes, shortest queue wins; -1 = platform
+    int nextCount = 1;
+    float platformX = 0;    // where riders appear when next is the platform
+
+    int busy = 0;
+    std::deque<int32_t> queue;
+    uint64_t served = 0;
+    double waitSum = 0.0;
+    size_t maxQueue = 0;
+};
+
+struct QEvent
+{
+    double t;
+    uint64_t seq;           // tie-break keeps the order deterministic
+    int32_t pax;
+    int16_t node;
+    uint8_t done;           // 0 = arrive at node, 1 = service finished
+    bool operator>(const QEvent& o) const { return t != o.t ? t > o.t : seq > o.seq; }
+};
+
+struct QPax
+{
+    double tapAt;
+    double queuedAt;
+    float speed;
+    float legPhase;
+    float offset;           // spread around the platform exit
+};
+
+struct Interior
+{
+    std::vector<QNode> nodes;
+    std::priority_queue<QEvent, std::vector<QEvent>, std::greater<QEvent>> events;
+    std::vector<QPax> pax;
+    std::vector<int32_t> freePax;
+    uint64_t seq = 0;
+    uint64_t rng = 0x9e3779b97f4a7c15ull;
+    uint64_t processed = 0;
+    int inside = 0;
+};
+
+// Platform crowd density grid (see "Crowd Density Heatmap")
+static const float CROWD_CELL = 10.0f;     // px per cell
+static const float CROWD_Y0 = 150.0f;      // platform band
+static const int CROWD_GX = 100;
+static const int CROWD_GY = 8;
+static const int CROWD_BLUR = 2;           // box filter radius (cells)
+static const float CROWD_FULL = 1.5f;      // smoothed riders per cell shown as red
+static const double CROWD_HZ = 4.0;        // image refresh rate
+
+struct CrowdGrid
+{
+    std::vector<int32_t> counts = std::vector<int32_t>(CROWD_GX * CROWD_GY, 0);
+    std::vector<float> density = std::vector<float>(CROWD_GX * CROWD_GY, 0.0f);
+    std::vector<uint8_t> rgba = std::vector<uint8_t>(CROWD_GX * CROWD_GY * 4, 0);
+    uint32_t version = 0;
+    double nextRefresh = 0.0;
+};
+
+// Lighting and demand for one simulated minute (see "Day Clock")
+static const int DAY_MINUTES = 1440;
+static const float SUNRISE = 6 * 60.0f, SUNSET = 18 * 60.0f;
+static const float NIGHT_ELEV = -0.06f;   // sun elevation where the night palette starts
+
+struct DayLight
+{
+    float sunX = 0, sunY = 0, moonX = 0, moonY = 0;
+    float elev = 0;                   // sun elevation (-1..1)
+    float sky[3] = {}, ground[3] = {};
+    float ambient = 1;                // dims the day palette towards dusk
+    float demand = 0;                 // rider arrivals relative to peak (0..1)
+};
+
+// Rider done with the interior queues but still walking down until `at`
+struct Arriving
+{
+    double at;
+    float x, speed, legPhase;
+};
+
+struct Sim
+{
+    double time = 0.0;           // seconds since start
+    double clock = 10 * 60.0;    // simulated minute of day [0, 1440)
+    float clockRate = 6.0f;      // simulated minutes per second (240 s days)
+    DayLight light;              // derived from clock (applyClock)
+    bool night = false;          // derived: sun below NIGHT_ELEV
+
+    // Train positioning and animation
+    TrainState state = TS_MOVING_TO_STATION;
+    float stateTimer = 0.0f;
+    float trainX = -520.0f;      // left start
+    float trainSpeed = 220.0f;   // px/sec
+    float wheelAngle = 0.0f;     // degrees
+    float doorOpen = 0.0f;       // 0 closed, 1 fully open
+    bool  signalGreen = true;
+    float hold = 0.0f;           // extra seconds held at the red signal this stop
+
+    std::vector<Passenger> passengers;
+    int cycle = 0;
+    uint64_t boarded = 0;
+
+    // Cloud animation
+    float c1x = 120.0f, c2x = 520.0f, c3x = 860.0f;
+    float cloudSpeed = 25.0f;
+
+    TapStream taps;
+    Interior station;
+    std::vector<Arriving> arriving;   // on the stairs, reach the platform later
+
+    bool showCrowd = false;
+    CrowdGrid crowd;
+};
+
+static bool tapsEnabled(const Sim& sim) { return !sim.taps.eof || !sim.taps.queue.empty(); }
+
+// --------------------------- Day Clock ---------------------------
+// Sun and moon position, sky and ground colour, ambient light and rider
+// demand are tabulated once per simulated minute; a frame costs one table
+// fetch and a lerp between neighbouring minutes.
+static float smooth01(float e0, float e1, float x)
+{
+    float t = std::min(1.0f, std::max(0.0f, (x - e0) / (e1 - e0)));
+    return t * t * (3.0f - 2.0f * t);
+}
+
+static DayLight dayLightAt(float minute)
+{
+    static const float skyNight[3]    = { 0.08f, 0.10f, 0.16f };
+    static const float skyDay[3]      = { 0.55f, 0.80f, 0.98f };
+    static const float skyDusk[3]     = { 0.98f, 0.62f, 0.42f };
+    static const float groundNight[3] = { 0.10f, 0.18f, 0.10f };
+    static const float groundDay[3]   = { 0.45f, 0.75f, 0.45f };
+
+    DayLight d;
+    float a = (minute - SUNRISE) / (SUNSET - SUNRISE) * 3.14159265f;   // 0 sunrise, pi sunset
+    d.sunX = 500.0f - 430.0f * std::cos(a);
+    d.sunY = 150.0f + 400.0f * std::sin(a);
+    d.moonX = 500.0f + 430.0f * std::cos(a);     // opposite side of the arc
+    d.moonY = 150.0f - 400.0f * std::sin(a);
+    d.elev = std::sin(a);
+
+    float day = smooth01(NIGHT_ELEV, 0.35f, d.elev);
+    float dusk = 0.55f * std::exp(-(d.elev / 0.12f) * (d.elev / 0.12f));
+    for (int c = 0; c < 3; c++)
+    {
+        float sky = skyNight[c] + (skyDay[c] - skyNight[c]) * day;
+        d.sky[c] = sky + (skyDusk[c] - sky) * dusk;
+        d.ground[c] = groundNight[c] + (groundDay[c] - groundNight[c]) * day;
+    }
+    d.ambient = 0.3f + 0.7f * day;     // continuous, so lerps near dusk stay dim; unused at night
+
+    // Commuter profile: morning and evening peaks, thin late-night service
+    float m8 = (minute - 480.0f) / 75.0f, m17 = (minute - 1050.0f) / 90.0f;
+    d.demand = 0.08f + 0.35f * smooth01(300, 420, minute) * (1.0f - smooth01(1320, 1410, minute))
+             + 0.6f * std::exp(-m8 * m8) + 0.5f * std::exp(-m17 * m17);
+    d.demand = std::min(1.0f, d.demand);
+    return d;
+}
+
+// Set while startup warm-up jobs build the caches (this table, sleeper
+// tiles, cloud sprites). Meanwhile draw paths never build one themselves:
+// they use a cache once it is ready and draw directly until then.
+static std::atomic<bool> gWarmupRunning{ false };
+static std::atomic<uint32_t> gCacheGeneration{ 0 };   // bumped as warm-up caches land
+
+// Entries 0..1440 (the last repeats midnight, so lerps never wrap)
+static std::once_flag gDayTableOnce;
+static std::atomic<bool> gDayTableReady{ false };
+static std::vector<DayLight> gDayTable;
+
+static void buildDayTable()
+{
+    std::call_once(gDayTableOnce, []()
+    {
+        gDayTable.resize(DAY_MINUTES + 1);
+        for (int m = 0; m <= DAY_MINUTES; m++) gDayTable[m] = dayLightAt((float)(m % DAY_MINUTES));
+        gDayTableReady.store(true, std::memory_order_release);
+    });
+}
+
+static DayLight dayLight(double minute)
+{
+    static_assert(sizeof(DayLight) % sizeof(float) == 0, "DayLight must be all floats");
+    if (!gDayTableReady.load(std::memory_order_acquire))
+    {
+        if (gWarmupRunning.load(std::memory_order_relaxed)) return dayLightAt((float)minute);
+        buildDayTable();
+    }
+    const DayLight* t = gDayTable.data();
+    int i = std::min(DAY_MINUTES - 1, std::max(0, (int)minute));
+    float f = (float)(minute - i);
+    DayLight d;
+    const float* a = (const float*)&t[i];
+    const float* b = (const float*)&t[i + 1];
+    float* o = (float*)&d;
+    for (size_t k = 0; k < sizeof(DayLight) / sizeof(float); k++) o[k] = a[k] + (b[k] - a[k]) * f;
+    return d;
+}
+
+// Derived lighting state for the current clock
+static void applyClock(Sim& sim)
+{
+    sim.light = dayLight(sim.clock);
+    sim.night = sim.light.elev < NIGHT_ELEV;
+}
+
+static void setClock(Sim& sim, double minute)
+{
+    sim.clock = std::fmod(std::fmod(minute, (double)DAY_MINUTES) + DAY_MINUTES, (double)DAY_MINUTES);
+    applyClock(sim);
+}
+
+static void stepClock(Sim& sim, float dt)
+{
+    setClock(sim, sim.clock + (double)dt * sim.clockRate);
+}
+
+
+// --------------------------- Render Backend ---------------------------
+// Everything the scene draws goes through this small interface, so the
+// same drawing code can target OpenGL, the software rasterizer, a trace
+// recorder, etc.
+struct RenderBackend
+{
+    virtual ~RenderBackend() {}
+    virtual const char* name() const = 0;
+
+    virtual void clear() = 0;
+    virtual void color(float r, float g, float b) = 0;
+    virtual void rect(float x, float y, float w, float h) = 0;
+    virtual void rectLine(float x, float y, float w, float h) = 0;
+    virtual void pointSize(float s) = 0;
+    virtual void points(const int* xy, int count) = 0;   // xy pairs
+
+    // RGBA8 image (rows bottom-up) stretched over a rect and alpha blended.
+    // Backends may cache it per slot until `version` changes.
+    virtual void image(float x, float y, float w, float h, const uint8_t* rgba,
+                       int iw, int ih, uint32_t slot, uint32_t version) = 0;
+
+    // Many sub-rects of one RGBA8 atlas (rows bottom-up) in one call, drawn
+    // in order and blended like image(), colour scaled by `tint`
+    struct SpriteQuad { float x, y, w, h; int u, v, tw, th; };   // scene rect <- texel rect
+    virtual void sprites(const SpriteQuad* q, int count, const uint8_t* atlas, int aw, int ah,
+                         float tint, uint32_t slot, uint32_t version) = 0;
+
+    // Repeat an RGBA8 tile (tw x th scene units, rows bottom-up) across a
+    // rect, anchored at (x, y). Texels with alpha < 128 are left untouched.
+    virtual void pattern(float x, float y, float w, float h, const uint8_t* tile,
+                         int tw, int th, uint32_t slot, uint32_t version) = 0;
+
+    virtual void push() = 0;
+    virtual void pop() = 0;
+    virtual void translate(float x, float y) = 0;
+    virtual void rotate(float deg) = 0;
+    virtual void scale(float sx, float sy) = 0;
+
+    // A target that returns true from smooth() is handed the raster
+    // algorithms' lines and circles as geometry, stroked at the point size,
+    // instead of their plotted points
+    virtual bool smooth() const { return false; }
+    virtual void segment(float, float, float, float) {}
+    virtual void circle(float, float, float) {}
+};
+
+#ifndef METRO_LIBRARY
+// Fixed-function OpenGL (immediate mode)
+struct GlBackend : RenderBackend
+{
+    const char* name() const override { return "gl"; }
+
+    void clear() override { glClear(GL_COLOR_BUFFER_BIT); }
+    void color(float r, float g, float b) override { glColor3f(r, g, b); }
+
+    void rect(float x, float y, float w, float h) override
+    {
+        glBegin(GL_QUADS);
+        glVertex2f(x, y);
+        glVertex2f(x + w, y);
+        glVertex2f(x + w, y + h);
+        glVertex2f(x, y + h);
+        glEnd();
+    }
+
+    void rectLine(float x, float y, float w, float h) override
+    {
+        glBegin(GL_LINE_LOOP);
+        glVertex2f(x, y);
+        glVertex2f(x + w, y);
+        glVertex2f(x + w, y + h);
+        glVertex2f(x, y + h);
+        glEnd();
+    }
+
+    void pointSize(float s) override { glPointSize(s); }
+
+    void points(const int* xy, int count) override
+    {
+        glBegin(GL_POINTS);
+        for (int i = 0; i < count; i++) glVertex2i(xy[2 * i], xy[2 * i + 1]);
+        glEnd();
+    }
+
+    struct Tex { GLuint id = 0; uint32_t version = 0; };
+    std::vector<Tex> tex;
+
+    // Bind the slot's texture, uploading only when the version changed
+    void bindTex(uint32_t slot, uint32_t version, const uint8_t* rgba, int iw, int ih,
+                 GLint filter, GLint wrap)
+    {
+        if (slot >= tex.size()) tex.resize(slot + 1);
+        Tex& t = tex[slot];
+        if (!t.id) glGenTextures(1, &t.id);
+        glBindTexture(GL_TEXTURE_2D, t.id);
+        if (t.version != version || version == 0)
+        {
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrap);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrap);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, iw, ih, 0, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
+            t.version = version;
+        }
+    }
+
+    void image(float x, float y, float w, float h, const uint8_t* rgba,
+               int iw, int ih, uint32_t slot, uint32_t version) override
+    {
+        bindTex(slot, version, rgba, iw, ih, GL_LINEAR, GL_CLAMP);
+        glEnable(GL_TEXTURE_2D);
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glColor3f(1, 1, 1);
+        glBegin(GL_QUADS);
+        glTexCoord2f(0, 0); glVertex2f(x, y);
+        glTexCoord2f(1, 0); glVertex2f(x + w, y);
+        glTexCoord2f(1, 1); glVertex2f(x + w, y + h);
+        glTexCoord2f(0, 1); glVertex2f(x, y + h);
+        glEnd();
+        glDisable(GL_BLEND);
+        glDisable(GL_TEXTURE_2D);
+    }
+
+    // One texture bind and one quad list for the whole batch; the vertex
+    // colour modulates the texture (GL_MODULATE)
+    void sprites(const SpriteQuad* q, int count, const uint8_t* atlas, int aw, int ah,
+                 float tint, uint32_t slot, uint32_t version) override
+    {
+        bindTex(slot, version, atlas, aw, ah, GL_LINEAR, GL_CLAMP);
+        glEnable(GL_TEXTURE_2D);
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glColor3f(tint, tint, tint);
+        glBegin(GL_QUADS);
+        for (int i = 0; i < count; i++)
+        {
+            float u0 = (float)q[i].u / aw, u1 = (float)(q[i].u + q[i].tw) / aw;
+            float v0 = (float)q[i].v / ah, v1 = (float)(q[i].v + q[i].th) / ah;
+            float x = q[i].x, y = q[i].y, w = q[i].w, h = q[i].h;
+            glTexCoord2f(u0, v0); glVertex2f(x, y);
+            glTexCoord2f(u1, v0); glVertex2f(x + w, y);
+            glTexCoord2f(u1, v1); glVertex2f(x + w, y + h);
+            glTexCoord2f(u0, v1); glVertex2f(x, y + h);
+        }
+        glEnd();
+        glDisable(GL_BLEND);
+        glDisable(GL_TEXTURE_2D);
+    }
+
+    // One textured quad; GL_REPEAT does the tiling
+    void pattern(float x, float y, float w, float h, const uint8_t* tile,
+                 int tw, int th, uint32_t slot, uint32_t version) override
+    {
+        bindTex(slot, version, tile, tw, th, GL_NEAREST, GL_REPEAT);
+        glEnable(GL_TEXTURE_2D);
+        glEnable(GL_ALPHA_TEST);
+        glAlphaFunc(GL_GEQUAL, 0.5f);
+        glColor3f(1, 1, 1);
+        float u = w / tw, v = h / th;
+        glBegin(GL_QUADS);
+        glTexCoord2f(0, 0); glVertex2f(x, y);
+        glTexCoord2f(u, 0); glVertex2f(x + w, y);
+        glTexCoord2f(u, v); glVertex2f(x + w, y + h);
+        glTexCoord2f(0, v); glVertex2f(x, y + h);
+        glEnd();
+        glDisable(GL_ALPHA_TEST);
+        glDisable(GL_TEXTURE_2D);
+    }
+
+    void push() override { glPushMatrix(); }
+    void pop() override { glPopMatrix(); }
+    void translate(float x, float y) override { glTranslatef(x, y, 0); }
+    void rotate(float deg) override { glRotatef(deg, 0, 0, 1); }
+    void scale(float sx, float sy) override { glScalef(sx, sy, 1.0f); }
+};
+
+static GlBackend gGlBackend;
+#endif
+
+// Image cache slots
+static const int AMBIENT_LEVELS = 16;   // baked tiles per theme under the day clock's light
+enum { IMG_CROWD = 0, IMG_SLEEPERS0, IMG_CLOUD0 = IMG_SLEEPERS0 + 2 * AMBIENT_LEVELS };
+
+// Current target; per thread so separate instances can render concurrently
+static thread_local RenderBackend* gGfx = nullptr;
+
+// Points plotted by the raster algorithms are collected into runs and
+// handed to the backend in one call (flushed on color change / end).
+static thread_local std::vector<int> gPointRun;
+static thread_local bool gInPoints = false;
+
+static void flushPoints()
+{
+    if (!gPointRun.empty())
+        gGfx->points(gPointRun.data(), (int)(gPointRun.size() / 2));
+    gPointRun.clear();
+}
+
+static void beginPoints() { gInPoints = true; }
+static void endPoints()   { flushPoints(); gInPoints = false; }
+
+static void gfxPush() { gGfx->push(); }
+static void gfxPop()  { gGfx->pop(); }
+static void gfxTranslate(float x, float y) { gGfx->translate(x, y); }
+static void gfxRotate(float deg) { gGfx->rotate(deg); }
+static void gfxScale(float sx, float sy) { gGfx->scale(sx, sy); }
+static void gfxPointSize(float s) { gGfx->pointSize(s); }
 
 // --------------------------- Utility ---------------------------
 static inline int iround(float x) { return (int)std::lround(x); }
@@ -40,12 +664,15 @@ static inline int iround(float x) { return (int)std::lround(x); }
 // Plot a point (used by custom algorithms)
 static void plotPoint(int x, int y)
 {
-    glVertex2i(x, y);
+    gPointRun.push_back(x);
+    gPointRun.push_back(y);
 }
 
 // --------------------------- DDA Line Algorithm ---------------------------
 static void lineDDA(float x1, float y1, float x2, float y2)
 {
+    if (gGfx->smooth()) { flushPoints(); gGfx->segment(x1, y1, x2, y2); return; }
+
     float dx = x2 - x1;
     float dy = y2 - y1;
 
@@ -69,6 +696,8 @@ static void lineDDA(float x1, float y1, float x2, float y2)
 // --------------------------- Bresenham Line Algorithm ---------------------------
 static void lineBresenham(int x1, int y1, int x2, int y2)
 {
+    if (gGfx->smooth()) { flushPoints(); gGfx->segment((float)x1, (float)y1, (float)x2, (float)y2); return; }
+
     int dx = std::abs(x2 - x1);
     int dy = std::abs(y2 - y1);
 
@@ -91,6 +720,8 @@ static void lineBresenham(int x1, int y1, int x2, int y2)
 // --------------------------- Midpoint Circle Algorithm ---------------------------
 static void circleMidpoint(int xc, int yc, int r)
 {
+    if (gGfx->smooth()) { flushPoints(); gGfx->circle((float)xc, (float)yc, (float)r); return; }
+
     int x = 0;
     int y = r;
     int d = 1 - r;
@@ -126,57 +757,60 @@ static void circleMidpoint(int xc, int yc, int r)
 }
 
 // --------------------------- Drawing Helpers ---------------------------
+// Ambient light of the layer being drawn (per thread: layers record in parallel)
+static thread_local float gAmbient = 1.0f;
+
+static void setLighting(const Sim& sim) { gAmbient = sim.night ? 1.0f : sim.light.ambient; }
+
 static void setColor(float r, float g, float b)
 {
-    glColor3f(r, g, b);
+    if (gInPoints) flushPoints();
+    gGfx->color(r * gAmbient, g * gAmbient, b * gAmbient);
+}
+
+// Light sources and the sky itself are not dimmed
+static void setColorUnlit(float r, float g, float b)
+{
+    if (gInPoints) flushPoints();
+    gGfx->color(r, g, b);
 }
 
 static void rectFilled(float x, float y, float w, float h)
 {
-    glBegin(GL_QUADS);
-    glVertex2f(x, y);
-    glVertex2f(x + w, y);
-    glVertex2f(x + w, y + h);
-    glVertex2f(x, y + h);
-    glEnd();
+    gGfx->rect(x, y, w, h);
 }
 
 static void rectOutline(float x, float y, float w, float h)
 {
-    glBegin(GL_LINE_LOOP);
-    glVertex2f(x, y);
-    glVertex2f(x + w, y);
-    glVertex2f(x + w, y + h);
-    glVertex2f(x, y + h);
-    glEnd();
+    gGfx->rectLine(x, y, w, h);
 }
 
 // Use algorithms to draw a rectangle outline with Bresenham (pixel lines)
 static void rectOutlineBresenham(int x, int y, int w, int h)
 {
-    glBegin(GL_POINTS);
+    beginPoints();
     lineBresenham(x, y, x + w, y);
     lineBresenham(x + w, y, x + w, y + h);
     lineBresenham(x + w, y + h, x, y + h);
     lineBresenham(x, y + h, x, y);
-    glEnd();
+    endPoints();
 }
 
 // Use algorithms to draw a rectangle outline with DDA (pixel lines)
 static void rectOutlineDDA(int x, int y, int w, int h)
 {
-    glBegin(GL_POINTS);
+    beginPoints();
     lineDDA((float)x, (float)y, (float)(x + w), (float)y);
     lineDDA((float)(x + w), (float)y, (float)(x + w), (float)(y + h));
     lineDDA((float)(x + w), (float)(y + h), (float)x, (float)(y + h));
     lineDDA((float)x, (float)(y + h), (float)x, (float)y);
-    glEnd();
+    endPoints();
 }
 
 // --------------------------- Scene Objects ---------------------------
 
 // Background buildings (scaled + DDA outlines)
-static void drawBuildings()
+static void drawBuildings(const Sim& sim)
 {
     // Buildings base layer
     struct B { float x, y, w, h, s; };
@@ -191,17 +825,17 @@ static void drawBuildings()
 
     for (auto &b : bs)
     {
-        glPushMatrix();
-        glTranslatef(b.x, b.y, 0);
-        glScalef(b.s, b.s, 1.0f); // Scaling (required)
+        gfxPush();
+        gfxTranslate(b.x, b.y);
+        gfxScale(b.s, b.s); // Scaling (required)
 
         // Fill
-        if (!gNight) setColor(0.78f, 0.80f, 0.86f);
+        if (!sim.night) setColor(0.78f, 0.80f, 0.86f);
         else         setColor(0.15f, 0.17f, 0.22f);
         rectFilled(0, 0, b.w, b.h);
 
         // Outline using DDA (required)
-        if (!gNight) setColor(0.30f, 0.35f, 0.45f);
+        if (!sim.night) setColor(0.30f, 0.35f, 0.45f);
         else         setColor(0.65f, 0.70f, 0.80f);
         rectOutlineDDA(0, 0, (int)b.w, (int)b.h);
 
@@ -217,631 +851,6862 @@ static void drawBuildings()
                 float py = r * wy - 8;
                 float ww = 18, wh = 14;
 
-                if (!gNight) setColor(0.55f, 0.70f, 0.90f);
+                if (!sim.night) setColor(0.55f, 0.70f, 0.90f);
                 else         setColor(0.95f, 0.85f, 0.40f); // warm lights at night
                 rectFilled(px, py, ww, wh);
             }
         }
 
-        glPopMatrix();
+        gfxPop();
     }
 }
 
-// Sun / Moon using midpoint circle
-static void drawSunMoon()
+// Sun / Moon using midpoint circle, placed on their arcs by the day clock
+static void drawSunMoon(const Sim& sim)
 {
-    glPointSize(2.0f);
-    glBegin(GL_POINTS);
-    if (!gNight)
+    const DayLight& l = sim.light;
+    gfxPointSize(2.0f);
+    beginPoints();
+    if (l.sunY > 150.0f - 35.0f)
     {
-        setColor(1.0f, 0.85f, 0.20f);
-        circleMidpoint(880, 520, 35);
+        setColorUnlit(1.0f, 0.85f, 0.20f);
+        circleMidpoint(iround(l.sunX), iround(l.sunY), 35);
     }
-    else
+    if (l.moonY > 150.0f - 30.0f)
     {
-        setColor(0.90f, 0.90f, 0.95f);
-        circleMidpoint(880, 520, 30);
-        // Crescent effect (simple)
-        setColor(0.10f, 0.10f, 0.15f);
-        circleMidpoint(892, 528, 26);
+        setColorUnlit(0.90f, 0.90f, 0.95f);
+        circleMidpoint(iround(l.moonX), iround(l.moonY), 30);
+        // Crescent effect (simple): bite out of it in sky colour
+        setColorUnlit(l.sky[0], l.sky[1], l.sky[2]);
+        circleMidpoint(iround(l.moonX) + 12, iround(l.moonY) + 8, 26);
     }
-    glEnd();
+    endPoints();
 }
 
 // Cloud made from 3 circles + a base (translation used externally)
-static void drawCloud()
+static void drawCloud(const Sim& sim)
 {
-    if (!gNight) setColor(1.0f, 1.0f, 1.0f);
+    if (!sim.night) setColor(1.0f, 1.0f, 1.0f);
     else         setColor(0.75f, 0.78f, 0.85f);
 
     rectFilled(-35, -10, 90, 22);
 
-    glPointSize(2.0f);
-    glBegin(GL_POINTS);
+    gfxPointSize(2.0f);
+    beginPoints();
     circleMidpoint(-20,  2, 18);
     circleMidpoint(  5, 10, 22);
     circleMidpoint( 30,  2, 18);
-    glEnd();
+    endPoints();
 }
 
-// Station + platform
-static void drawStation()
+// --------------------------- Asset Disk Cache ---------------------------
+// Baked pixels are a pure function of their inputs, so they are kept across
+// runs in a content-addressed directory: the file name is a hash of the
+// inputs (and ASSET_CACHE_VERSION, bumped whenever a bake changes), the file
+// is a small header plus raw pixels, and a hit is mmapped and used in place.
+// Files are written to a temp name and renamed, so concurrent warm-up jobs
+// and processes never see a torn blob. A hit refreshes the file's mtime;
+// once the directory exceeds its size bound the least recently used files
+// are deleted.
+static const uint32_t ASSET_CACHE_MAGIC = 0x4350584d;   // "MXPC"
+static const uint32_t ASSET_CACHE_VERSION = 1;
+static const size_t ASSET_HEADER = 64;                   // pixels start here
+
+struct AssetHeader
 {
-    // Platform
-    if (!gNight) setColor(0.60f, 0.60f, 0.62f);
-    else         setColor(0.25f, 0.25f, 0.28f);
-    rectFilled(0, 150, W, 80);
-
-    // Platform edge line using Bresenham
-    if (!gNight) setColor(0.95f, 0.90f, 0.20f);
-    else         setColor(0.90f, 0.85f, 0.30f);
-    glPointSize(2.0f);
-    glBegin(GL_POINTS);
-    lineBresenham(0, 150, W, 150);
-    glEnd();
+    uint32_t magic, version;
+    uint64_t key;
+    int32_t w, h;
+    float ox, oy;
+    uint64_t bytes;
+};
 
-    // Station building (simple)
-    if (!gNight) setColor(0.88f, 0.88f, 0.90f);
-    else         setColor(0.18f, 0.18f, 0.22f);
-    rectFilled(680, 230, 280, 170);
+struct AssetCache
+{
+    std::string dir;                 // empty = disabled
+    uint64_t maxBytes = 64ull << 20;
+    std::atomic<uint64_t> total{ 0 };
+    std::atomic<int> hits{ 0 }, misses{ 0 };
+    std::atomic<uint32_t> tmpSeq{ 0 };
+    std::mutex trimLock;
+};
+static AssetCache gAssetCache;
 
-    // Outline (Bresenham)
-    if (!gNight) setColor(0.25f, 0.30f, 0.40f);
-    else         setColor(0.65f, 0.70f, 0.80f);
-    glPointSize(2.0f);
-    rectOutlineBresenham(680, 230, 280, 170);
+// Inputs -> key: FNV-1a over the fields a bake depends on
+struct AssetKey
+{
+    uint64_t h = 1469598103934665603ull;
+    AssetKey(const char* kind) { bytes(kind, std::strlen(kind)); add(ASSET_CACHE_VERSION); }
+    void bytes(const void* p, size_t n)
+    {
+        for (size_t i = 0; i < n; i++) { h ^= ((const uint8_t*)p)[i]; h *= 1099511628211ull; }
+    }
+    template <class T> AssetKey& add(T v) { bytes(&v, sizeof v); return *this; }
+};
 
-    // Station sign
-    if (!gNight) setColor(0.20f, 0.40f, 0.80f);
-    else         setColor(0.30f, 0.50f, 0.90f);
-    rectFilled(740, 350, 160, 40);
+// A header is trusted only if it is ours and its pixel count is what the
+// file holds: callers read w * h * 4 bytes from the blob
+static const int32_t ASSET_MAX_DIM = 4096;
 
-    if (!gNight) setColor(1.0f, 1.0f, 1.0f);
-    else         setColor(1.0f, 1.0f, 1.0f);
-    // Simple "METRO" letters using DDA lines (pixel style)
-    glPointSize(2.0f);
-    glBegin(GL_POINTS);
-    // M
-    lineDDA(755, 360, 755, 380);
-    lineDDA(755, 380, 765, 370);
-    lineDDA(765, 370, 775, 380);
-    lineDDA(775, 380, 775, 360);
-    // E
-    lineDDA(790, 360, 790, 380);
-    lineDDA(790, 380, 810, 380);
-    lineDDA(790, 370, 805, 370);
-    lineDDA(790, 360, 810, 360);
-    // T
-    lineDDA(825, 380, 845, 380);
-    lineDDA(835, 380, 835, 360);
-    // R
-    lineDDA(860, 360, 860, 380);
-    lineDDA(860, 380, 878, 380);
-    lineDDA(878, 380, 878, 370);
-    lineDDA(878, 370, 860, 370);
-    lineDDA(860, 370, 880, 360);
-    // O
-    circleMidpoint(915, 370, 10);
-    glEnd();
+static bool validAssetHeader(const AssetHeader& h, uint64_t key, uint64_t fileSize)
+{
+    return h.magic == ASSET_CACHE_MAGIC && h.version == ASSET_CACHE_VERSION && h.key == key &&
+           h.w > 0 && h.h > 0 && h.w <= ASSET_MAX_DIM && h.h <= ASSET_MAX_DIM &&
+           (uint64_t)h.w * h.h * 4 == h.bytes && ASSET_HEADER + h.bytes == fileSize;
 }
 
-// Track with sleepers (Bresenham)
-static void drawTrack()
+// Read-only view of a cached blob; the mapping lives for the whole run
+struct AssetBlob
 {
-    if (!gNight) setColor(0.25f, 0.25f, 0.25f);
-    else         setColor(0.55f, 0.55f, 0.60f);
+    AssetHeader hdr{};
+    const uint8_t* pixels = nullptr;
+};
 
-    glPointSize(2.0f);
-    glBegin(GL_POINTS);
-    lineBresenham(0, 120, W, 120);
-    lineBresenham(0,  95, W,  95);
-    glEnd();
+static std::string assetPath(uint64_t key, const char* suffix = ".mpx")
+{
+    char name[48];
+    std::snprintf(name, sizeof name, "/%016llx%s", (unsigned long long)key, suffix);
+    return gAssetCache.dir + name;
+}
 
-    // Sleepers (ties)
-    if (!gNight) setColor(0.45f, 0.30f, 0.20f);
-    else         setColor(0.35f, 0.25f, 0.20f);
+#ifdef METRO_MMAP
 
-    for (int x = 0; x < W; x += 35)
-        rectFilled((float)x, 92.0f, 18.0f, 32.0f);
+static void mkdirs(const std::string& path)
+{
+    for (size_t i = 1; i <= path.size(); i++)
+        if (i == path.size() || path[i] == '/') mkdir(path.substr(0, i).c_str(), 0755);
 }
 
-// Signal light (red/green state)
-static void drawSignal(bool green)
+// Least recently used first until the directory is at 3/4 of its bound
+static void trimAssetCache()
 {
-    // Pole
-    if (!gNight) setColor(0.20f, 0.20f, 0.22f);
-    else         setColor(0.65f, 0.65f, 0.70f);
-    rectFilled(610, 150, 12, 140);
-
-    // Head box
-    if (!gNight) setColor(0.12f, 0.12f, 0.14f);
-    else         setColor(0.20f, 0.20f, 0.24f);
-    rectFilled(590, 260, 55, 85);
-
-    // Lights (Midpoint circle)
-    glPointSize(2.0f);
-    glBegin(GL_POINTS);
-    if (!green)
+    std::lock_guard<std::mutex> lock(gAssetCache.trimLock);
+    DIR* d = opendir(gAssetCache.dir.c_str());
+    if (!d) return;
+    struct Entry { std::string path; int64_t mtime; uint64_t size; };
+    std::vector<Entry> files;
+    uint64_t total = 0;
+    while (dirent* e = readdir(d))
     {
-        setColor(1.0f, 0.15f, 0.15f); circleMidpoint(617, 320, 12); // Red ON
-        if (!gNight) setColor(0.10f, 0.35f, 0.10f);
-        else         setColor(0.10f, 0.25f, 0.10f);
-        circleMidpoint(617, 285, 12); // Green OFF
+        size_t n = std::strlen(e->d_name);
+        if (n < 4 || std::strcmp(e->d_name + n - 4, ".mpx") != 0) continue;
+        std::string p = gAssetCache.dir + "/" + e->d_name;
+        struct stat st;
+        if (stat(p.c_str(), &st) != 0) continue;
+        files.push_back({ p, (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec, (uint64_t)st.st_size });
+        total += st.st_size;
     }
-    else
+    closedir(d);
+
+    if (total > gAssetCache.maxBytes)
     {
-        if (!gNight) setColor(0.35f, 0.10f, 0.10f);
-        else         setColor(0.25f, 0.10f, 0.10f);
-        circleMidpoint(617, 320, 12); // Red OFF
-        setColor(0.15f, 1.0f, 0.20f); circleMidpoint(617, 285, 12); // Green ON
+        std::sort(files.begin(), files.end(), [](const Entry& a, const Entry& b) { return a.mtime < b.mtime; });
+        for (auto &f : files)
+        {
+            if (total <= gAssetCache.maxBytes / 4 * 3) break;
+            if (unlink(f.path.c_str()) == 0) total -= f.size;
+        }
     }
-    glEnd();
+    gAssetCache.total = total;
 }
 
-// --------------------------- Train + Passengers (State Machine) ---------------------------
-enum TrainState
+static void openAssetCache(const char* dir, uint64_t maxBytes)
 {
-    TS_MOVING_TO_STATION,
-    TS_ARRIVING,
-    TS_STOPPED_SIGNAL_RED,
-    TS_DOORS_OPENING,
-    TS_PASSENGERS_BOARDING,
-    TS_DOORS_CLOSING,
-    TS_SIGNAL_GREEN_WAIT,
-    TS_MOVING_AWAY
-};
-
-static TrainState gState = TS_MOVING_TO_STATION;
-
-// Train positioning and animation
-static float gTrainX = -520.0f;     // left start
-static const float TRAIN_Y = 135.0f;
-
-static float gTrainSpeed = 220.0f;  // px/sec
-static float gWheelAngle = 0.0f;    // degrees
-
-static float gDoorOpen = 0.0f;      // 0 closed, 1 fully open
-static bool  gSignalGreen = true;
-
-static const float STATION_STOP_X = 420.0f;     // stop target for train front alignment
-static const float TRAIN_LENGTH = 520.0f;       // approximate total
+    gAssetCache.dir = dir ? dir : "";
+    gAssetCache.maxBytes = maxBytes;
+    if (gAssetCache.dir.empty()) return;
+    mkdirs(gAssetCache.dir);
+    trimAssetCache();
+}
 
-// Passenger system (2 passengers)
-struct Passenger
+#ifndef METRO_LIBRARY
+// $XDG_CACHE_HOME/metro-sim, else ~/.cache/metro-sim
+static std::string defaultAssetCacheDir()
 {
-    bool active = true;
-    float x = 0;
-    float y = 0;
-    float speed = 90.0f;
-    float legPhase = 0.0f;   // for walking animation
-};
-
-static Passenger p1, p2;
-static int gCycle = 0;
+    if (const char* x = std::getenv("XDG_CACHE_HOME")) if (*x) return std::string(x) + "/metro-sim";
+    if (const char* home = std::getenv("HOME")) if (*home) return std::string(home) + "/.cache/metro-sim";
+    return "";
+}
+#endif
 
-// Train door target x (in world coords)
-static float trainDoorWorldX()
+static bool loadAsset(uint64_t key, AssetBlob& out)
+{
+    if (gAssetCache.dir.empty()) return false;
+    int fd = open(assetPath(key).c_str(), O_RDONLY);
+    if (fd < 0) { gAssetCache.misses++; return false; }
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= ASSET_HEADER)
+        map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) futimens(fd, nullptr);        // LRU stamp
+    close(fd);
+    if (map == MAP_FAILED) { gAssetCache.misses++; return false; }
+
+    std::memcpy(&out.hdr, map, sizeof out.hdr);
+    const AssetHeader& h = out.hdr;
+    if (!validAssetHeader(h, key, (uint64_t)st.st_size))
+    {
+        munmap(map, st.st_size);
+        unlink(assetPath(key).c_str());                 // stale or corrupt: rebuild
+        gAssetCache.misses++;
+        return false;
+    }
+    out.pixels = (const uint8_t*)map + ASSET_HEADER;
+    gAssetCache.hits++;
+    return true;
+}
+
+static void storeAsset(const AssetHeader& hdr, const uint8_t* pixels)
+{
+    if (gAssetCache.dir.empty()) return;
+    char suffix[48];
+    std::snprintf(suffix, sizeof suffix, ".tmp%d.%u", (int)getpid(), gAssetCache.tmpSeq++);
+    std::string tmp = assetPath(hdr.key, suffix);
+    FILE* f = std::fopen(tmp.c_str(), "wb");
+    if (!f) return;
+    uint8_t head[ASSET_HEADER] = {};
+    std::memcpy(head, &hdr, sizeof hdr);
+    bool ok = std::fwrite(head, sizeof head, 1, f) == 1 &&
+              std::fwrite(pixels, 1, hdr.bytes, f) == hdr.bytes;
+    ok = std::fclose(f) == 0 && ok;
+    if (!ok || std::rename(tmp.c_str(), assetPath(hdr.key).c_str()) != 0)
+    {
+        unlink(tmp.c_str());
+        return;
+    }
+    if ((gAssetCache.total += ASSET_HEADER + hdr.bytes) > gAssetCache.maxBytes) trimAssetCache();
+}
+#else
+// Without mmap (Windows): the same files through std::filesystem and stdio.
+// A hit is read into memory that, like a mapping, lives for the whole run.
+static void trimAssetCache()
+{
+    std::lock_guard<std::mutex> lock(gAssetCache.trimLock);
+    struct Entry { std::filesystem::path path; std::filesystem::file_time_type mtime; uint64_t size; };
+    std::vector<Entry> files;
+    uint64_t total = 0;
+    std::error_code ec;
+    for (const auto& e : std::filesystem::directory_iterator(gAssetCache.dir, ec))
+    {
+        if (e.path().extension() != ".mpx") continue;
+        std::error_code fe;
+        uint64_t size = e.file_size(fe);
+        auto mtime = e.last_write_time(fe);
+        if (fe) continue;
+        files.push_back({ e.path(), mtime, size });
+        total += size;
+    }
+
+    if (total > gAssetCache.maxBytes)
+    {
+        std::sort(files.begin(), files.end(), [](const Entry& a, const Entry& b) { return a.mtime < b.mtime; });
+        for (auto &f : files)
+        {
+            if (total <= gAssetCache.maxBytes / 4 * 3) break;
+            if (std::filesystem::remove(f.path, ec)) total -= f.size;
+        }
+    }
+    gAssetCache.total = total;
+}
+
+static void openAssetCache(const char* dir, uint64_t maxBytes)
+{
+    gAssetCache.dir = dir ? dir : "";
+    gAssetCache.maxBytes = maxBytes;
+    if (gAssetCache.dir.empty()) return;
+    std::error_code ec;
+    std::filesystem::create_directories(gAssetCache.dir, ec);
+    trimAssetCache();
+}
+
+#ifndef METRO_LIBRARY
+// %LOCALAPPDATA%\metro-sim, else $XDG_CACHE_HOME/metro-sim
+static std::string defaultAssetCacheDir()
+{
+    if (const char* x = std::getenv("LOCALAPPDATA")) if (*x) return std::string(x) + "/metro-sim";
+    if (const char* x = std::getenv("XDG_CACHE_HOME")) if (*x) return std::string(x) + "/metro-sim";
+    return "";
+}
+#endif
+
+static bool loadAsset(uint64_t key, AssetBlob& out)
+{
+    if (gAssetCache.dir.empty()) return false;
+    std::string path = assetPath(key);
+    std::error_code ec;
+    uint64_t size = std::filesystem::file_size(path, ec);
+    FILE* f = ec ? nullptr : std::fopen(path.c_str(), "rb");
+    if (!f) { gAssetCache.misses++; return false; }
+
+    AssetHeader& h = out.hdr;
+    uint8_t* pixels = nullptr;
+    bool ok = size >= ASSET_HEADER && std::fread(&h, sizeof h, 1, f) == 1 && validAssetHeader(h, key, size);
+    if (ok)
+    {
+        pixels = new uint8_t[h.bytes];
+        ok = std::fseek(f, (long)ASSET_HEADER, SEEK_SET) == 0 && std::fread(pixels, 1, h.bytes, f) == h.bytes;
+    }
+    std::fclose(f);
+    if (!ok)
+    {
+        delete[] pixels;
+        std::filesystem::remove(path, ec);               // stale or corrupt: rebuild
+        gAssetCache.misses++;
+        return false;
+    }
+    std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), ec);   // LRU stamp
+    out.pixels = pixels;
+    gAssetCache.hits++;
+    return true;
+}
+
+static void storeAsset(const AssetHeader& hdr, const uint8_t* pixels)
+{
+    if (gAssetCache.dir.empty()) return;
+    char suffix[48];
+    std::snprintf(suffix, sizeof suffix, ".tmp%llx.%u",
+                  (unsigned long long)std::chrono::steady_clock::now().time_since_epoch().count(),
+                  gAssetCache.tmpSeq++);
+    std::string tmp = assetPath(hdr.key, suffix);
+    FILE* f = std::fopen(tmp.c_str(), "wb");
+    if (!f) return;
+    uint8_t head[ASSET_HEADER] = {};
+    std::memcpy(head, &hdr, sizeof hdr);
+    bool ok = std::fwrite(head, sizeof head, 1, f) == 1 &&
+              std::fwrite(pixels, 1, hdr.bytes, f) == hdr.bytes;
+    ok = std::fclose(f) == 0 && ok;
+    std::error_code ec;
+    if (ok) std::filesystem::rename(tmp, assetPath(hdr.key), ec);   // replaces an existing file
+    if (!ok || ec)
+    {
+        std::filesystem::remove(tmp, ec);
+        return;
+    }
+    if ((gAssetCache.total += ASSET_HEADER + hdr.bytes) > gAssetCache.maxBytes) trimAssetCache();
+}
+#endif
+
+// --------------------------- Cloud Sprites ---------------------------
+// Each cloud is a sprite baked from seeded fractal value noise shaped by a
+// soft envelope, then drawn as a single image blit. Sprites are baked on
+// first use per (variant, theme, scale) and reused, and kept in the asset
+// disk cache for later runs; GL keeps each one as a texture, so a sky of
+// many clouds costs one blit per cloud. That is not batching: in the
+// software renderer the cost stays linear in the cloud count, and a blit is
+// only slightly cheaper than the vector cloud (see --cloud-bench). The scene
+// draws three clouds, and the layer compositor redraws them only when they
+// move a whole pixel.
+static const int CLOUD_VARIANTS = 16;
+static const int CLOUD_SCALES = 3;
+static const float CLOUD_SCALE[CLOUD_SCALES] = { 0.9f, 1.0f, 1.1f };
+static const float CLOUD_W = 120.0f, CLOUD_H = 56.0f;   // scene units at scale 1
+static const int CLOUD_OCTAVES = 4;
+
+// Jenkins one-at-a-time mix of the lattice point: shifts, adds and xors
+// only, since SSE2 has no 32-bit multiply
+static inline uint32_t noiseHash(int32_t x, int32_t y, uint32_t seed)
+{
+    uint32_t h = seed;
+    h += (uint32_t)x; h += h << 10; h ^= h >> 6;
+    h += (uint32_t)y; h += h << 10; h ^= h >> 6;
+    h += h << 3; h ^= h >> 11; h += h << 15;
+    return h;
+}
+
+static inline float valueNoise(float fx, float fy, uint32_t seed)
+{
+    // Coordinates are non-negative, so truncation is floor
+    int32_t x0 = (int32_t)fx, y0 = (int32_t)fy;
+    float tx = fx - (float)x0, ty = fy - (float)y0;
+    float sx = tx * tx * (3.0f - 2.0f * tx);
+    float sy = ty * ty * (3.0f - 2.0f * ty);
+    const float k = 1.0f / 16777216.0f;
+    float h00 = (float)(noiseHash(x0, y0, seed) >> 8) * k;
+    float h10 = (float)(noiseHash(x0 + 1, y0, seed) >> 8) * k;
+    float h01 = (float)(noiseHash(x0, y0 + 1, seed) >> 8) * k;
+    float h11 = (float)(noiseHash(x0 + 1, y0 + 1, seed) >> 8) * k;
+    float a = h00 + (h10 - h00) * sx;
+    float b = h01 + (h11 - h01) * sx;
+    return a + (b - a) * sy;
+}
+
+#ifdef METRO_SSE2
+static inline __m128i noiseHash4(__m128i x, __m128i y, __m128i seed)
+{
+    __m128i h = _mm_add_epi32(seed, x);
+    h = _mm_add_epi32(h, _mm_slli_epi32(h, 10)); h = _mm_xor_si128(h, _mm_srli_epi32(h, 6));
+    h = _mm_add_epi32(h, y);
+    h = _mm_add_epi32(h, _mm_slli_epi32(h, 10)); h = _mm_xor_si128(h, _mm_srli_epi32(h, 6));
+    h = _mm_add_epi32(h, _mm_slli_epi32(h, 3));  h = _mm_xor_si128(h, _mm_srli_epi32(h, 11));
+    h = _mm_add_epi32(h, _mm_slli_epi32(h, 15));
+    return h;
+}
+
+// Four lanes of valueNoise, same operation order so results are identical
+static inline __m128 valueNoise4(__m128 fx, __m128 fy, __m128i seed)
+{
+    __m128i x0 = _mm_cvttps_epi32(fx), y0 = _mm_cvttps_epi32(fy);
+    __m128 tx = _mm_sub_ps(fx, _mm_cvtepi32_ps(x0));
+    __m128 ty = _mm_sub_ps(fy, _mm_cvtepi32_ps(y0));
+    const __m128 three = _mm_set1_ps(3.0f), two = _mm_set1_ps(2.0f);
+    __m128 sx = _mm_mul_ps(_mm_mul_ps(tx, tx), _mm_sub_ps(three, _mm_mul_ps(two, tx)));
+    __m128 sy = _mm_mul_ps(_mm_mul_ps(ty, ty), _mm_sub_ps(three, _mm_mul_ps(two, ty)));
+    const __m128 k = _mm_set1_ps(1.0f / 16777216.0f);
+    const __m128i one = _mm_set1_epi32(1);
+    __m128i x1 = _mm_add_epi32(x0, one), y1 = _mm_add_epi32(y0, one);
+    __m128 h00 = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(noiseHash4(x0, y0, seed), 8)), k);
+    __m128 h10 = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(noiseHash4(x1, y0, seed), 8)), k);
+    __m128 h01 = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(noiseHash4(x0, y1, seed), 8)), k);
+    __m128 h11 = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(noiseHash4(x1, y1, seed), 8)), k);
+    __m128 a = _mm_add_ps(h00, _mm_mul_ps(_mm_sub_ps(h10, h00), sx));
+    __m128 b = _mm_add_ps(h01, _mm_mul_ps(_mm_sub_ps(h11, h01), sx));
+    return _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), sy));
+}
+#endif
+
+// fBm along a row: out[i] = sum of octaves at (x0 + i*dx, y), in [0, 1)
+static void fbmRow(float* out, int n, float x0, float dx, float y, uint32_t seed)
+{
+    const float norm = 1.0f / (2.0f - 2.0f / (float)(1 << CLOUD_OCTAVES));
+    int i = 0;
+#ifdef METRO_SSE2
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128 fx = _mm_add_ps(_mm_set1_ps(x0),
+                               _mm_mul_ps(_mm_set_ps(i + 3.0f, i + 2.0f, i + 1.0f, (float)i), _mm_set1_ps(dx)));
+        __m128 fy = _mm_set1_ps(y);
+        __m128 sum = _mm_setzero_ps();
+        float amp = 1.0f;
+        for (int o = 0; o < CLOUD_OCTAVES; o++)
+        {
+            __m128i s = _mm_set1_epi32((int32_t)(seed + 0x9e3779b9u * o));
+            sum = _mm_add_ps(sum, _mm_mul_ps(valueNoise4(fx, fy, s), _mm_set1_ps(amp)));
+            fx = _mm_add_ps(fx, fx); fy = _mm_add_ps(fy, fy);
+            amp *= 0.5f;
+        }
+        _mm_storeu_ps(out + i, _mm_mul_ps(sum, _mm_set1_ps(norm)));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        float fx = x0 + (float)i * dx, fy = y, sum = 0.0f, amp = 1.0f;
+        for (int o = 0; o < CLOUD_OCTAVES; o++)
+        {
+            sum += valueNoise(fx, fy, seed + 0x9e3779b9u * o) * amp;
+            fx += fx; fy += fy;
+            amp *= 0.5f;
+        }
+        out[i] = sum * norm;
+    }
+}
+
+struct CloudSprite
+{
+    int w = 0, h = 0;          // texels == scene units
+    float ox = 0, oy = 0;      // offset of the bottom-left from the cloud anchor
+    std::vector<uint8_t> rgba;  // when baked here
+    const uint8_t* px = nullptr; // rgba, or the mapped disk cache blob
+};
+
+static void bakeCloud(CloudSprite& s, int variant, bool night, float scale)
+{
+    s.w = iround(CLOUD_W * scale);
+    s.h = iround(CLOUD_H * scale);
+    s.ox = -0.5f * s.w;
+    s.oy = -0.25f * s.h;
+    s.rgba.assign((size_t)s.w * s.h * 4, 0);
+
+    // Per-variant seed, width and puffiness
+    uint32_t seed = noiseHash(variant, 7, 0x51f15eedu);
+    float rx = 0.78f + 0.22f * (float)(seed & 255) / 255.0f;
+    float lumpy = 0.9f + 0.5f * (float)((seed >> 8) & 255) / 255.0f;
+    const float freq = 1.0f / 14.0f;                 // noise cells per scene unit
+    const float base = 1000.0f + 64.0f * variant;   // keeps lattice coords positive
+
+    const float top[3] = { night ? 0.75f : 1.00f, night ? 0.78f : 1.00f, night ? 0.85f : 1.00f };
+    const float low[3] = { night ? 0.38f : 0.74f, night ? 0.41f : 0.78f, night ? 0.50f : 0.88f };
+
+    std::vector<float> n(s.w);
+    for (int y = 0; y < s.h; y++)
+    {
+        float v = (float)y / scale;                  // scene units, unscaled
+        fbmRow(n.data(), s.w, base, freq / scale, base + v * freq, seed);
+        float ny = v / CLOUD_H;                       // 0 bottom .. 1 top
+        for (int x = 0; x < s.w; x++)
+        {
+            float nx = ((float)x / s.w - 0.5f) * 2.0f / rx;
+            float dy = (ny - 0.35f) / 0.55f;
+            float env = 1.0f - nx * nx - dy * dy;
+            float d = (env + (n[x] - 0.5f) * lumpy) * 3.0f;
+            float ex = std::fabs((float)x / s.w - 0.5f) * 2.0f;
+            d *= std::min(1.0f, ny / 0.12f);             // flattish base
+            d *= std::min(1.0f, (1.0f - ny) / 0.2f);     // no hard edges at the
+            d *= std::min(1.0f, (1.0f - ex) / 0.12f);    // sprite border
+            d = std::min(1.0f, std::max(0.0f, d));
+            if (d <= 0.0f) continue;
+
+            float light = std::min(1.0f, std::max(0.0f, 0.35f + ny + (n[x] - 0.5f) * 0.8f));
+            uint8_t* p = &s.rgba[4 * ((size_t)y * s.w + x)];
+            for (int c = 0; c < 3; c++)
+                p[c] = (uint8_t)iround(255.0f * (low[c] + (top[c] - low[c]) * light));
+            p[3] = (uint8_t)iround(255.0f * d);
+        }
+    }
+}
+
+struct CloudCacheEntry
+{
+    std::once_flag once;
+    std::atomic<bool> ready{ false };
+    CloudSprite sprite;
+};
+static CloudCacheEntry gCloudCache[CLOUD_VARIANTS * 2 * CLOUD_SCALES];
+
+static int cloudKey(int variant, bool night, int scaleIdx)
+{
+    return ((variant % CLOUD_VARIANTS) * 2 + (night ? 1 : 0)) * CLOUD_SCALES + scaleIdx;
+}
+
+// Thread-safe: warm-up jobs and layer recording may race for an entry
+static const CloudSprite& bakeCloudEntry(int key)
+{
+    CloudCacheEntry& e = gCloudCache[key];
+    std::call_once(e.once, [&]()
+    {
+        CloudSprite& s = e.sprite;
+        int variant = key / (2 * CLOUD_SCALES), night = (key / CLOUD_SCALES) & 1;
+        float scale = CLOUD_SCALE[key % CLOUD_SCALES];
+        uint64_t hash = AssetKey("cloud").add(variant).add(night).add(scale)
+                            .add(CLOUD_W).add(CLOUD_H).add(CLOUD_OCTAVES).h;
+        AssetBlob blob;
+        if (loadAsset(hash, blob))
+        {
+            s.w = blob.hdr.w; s.h = blob.hdr.h;
+            s.ox = blob.hdr.ox; s.oy = blob.hdr.oy;
+            s.px = blob.pixels;
+        }
+        else
+        {
+            bakeCloud(s, variant, night != 0, scale);
+            s.px = s.rgba.data();
+            storeAsset({ ASSET_CACHE_MAGIC, ASSET_CACHE_VERSION, hash, s.w, s.h, s.ox, s.oy, s.rgba.size() },
+                       s.px);
+        }
+        e.ready.store(true, std::memory_order_release);
+    });
+    return e.sprite;
+}
+
+#ifndef METRO_LIBRARY
+static const CloudSprite& cloudSprite(int variant, bool night, int scaleIdx)
+{
+    return bakeCloudEntry(cloudKey(variant, night, scaleIdx));
+}
+#endif
+
+// All sprites of one theme shelf-packed into one texture (with a clear
+// texel between them for linear filtering), so a sky of any number of
+// clouds is one sprites() call and one texture bind
+static const int CLOUD_ATLAS_W = 1024;
+
+struct CloudAtlas
+{
+    struct Cell { int u, v, w, h; float ox, oy; };
+    std::once_flag once;
+    std::atomic<bool> ready{ false };
+    int w = 0, h = 0;
+    std::vector<uint8_t> rgba;
+    Cell cell[CLOUD_VARIANTS * CLOUD_SCALES];   // variant * CLOUD_SCALES + scale
+};
+static CloudAtlas gCloudAtlas[2];
+
+static const CloudAtlas& cloudAtlas(bool night)
+{
+    CloudAtlas& a = gCloudAtlas[night ? 1 : 0];
+    std::call_once(a.once, [&]()
+    {
+        const CloudSprite* sp[CLOUD_VARIANTS * CLOUD_SCALES];
+        a.w = CLOUD_ATLAS_W;
+        for (int i = 0; i < CLOUD_VARIANTS * CLOUD_SCALES; i++)
+        {
+            sp[i] = &bakeCloudEntry(cloudKey(i / CLOUD_SCALES, night, i % CLOUD_SCALES));
+            a.w = std::max(a.w, sp[i]->w + 2);
+        }
+        int x = 1, y = 1, shelf = 0;
+        for (int i = 0; i < CLOUD_VARIANTS * CLOUD_SCALES; i++)
+        {
+            if (x + sp[i]->w + 1 > a.w) { x = 1; y += shelf + 1; shelf = 0; }
+            a.cell[i] = { x, y, sp[i]->w, sp[i]->h, sp[i]->ox, sp[i]->oy };
+            x += sp[i]->w + 1;
+            shelf = std::max(shelf, sp[i]->h);
+        }
+        a.h = y + shelf + 1;
+        a.rgba.assign((size_t)a.w * a.h * 4, 0);
+        for (int i = 0; i < CLOUD_VARIANTS * CLOUD_SCALES; i++)
+            for (int r = 0; r < sp[i]->h; r++)
+                std::memcpy(&a.rgba[4 * ((size_t)(a.cell[i].v + r) * a.w + a.cell[i].u)],
+                            sp[i]->px + 4 * (size_t)r * sp[i]->w, 4 * (size_t)sp[i]->w);
+        a.ready.store(true, std::memory_order_release);
+    });
+    return a;
+}
+
+// Packed on first use; null while warm-up has not got to it yet
+static const CloudAtlas* readyCloudAtlas(bool night)
+{
+    if (!gCloudAtlas[night ? 1 : 0].ready.load(std::memory_order_acquire) &&
+        gWarmupRunning.load(std::memory_order_relaxed)) return nullptr;
+    return &cloudAtlas(night);
+}
+
+// One cloud of the sky: anchor, sprite variant and scale
+struct CloudPlace { float x, y; int variant, scaleIdx; };
+
+static thread_local std::vector<RenderBackend::SpriteQuad> gCloudQuads;
+
+// Clouds back to front as one sprite batch, tinted by the ambient light the
+// way setColor dims the vector clouds that stand in until the atlas is ready
+static void drawClouds(const Sim& sim, const CloudPlace* c, int n)
+{
+    const CloudAtlas* a = readyCloudAtlas(sim.night);
+    if (!a)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            gfxPush();
+            gfxTranslate(c[i].x, c[i].y);
+            gfxScale(CLOUD_SCALE[c[i].scaleIdx], CLOUD_SCALE[c[i].scaleIdx]);
+            drawCloud(sim);
+            gfxPop();
+        }
+        return;
+    }
+    gCloudQuads.resize(n);
+    for (int i = 0; i < n; i++)
+    {
+        const CloudAtlas::Cell& e = a->cell[(c[i].variant % CLOUD_VARIANTS) * CLOUD_SCALES + c[i].scaleIdx];
+        gCloudQuads[i] = { c[i].x + e.ox, c[i].y + e.oy, (float)e.w, (float)e.h, e.u, e.v, e.w, e.h };
+    }
+    flushPoints();
+    gGfx->sprites(gCloudQuads.data(), n, a->rgba.data(), a->w, a->h, gAmbient,
+                  IMG_CLOUD0 + (sim.night ? 1 : 0), 1);
+}
+
+// Station + platform
+static void drawStation(const Sim& sim)
+{
+    // Platform
+    if (!sim.night) setColor(0.60f, 0.60f, 0.62f);
+    else         setColor(0.25f, 0.25f, 0.28f);
+    rectFilled(0, 150, W, 80);
+
+    // Platform edge line using Bresenham
+    if (!sim.night) setColor(0.95f, 0.90f, 0.20f);
+    else         setColor(0.90f, 0.85f, 0.30f);
+    gfxPointSize(2.0f);
+    beginPoints();
+    lineBresenham(0, 150, W, 150);
+    endPoints();
+
+    // Station building (simple)
+    if (!sim.night) setColor(0.88f, 0.88f, 0.90f);
+    else         setColor(0.18f, 0.18f, 0.22f);
+    rectFilled(680, 230, 280, 170);
+
+    // Outline (Bresenham)
+    if (!sim.night) setColor(0.25f, 0.30f, 0.40f);
+    else         setColor(0.65f, 0.70f, 0.80f);
+    gfxPointSize(2.0f);
+    rectOutlineBresenham(680, 230, 280, 170);
+
+    // Station sign
+    if (!sim.night) setColor(0.20f, 0.40f, 0.80f);
+    else         setColor(0.30f, 0.50f, 0.90f);
+    rectFilled(740, 350, 160, 40);
+
+    if (!sim.night) setColor(1.0f, 1.0f, 1.0f);
+    else         setColor(1.0f, 1.0f, 1.0f);
+    // Simple "METRO" letters using DDA lines (pixel style)
+    gfxPointSize(2.0f);
+    beginPoints();
+    // M
+    lineDDA(755, 360, 755, 380);
+    lineDDA(755, 380, 765, 370);
+    lineDDA(765, 370, 775, 380);
+    lineDDA(775, 380, 775, 360);
+    // E
+    lineDDA(790, 360, 790, 380);
+    lineDDA(790, 380, 810, 380);
+    lineDDA(790, 370, 805, 370);
+    lineDDA(790, 360, 810, 360);
+    // T
+    lineDDA(825, 380, 845, 380);
+    lineDDA(835, 380, 835, 360);
+    // R
+    lineDDA(860, 360, 860, 380);
+    lineDDA(860, 380, 878, 380);
+    lineDDA(878, 380, 878, 370);
+    lineDDA(878, 370, 860, 370);
+    lineDDA(860, 370, 880, 360);
+    // O
+    circleMidpoint(915, 370, 10);
+    endPoints();
+}
+
+// Pattern tile: a solid block at the left of an otherwise clear tile
+struct PatternTile
+{
+    int w, h;
+    std::vector<uint8_t> rgba;
+};
+
+static PatternTile makeBlockTile(int w, int h, int blockW, float r, float g, float b)
+{
+    PatternTile t{ w, h, std::vector<uint8_t>((size_t)w * h * 4, 0) };
+    for (int y = 0; y < h; y++)
+        for (int x = 0; x < blockW; x++)
+        {
+            uint8_t* p = &t.rgba[4 * ((size_t)y * w + x)];
+            p[0] = (uint8_t)iround(r * 255); p[1] = (uint8_t)iround(g * 255);
+            p[2] = (uint8_t)iround(b * 255); p[3] = 255;
+        }
+    return t;
+}
+
+// One tile per theme and ambient level, built on first use (frame layers
+// record on workers, hence call_once)
+struct TileCacheEntry
+{
+    std::once_flag once;
+    std::atomic<bool> ready{ false };
+    PatternTile tile;
+};
+static TileCacheEntry gSleeperTiles[2 * AMBIENT_LEVELS];
+
+static int sleeperSlot(bool night, float ambient)
+{
+    int level = std::min(AMBIENT_LEVELS - 1, std::max(0, iround(ambient * (AMBIENT_LEVELS - 1))));
+    return (night ? AMBIENT_LEVELS : 0) + level;
+}
+
+static const PatternTile& sleeperTile(int slot)
+{
+    TileCacheEntry& e = gSleeperTiles[slot];
+    std::call_once(e.once, [&]()
+    {
+        float a = (float)(slot % AMBIENT_LEVELS) / (AMBIENT_LEVELS - 1);
+        e.tile = slot >= AMBIENT_LEVELS ? makeBlockTile(35, 32, 18, 0.35f * a, 0.25f * a, 0.20f * a)
+                                        : makeBlockTile(35, 32, 18, 0.45f * a, 0.30f * a, 0.20f * a);
+        e.ready.store(true, std::memory_order_release);
+    });
+    return e.tile;
+}
+
+// Track with sleepers (Bresenham)
+static void drawTrack(const Sim& sim)
+{
+    if (!sim.night) setColor(0.25f, 0.25f, 0.25f);
+    else         setColor(0.55f, 0.55f, 0.60f);
+
+    gfxPointSize(2.0f);
+    beginPoints();
+    lineBresenham(0, 120, W, 120);
+    lineBresenham(0,  95, W,  95);
+    endPoints();
+
+    // Sleepers (ties): one 18-unit tie per 35-unit tile, repeated; one
+    // rect per tie until warm-up has built the tile
+    int slot = sleeperSlot(sim.night, gAmbient);
+    if (!gSleeperTiles[slot].ready.load(std::memory_order_acquire) &&
+        gWarmupRunning.load(std::memory_order_relaxed))
+    {
+        if (!sim.night) setColor(0.45f, 0.30f, 0.20f);
+        else         setColor(0.35f, 0.25f, 0.20f);
+        for (int x = 0; x < W; x += 35)
+            rectFilled((float)x, 92.0f, 18.0f, 32.0f);
+        return;
+    }
+    const PatternTile& t = sleeperTile(slot);
+    flushPoints();
+    gGfx->pattern(0, 92.0f, W, (float)t.h, t.rgba.data(), t.w, t.h,
+                  IMG_SLEEPERS0 + slot, 1);
+}
+
+// Signal light (red/green state)
+static void drawSignal(const Sim& sim, bool green)
+{
+    // Pole
+    if (!sim.night) setColor(0.20f, 0.20f, 0.22f);
+    else         setColor(0.65f, 0.65f, 0.70f);
+    rectFilled(610, 150, 12, 140);
+
+    // Head box
+    if (!sim.night) setColor(0.12f, 0.12f, 0.14f);
+    else         setColor(0.20f, 0.20f, 0.24f);
+    rectFilled(590, 260, 55, 85);
+
+    // Lights (Midpoint circle)
+    gfxPointSize(2.0f);
+    beginPoints();
+    if (!green)
+    {
+        setColor(1.0f, 0.15f, 0.15f); circleMidpoint(617, 320, 12); // Red ON
+        if (!sim.night) setColor(0.10f, 0.35f, 0.10f);
+        else         setColor(0.10f, 0.25f, 0.10f);
+        circleMidpoint(617, 285, 12); // Green OFF
+    }
+    else
+    {
+        if (!sim.night) setColor(0.35f, 0.10f, 0.10f);
+        else         setColor(0.25f, 0.10f, 0.10f);
+        circleMidpoint(617, 320, 12); // Red OFF
+        setColor(0.15f, 1.0f, 0.20f); circleMidpoint(617, 285, 12); // Green ON
+    }
+    endPoints();
+}
+
+// --------------------------- Station Interior ---------------------------
+// Riders tap in at the gates, walk the concourse, then take the escalator or
+// the stairs down to the platform. Each server is a FCFS multi-server queue
+// driven by a binary-heap event scheduler, so gate throughput and escalator
+// queues decide when and where riders reach the platform.
+enum { Q_GATES, Q_CONCOURSE, Q_ESCALATOR, Q_ESC_RIDE, Q_STAIRS };
+
+static void addQNode(Interior& in, const char* name, int servers, float mean, float cv,
+                     float transit, int next0, int next1, float platformX)
+{
+    QNode n;
+    n.name = name;
+    n.servers = servers;
+    n.serviceMean = mean;
+    n.serviceCv = cv;
+    n.transit = transit;
+    n.next[0] = next0;
+    n.next[1] = next1;
+    n.nextCount = next1 >= 0 ? 2 : 1;
+    n.platformX = platformX;
+    in.nodes.push_back(n);
+}
+
+static void buildInterior(Interior& in, int gates, int escalators, int stairs)
+{
+    in.nodes.clear();
+    //                     servers     mean  cv    transit next                    platformX
+    addQNode(in, "gates",     gates,      1.2f, 0.5f, 0.0f, Q_CONCOURSE, -1,        0);
+    addQNode(in, "concourse", 0,          1.5f, 0.3f, 0.0f, Q_ESCALATOR, Q_STAIRS,  0);
+    addQNode(in, "escalator", escalators, 0.6f, 0.0f, 0.0f, Q_ESC_RIDE, -1,         0);
+    addQNode(in, "esc-ride",  0,          1.5f, 0.0f, 0.0f, -1, -1,                 760.0f);
+    addQNode(in, "stairs",    stairs,     1.0f, 0.4f, 2.0f, -1, -1,                 880.0f);
+}
+
+// xorshift64*; uniform in (0,1]
+static double interiorRand(Interior& in)
+{
+    in.rng ^= in.rng >> 12; in.rng ^= in.rng << 25; in.rng ^= in.rng >> 27;
+    return ((in.rng * 2685821657736338717ull) >> 11) * (1.0 / 9007199254740992.0) + 1e-17;
+}
+
+static double serviceTime(Interior& in, const QNode& n)
+{
+    double det = n.serviceMean * (1.0f - n.serviceCv);
+    if (n.serviceCv <= 0.0f) return det;
+    return det - std::log(interiorRand(in)) * n.serviceMean * n.serviceCv;
+}
+
+static void pushEvent(Interior& in, double t, int32_t pax, int node, bool done)
+{
+    in.events.push({ t, in.seq++, pax, (int16_t)node, (uint8_t)done });
+}
+
+static void startService(Interior& in, int node, int32_t pax, double now)
+{
+    QNode& n = in.nodes[node];
+    n.waitSum += now - in.pax[pax].queuedAt;
+    n.busy++;
+    pushEvent(in, now + serviceTime(in, n), pax, node, true);
+}
+
+// Rider taps in at time t (may be slightly in the future)
+static void interiorArrive(Interior& in, double t, float speed, float legPhase, float offset)
+{
+    int32_t id;
+    if (!in.freePax.empty()) { id = in.freePax.back(); in.freePax.pop_back(); }
+    else { id = (int32_t)in.pax.size(); in.pax.push_back(QPax()); }
+    in.pax[id] = { t, t, speed, legPhase, offset };
+    in.inside++;
+    pushEvent(in, t, id, Q_GATES, false);
+}
+
+// Process events up to `until`; onPlatform(pax, x, t) for each rider reaching it
+template <class Fn>
+static void advanceInterior(Interior& in, double until, Fn onPlatform)
+{
+    while (!in.events.empty() && in.events.top().t <= until)
+    {
+        QEvent e = in.events.top();
+        in.events.pop();
+        in.processed++;
+        QNode& n = in.nodes[e.node];
+
+        if (!e.done)
+        {
+            in.pax[e.pax].queuedAt = e.t;
+            if (n.servers == 0) startService(in, e.node, e.pax, e.t);   // walking link
+            else if (n.busy < n.servers) startService(in, e.node, e.pax, e.t);
+            else
+            {
+                n.queue.push_back(e.pax);
+                n.maxQueue = std::max(n.maxQueue, n.queue.size());
+            }
+            continue;
+        }
+
+        // Service finished: free the server, hand the next queued rider in
+        n.busy--;
+        n.served++;
+        if (!n.queue.empty())
+        {
+            int32_t q = n.queue.front();
+            n.queue.pop_front();
+            startService(in, e.node, q, e.t);
+        }
+
+        int next = n.next[0];
+        if (n.nextCount == 2)
+        {
+            // Pick the successor with the shorter queue per server
+            const QNode& a = in.nodes[n.next[0]];
+            const QNode& b = in.nodes[n.next[1]];
+            float la = (float)(a.queue.size() + a.busy) / std::max(1, a.servers);
+            float lb = (float)(b.queue.size() + b.busy) / std::max(1, b.servers);
+            if (lb < la) next = n.next[1];
+        }
+
+        if (next < 0)
+        {
+            onPlatform(in.pax[e.pax], n.platformX, e.t + n.transit);
+            in.freePax.push_back(e.pax);
+            in.inside--;
+        }
+        else pushEvent(in, e.t + n.transit, e.pax, next, false);
+    }
+}
+
+#ifndef METRO_LIBRARY
+// Headless run: Poisson arrivals at `perHour` through an interchange-sized
+// interior for one simulated hour; reports throughput and queueing.
+static void benchInterior(double perHour)
+{
+    Interior in;
+    buildInterior(in, 40, 16, 6);
+    const double hour = 3600.0, rate = perHour / hour;
+
+    auto t0 = std::chrono::steady_clock::now();
+    double t = 0.0, platformed = 0.0, sumTime = 0.0;
+    double nextArrival = -std::log(interiorRand(in)) / rate;
+    // Step in 16 ms ticks like the real-time loop
+    for (; t < hour; t += DT)
+    {
+        while (nextArrival <= t + DT)
+        {
+            interiorArrive(in, nextArrival, 80.0f, 0.0f, 0.0f);
+            nextArrival += -std::log(interiorRand(in)) / rate;
+        }
+        advanceInterior(in, t + DT, [&](const QPax& p, float, double at)
+        {
+            platformed += 1.0;
+            sumTime += at - p.tapAt;
+        });
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+    std::printf("interior: %.0f pax/h, %llu events, %.0f reached platform, %d still inside\n",
+                perHour, (unsigned long long)in.processed, platformed, in.inside);
+    std::printf("mean gate-to-platform time %.1f s\n", platformed > 0 ? sumTime / platformed : 0.0);
+    std::printf("simulated 3600 s in %.1f ms wall (%.0fx real time)\n", ms, hour * 1000.0 / ms);
+    for (auto &n : in.nodes)
+        std::printf("  %-10s servers %-3d served %-7llu mean wait %6.2f s  max queue %zu\n",
+                    n.name, n.servers, (unsigned long long)n.served,
+                    n.served ? n.waitSum / n.served : 0.0, n.maxQueue);
+}
+#endif
+
+// --------------------------- Train + Passengers (State Machine) ---------------------------
+// Train door target x (in world coords)
+static float trainDoorWorldX(const Sim& sim)
 {
     // Door placed on 2nd coach area.
-    // Door local x is around 240 from train origin (gTrainX)
-    return gTrainX + 240.0f;
+    // Door local x is around 240 from train origin (trainX)
+    return sim.trainX + 240.0f;
+}
+
+static void addPassenger(Sim& sim, float x, float speed, float legPhase)
+{
+    Passenger p;
+    p.x = x; p.y = 170.0f; p.speed = speed; p.legPhase = legPhase;
+
+    // Reuse a boarded slot before growing the pool (its grid cell is
+    // kept so the crowd counts can still remove it)
+    for (auto &q : sim.passengers)
+        if (!q.active) { p.cell = q.cell; q = p; return; }
+    sim.passengers.push_back(p);
+}
+
+static void spawnPassengers(Sim& sim)
+{
+    // With a tap log, riders arrive from the records instead
+    if (tapsEnabled(sim)) return;
+
+    // Up to four riders tap in at the gates each cycle, following the
+    // day clock's demand profile (two at mid-morning)
+    int riders = iround(4.0f * sim.light.demand);
+    for (int i = 0; i < riders; i++)
+        interiorArrive(sim.station, sim.time, 90.0f - 10.0f * (i & 1) - 4.0f * (i >> 1),
+                       1.2f * i, 30.0f * i);
+}
+
+// Observes each rider leaving the interior; `at` is when it reaches the platform
+typedef std::function<void(const QPax& p, double at)> ArrivalFn;
+
+// Riders reaching the platform from the station interior. The interior
+// reports them when they leave their last server; they appear only at `at`,
+// after the transit (stairs) that follows it.
+static void updateStationInterior(Sim& sim, const ArrivalFn& onArrival = nullptr)
+{
+    advanceInterior(sim.station, sim.time, [&](const QPax& p, float x, double at)
+    {
+        sim.arriving.push_back({ at, x + p.offset, p.speed, p.legPhase });
+        if (onArrival) onArrival(p, at);
+    });
+    size_t kept = 0;
+    for (size_t i = 0; i < sim.arriving.size(); i++)
+    {
+        const Arriving a = sim.arriving[i];
+        if (a.at <= sim.time) addPassenger(sim, a.x, a.speed, a.legPhase);
+        else sim.arriving[kept++] = a;
+    }
+    sim.arriving.resize(kept);
+}
+
+// --------------------------- Tap Record Streaming ---------------------------
+// Fare-gate logs can be tens of GB, so the file is read through a fixed-size
+// window (mmap where available, a read buffer otherwise). Records are parsed
+// just ahead of the sim clock into a bounded spawn queue: memory use does not
+// depend on file size.
+// Index of the lowest set bit; v != 0
+static inline int lowBit(unsigned v)
+{
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward(&i, v);
+    return (int)i;
+#else
+    return __builtin_ctz(v);
+#endif
+}
+
+// Find next byte c in [p, end); SSE2 compares 16 bytes per step
+static const char* scanByte(const char* p, const char* end, char c)
+{
+#ifdef METRO_SSE2
+    const __m128i needle = _mm_set1_epi8(c);
+    while (end - p >= 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+        if (mask) return p + lowBit((unsigned)mask);
+        p += 16;
+    }
+#endif
+    const void* r = std::memchr(p, c, (size_t)(end - p));
+    return r ? (const char*)r : end;
+}
+
+// 64-bit file offsets for the read-buffer path (long is 32 bits on Windows)
+static int seekFile(FILE* f, uint64_t off, int whence)
+{
+#ifdef _WIN32
+    return _fseeki64(f, (__int64)off, whence);
+#else
+    return fseeko(f, (off_t)off, whence);
+#endif
+}
+
+#ifndef METRO_MMAP
+static uint64_t tellFile(FILE* f)
+{
+#ifdef _WIN32
+    return (uint64_t)_ftelli64(f);
+#else
+    return (uint64_t)ftello(f);
+#endif
+}
+#endif
+
+static void tapUnmap(TapStream& s)
+{
+#ifdef METRO_MMAP
+    if (s.win && s.fd >= 0) munmap((void*)s.win, s.winLen);
+#endif
+    s.win = nullptr;
+    s.winLen = 0;
+}
+
+// Move the window so that it starts at file offset `off`
+static bool tapMapAt(TapStream& s, uint64_t off)
+{
+    tapUnmap(s);
+    if (off >= s.fileSize) return false;
+
+#ifdef METRO_MMAP
+    if (s.fd >= 0)
+    {
+        static const uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+        uint64_t aligned = off - off % page;
+        size_t len = (size_t)std::min<uint64_t>(TAP_WINDOW, s.fileSize - aligned);
+        void* p = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, s.fd, (off_t)aligned);
+        if (p == MAP_FAILED) return false;
+        madvise(p, len, MADV_SEQUENTIAL);
+        s.win = (const char*)p;
+        s.winLen = len;
+        s.winOff = aligned;
+        s.cur = (size_t)(off - aligned);
+        return true;
+    }
+#endif
+    s.buf.resize(TAP_WINDOW);
+    if (seekFile(s.fp, off, SEEK_SET) != 0) return false;
+    s.winLen = std::fread(s.buf.data(), 1, TAP_WINDOW, s.fp);
+    s.win = s.buf.data();
+    s.winOff = off;
+    s.cur = 0;
+    return s.winLen > 0;
+}
+
+static bool openTapStream(TapStream& s, const char* path)
+{
+#ifdef METRO_MMAP
+    s.fd = open(path, O_RDONLY);
+    if (s.fd < 0) return false;
+    struct stat st;
+    if (fstat(s.fd, &st) != 0) { close(s.fd); s.fd = -1; return false; }
+    s.fileSize = (uint64_t)st.st_size;
+#else
+    s.fp = std::fopen(path, "rb");
+    if (!s.fp) return false;
+    seekFile(s.fp, 0, SEEK_END);
+    s.fileSize = tellFile(s.fp);
+#endif
+    s.eof = !tapMapAt(s, 0);
+    return true;
+}
+
+static void closeTapStream(TapStream& s)
+{
+    tapUnmap(s);
+#ifdef METRO_MMAP
+    if (s.fd >= 0) close(s.fd);
+#endif
+    if (s.fp) std::fclose(s.fp);
+    s.fd = -1;
+    s.fp = nullptr;
+    s.eof = true;
+    s.queue.clear();
+}
+
+// Parse "<seconds>[.<frac>],<card>,..." ; returns false for header/bad lines
+static bool parseTapLine(const char* p, const char* end, double& t, uint32_t& card)
+{
+    const char* comma = scanByte(p, end, ',');
+
+    double v = 0.0, scale = 0.0;
+    bool digits = false;
+    for (const char* q = p; q < comma; q++)
+    {
+        char c = *q;
+        if (c >= '0' && c <= '9')
+        {
+            digits = true;
+            if (scale == 0.0) v = v * 10.0 + (c - '0');
+            else { v += (c - '0') * scale; scale *= 0.1; }
+        }
+        else if (c == '.' && scale == 0.0) scale = 0.1;
+        else if (c != ' ' && c != '\r') return false;
+    }
+    if (!digits) return false;
+    t = v;
+
+    // FNV-1a over the card field
+    uint32_t h = 2166136261u;
+    if (comma < end)
+    {
+        const char* fieldEnd = scanByte(comma + 1, end, ',');
+        for (const char* q = comma + 1; q < fieldEnd; q++)
+            h = (h ^ (uint8_t)*q) * 16777619u;
+    }
+    card = h;
+    return true;
+}
+
+// Parse records until the queue covers the lookahead horizon (or is full)
+static void refillTapQueue(TapStream& s, double horizon)
+{
+    bool slid = false;
+    while (!s.eof && s.queue.size() < TAP_QUEUE_MAX)
+    {
+        if (!s.queue.empty() && s.queue.back().t > horizon) break;
+
+        const char* p = s.win + s.cur;
+        const char* end = s.win + s.winLen;
+        const char* nl = scanByte(p, end, '\n');
+
+        bool lastWindow = s.winOff + s.winLen >= s.fileSize;
+        if (nl == end && !lastWindow)
+        {
+            // Record straddles the window edge: slide window to line start
+            uint64_t lineOff = s.winOff + s.cur;
+            if (slid)
+            {
+                // Line longer than the window: skip past its newline and
+                // count it with the malformed lines
+                s.skipped++;
+                slid = false;
+                bool found = false;
+                while (!found && tapMapAt(s, s.winOff + s.winLen))
+                {
+                    const char* q = scanByte(s.win + s.cur, s.win + s.winLen, '\n');
+                    if (q < s.win + s.winLen) { s.cur = (size_t)(q - s.win) + 1; found = true; }
+                }
+                if (!found || (s.cur >= s.winLen && !tapMapAt(s, s.winOff + s.winLen))) { s.eof = true; break; }
+                continue;
+            }
+            if (!tapMapAt(s, lineOff)) { s.eof = true; break; }
+            slid = true;
+            continue;
+        }
+
+        double t;
+        uint32_t card;
+        if (p < nl && parseTapLine(p, nl, t, card))
+        {
+            if (!s.haveBase) { s.baseT = t; s.haveBase = true; }
+            s.queue.push_back({ t - s.baseT, card });
+            s.records++;
+        }
+        else if (p < nl) s.skipped++;
+
+        slid = false;
+        s.cur = (size_t)(nl - s.win) + 1;
+        if (s.cur >= s.winLen)
+        {
+            if (lastWindow || !tapMapAt(s, s.winOff + s.winLen)) s.eof = true;
+        }
+    }
+
+    if (s.eof) tapUnmap(s);
+}
+
+// Spawn riders whose tap time has been reached by the sim clock
+static void updateTapSpawns(Sim& sim)
+{
+    if (!tapsEnabled(sim)) return;
+
+    refillTapQueue(sim.taps, sim.time + TAP_LOOKAHEAD);
+    while (!sim.taps.queue.empty() && sim.taps.queue.front().t <= sim.time)
+    {
+        uint32_t h = sim.taps.queue.front().card;
+        sim.taps.queue.pop_front();
+
+        // Through the gates; the exit used decides the platform position
+        float offset = (float)(h % 60u) - 30.0f;
+        float speed = 70.0f + (float)((h >> 8) % 40u);
+        interiorArrive(sim.station, sim.time, speed, (float)((h >> 16) % 628u) * 0.01f, offset);
+    }
+}
+
+// Draw passenger (simple body + head circle), walking legs by tiny rotation
+static void drawPassenger(const Sim& sim, const Passenger& p, float scale = 1.0f)
+{
+    if (!p.active) return;
+
+    gfxPush();
+    gfxTranslate(p.x, p.y);       // Translation (required)
+    gfxScale(scale, scale);    // Scaling (required)
+
+    // Body
+    if (!sim.night) setColor(0.20f, 0.35f, 0.85f);
+    else         setColor(0.35f, 0.55f, 0.95f);
+    rectFilled(-6, 0, 12, 26);
+
+    // Head (midpoint circle)
+    gfxPointSize(2.0f);
+    beginPoints();
+    if (!sim.night) setColor(1.0f, 0.85f, 0.70f);
+    else         setColor(0.95f, 0.80f, 0.65f);
+    circleMidpoint(0, 34, 8);
+    endPoints();
+
+    // Legs (animated)
+    float a = std::sin(p.legPhase) * 22.0f; // +- degrees
+    if (!sim.night) setColor(0.10f, 0.10f, 0.12f);
+    else         setColor(0.85f, 0.85f, 0.90f);
+
+    // Left leg
+    gfxPush();
+    gfxTranslate(-3, 0);
+    gfxRotate(a);
+    rectFilled(-2, -14, 4, 14);
+    gfxPop();
+
+    // Right leg
+    gfxPush();
+    gfxTranslate(3, 0);
+    gfxRotate(-a);
+    rectFilled(-2, -14, 4, 14);
+    gfxPop();
+
+    gfxPop();
+}
+
+// Draw wheels (rotation required)
+static void drawWheel(const Sim& sim, float cx, float cy, float r)
+{
+    // Wheel outline via midpoint circle, spokes via DDA
+    gfxPush();
+    gfxTranslate(cx, cy);
+    gfxRotate(sim.wheelAngle);  // Rotation (required)
+
+    if (!sim.night) setColor(0.05f, 0.05f, 0.05f);
+    else         setColor(0.90f, 0.90f, 0.95f);
+
+    gfxPointSize(2.0f);
+    beginPoints();
+    circleMidpoint(0, 0, (int)r);
+    // Spokes (DDA)
+    lineDDA(0, 0, r, 0);
+    lineDDA(0, 0, -r, 0);
+    lineDDA(0, 0, 0, r);
+    lineDDA(0, 0, 0, -r);
+    endPoints();
+
+    gfxPop();
+}
+
+// Train drawing with multiple coaches + doors
+static void drawTrain(const Sim& sim)
+{
+    gfxPush();
+    gfxTranslate(sim.trainX, TRAIN_Y); // Translation (required)
+
+    // Coaches
+    const int coaches = 3;
+    const float coachW = 170.0f;
+    const float coachH = 70.0f;
+    const float gap = 8.0f;
+
+    for (int i = 0; i < coaches; i++)
+    {
+        float ox = i * (coachW + gap);
+
+        // Body
+        if (!sim.night) setColor(0.92f, 0.22f, 0.22f);
+        else         setColor(0.75f, 0.18f, 0.20f);
+        rectFilled(ox, 20, coachW, coachH);
+
+        // Roof
+        if (!sim.night) setColor(0.80f, 0.15f, 0.15f);
+        else         setColor(0.60f, 0.12f, 0.14f);
+        rectFilled(ox, 85, coachW, 12);
+
+        // Window strip
+        if (!sim.night) setColor(0.55f, 0.75f, 0.95f);
+        else         setColor(0.95f, 0.85f, 0.40f);
+        rectFilled(ox + 15, 55, coachW - 30, 22);
+
+        // Outline using Bresenham (required)
+        if (!sim.night) setColor(0.20f, 0.20f, 0.22f);
+        else         setColor(0.85f, 0.85f, 0.90f);
+        gfxPointSize(2.0f);
+        rectOutlineBresenham((int)ox, 20, (int)coachW, (int)coachH + 12);
+
+        // Doors on middle coach only (i==1)
+        if (i == 1)
+        {
+            float doorX = ox + 65;
+            float doorY = 22;
+            float doorW = 40;
+            float doorH = 65;
+
+            // Door frame
+            if (!sim.night) setColor(0.18f, 0.18f, 0.20f);
+            else         setColor(0.90f, 0.90f, 0.95f);
+            rectOutline(doorX, doorY, doorW, doorH);
+
+            // Sliding doors: left + right panels move outward as sim.doorOpen increases
+            float slide = (doorW * 0.5f) * sim.doorOpen;
+
+            // Left panel
+            if (!sim.night) setColor(0.93f, 0.93f, 0.95f);
+            else         setColor(0.30f, 0.30f, 0.35f);
+            rectFilled(doorX, doorY, doorW * 0.5f - slide, doorH);
+
+            // Right panel
+            rectFilled(doorX + doorW * 0.5f + slide, doorY,
+                       doorW * 0.5f - slide, doorH);
+        }
+    }
+
+    // Front cabin (extra)
+    if (!sim.night) setColor(0.85f, 0.20f, 0.20f);
+    else         setColor(0.65f, 0.16f, 0.18f);
+    rectFilled(coaches * (coachW + gap), 30, 70, 60);
+
+    // Cabin window
+    if (!sim.night) setColor(0.55f, 0.75f, 0.95f);
+    else         setColor(0.95f, 0.85f, 0.40f);
+    rectFilled(coaches * (coachW + gap) + 20, 60, 35, 18);
+
+    // Wheels (under each coach)
+    for (int i = 0; i < coaches; i++)
+    {
+        float ox = i * (coachW + gap);
+        drawWheel(sim, ox + 35, 18, 12);
+        drawWheel(sim, ox + coachW - 35, 18, 12);
+    }
+    // Wheels under cabin
+    drawWheel(sim, coaches * (coachW + gap) + 20, 18, 12);
+    drawWheel(sim, coaches * (coachW + gap) + 55, 18, 12);
+
+    gfxPop();
+}
+
+// --------------------------- Station Network / Travel Times ---------------------------
+// Station graph (undirected segments, run time in whole seconds) and the
+// all-pairs shortest travel-time matrix used by routing, demand and the
+// dashboard. The matrix is a flat row-major uint32 array with rows padded
+// to 64 bytes so each source row starts on its own cache line.
+static const uint32_t TT_INF = 0x3fffffffu;
+static const uint32_t SEG_MAX_SECS = 86400;   // keeps path sums far below TT_INF
+
+struct Segment
+{
+    int a, b;
+    uint32_t secs;
+};
+
+struct Network
+{
+    std::vector<std::string> names;
+    std::vector<Segment> segs;
+
+    // CSR adjacency: neighbours of s are adj[off[s] .. off[s+1])
+    std::vector<int> off;
+    std::vector<int> adjTo;
+    std::vector<int> adjSeg;
+
+    int n = 0;
+    int stride = 0;                  // padded row length (elements)
+    std::vector<uint32_t> tt;        // n * stride travel times
+
+    uint32_t time(int s, int t) const { return tt[(size_t)s * stride + t]; }
+};
+
+static Network gNet;
+
+#ifndef METRO_LIBRARY
+static int stationIndex(Network& net, const std::string& name)
+{
+    for (int i = 0; i < (int)net.names.size(); i++)
+        if (net.names[i] == name) return i;
+    net.names.push_back(name);
+    return (int)net.names.size() - 1;
+}
+
+static void addSegment(Network& net, const std::string& a, const std::string& b, uint32_t secs)
+{
+    int ia = stationIndex(net, a);
+    int ib = stationIndex(net, b);
+    net.segs.push_back({ ia, ib, secs });
+}
+
+// Two crossing lines sharing an interchange
+static void defaultNetwork(Network& net)
+{
+    const char* red[]  = { "Harbor", "Market", "Central", "Museum", "Park", "Airport" };
+    const char* blue[] = { "North", "College", "Central", "Stadium", "South" };
+    const uint32_t redT[]  = { 95, 80, 110, 90, 240 };
+    const uint32_t blueT[] = { 120, 75, 85, 130 };
+    for (int i = 0; i < 5; i++) addSegment(net, red[i], red[i + 1], redT[i]);
+    for (int i = 0; i < 4; i++) addSegment(net, blue[i], blue[i + 1], blueT[i]);
+}
+
+// One segment per line: "<from>,<to>,<seconds>"
+static bool loadNetwork(Network& net, const char* path)
+{
+    FILE* f = std::fopen(path, "r");
+    if (!f) return false;
+    char line[512];
+    while (std::fgets(line, sizeof line, f))
+    {
+        char a[200], b[200];
+        unsigned secs;
+        if (std::sscanf(line, " %199[^,],%199[^,],%u", a, b, &secs) == 3)
+            addSegment(net, a, b, std::min<uint32_t>(secs, SEG_MAX_SECS));
+    }
+    std::fclose(f);
+    return !net.segs.empty();
+}
+
+static void buildAdjacency(Network& net)
+{
+    net.n = (int)net.names.size();
+    net.off.assign(net.n + 1, 0);
+    for (auto &s : net.segs) { net.off[s.a + 1]++; net.off[s.b + 1]++; }
+    for (int i = 0; i < net.n; i++) net.off[i + 1] += net.off[i];
+
+    net.adjTo.resize(net.off[net.n]);
+    net.adjSeg.resize(net.off[net.n]);
+    std::vector<int> fill(net.off.begin(), net.off.end() - 1);
+    for (int e = 0; e < (int)net.segs.size(); e++)
+    {
+        const Segment& s = net.segs[e];
+        net.adjTo[fill[s.a]] = s.b; net.adjSeg[fill[s.a]++] = e;
+        net.adjTo[fill[s.b]] = s.a; net.adjSeg[fill[s.b]++] = e;
+    }
+}
+
+// Single-source Dijkstra writing straight into the source's matrix row
+static void dijkstraRow(const Network& net, int src, uint32_t* row)
+{
+    typedef std::pair<uint32_t, int> Item;
+    std::priority_queue<Item, std::vector<Item>, std::greater<Item>> pq;
+
+    std::fill(row, row + net.n, TT_INF);
+    row[src] = 0;
+    pq.push({ 0, src });
+    while (!pq.empty())
+    {
+        Item it = pq.top(); pq.pop();
+        int u = it.second;
+        if (it.first != row[u]) continue;
+        for (int k = net.off[u]; k < net.off[u + 1]; k++)
+        {
+            int v = net.adjTo[k];
+            uint32_t d = it.first + net.segs[net.adjSeg[k]].secs;
+            if (d < row[v]) { row[v] = d; pq.push({ d, v }); }
+        }
+    }
+}
+#endif
+
+// Run fn(i) for i in [0, count) over the hardware threads
+template <class Fn>
+static void parallelFor(int count, Fn fn)
+{
+    int threads = (int)std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min(threads, count);
+    if (threads <= 1) { for (int i = 0; i < count; i++) fn(i); return; }
+
+    std::atomic<int> next(0);
+    auto worker = [&]() { for (int i; (i = next++) < count; ) fn(i); };
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; t++) pool.emplace_back(worker);
+    worker();
+    for (auto &t : pool) t.join();
+}
+
+// Long-lived workers for jobs submitted over time
+struct ThreadPool
+{
+    std::vector<std::thread> workers;
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> q;
+    bool stop = false;
+
+    explicit ThreadPool(int threads)
+    {
+        for (int i = 0; i < threads; i++)
+            workers.emplace_back([this]()
+            {
+                for (;;)
+                {
+                    std::function<void()> job;
+                    {
+                        std::unique_lock<std::mutex> lk(m);
+                        cv.wait(lk, [this]() { return stop || !q.empty(); });
+                        if (stop && q.empty()) return;
+                        job = std::move(q.front());
+                        q.pop_front();
+                    }
+                    job();
+                }
+            });
+    }
+
+    ~ThreadPool()
+    {
+        { std::lock_guard<std::mutex> lk(m); stop = true; }
+        cv.notify_all();
+        for (auto &t : workers) t.join();
+    }
+
+    void submit(std::function<void()> job)
+    {
+        { std::lock_guard<std::mutex> lk(m); q.push_back(std::move(job)); }
+        cv.notify_one();
+    }
+
+    // Run one queued job on the calling thread; false if none was queued
+    bool helpOne()
+    {
+        std::function<void()> job;
+        {
+            std::lock_guard<std::mutex> lk(m);
+            if (q.empty()) return false;
+            job = std::move(q.front());
+            q.pop_front();
+        }
+        job();
+        return true;
+    }
+};
+
+#ifndef METRO_LIBRARY
+static void buildTravelMatrix(Network& net)
+{
+    buildAdjacency(net);
+    net.stride = (net.n + 15) & ~15;
+    net.tt.assign((size_t)net.n * net.stride, TT_INF);
+    parallelFor(net.n, [&](int s) { dijkstraRow(net, s, &net.tt[(size_t)s * net.stride]); });
+}
+
+// Change one segment's run time and repair the matrix in place.
+// Decrease: every pair can only improve through the segment, O(n^2).
+// Increase: only sources whose shortest-path tree used it are re-run.
+static void setSegmentTime(Network& net, int e, uint32_t secs)
+{
+    Segment& seg = net.segs[e];
+    secs = std::min(secs, SEG_MAX_SECS);
+    uint32_t old = seg.secs;
+    if (secs == old) return;
+    seg.secs = secs;
+
+    const int a = seg.a, b = seg.b;
+    if (secs < old)
+    {
+        std::vector<uint32_t> rowA(net.tt.begin() + (size_t)a * net.stride,
+                                   net.tt.begin() + (size_t)a * net.stride + net.n);
+        std::vector<uint32_t> rowB(net.tt.begin() + (size_t)b * net.stride,
+                                   net.tt.begin() + (size_t)b * net.stride + net.n);
+        parallelFor(net.n, [&](int s)
+        {
+            uint32_t* row = &net.tt[(size_t)s * net.stride];
+            uint32_t viaA = rowA[s] + secs;   // s -> a -> b (undirected: d(s,a) == d(a,s))
+            uint32_t viaB = rowB[s] + secs;   // s -> b -> a
+            for (int t = 0; t < net.n; t++)
+            {
+                uint32_t d = std::min(viaA + rowB[t], viaB + rowA[t]);
+                if (d < row[t]) row[t] = d;
+            }
+        });
+        return;
+    }
+
+    std::vector<int> affected;
+    for (int s = 0; s < net.n; s++)
+    {
+        uint32_t da = net.time(s, a), db = net.time(s, b);
+        if (da != TT_INF && (da + old == db || db + old == da)) affected.push_back(s);
+    }
+    parallelFor((int)affected.size(), [&](int i)
+    {
+        int s = affected[i];
+        dijkstraRow(net, s, &net.tt[(size_t)s * net.stride]);
+    });
+}
+
+static void printTravelTimes(const Network& net)
+{
+    std::printf("%-10s", "");
+    for (int t = 0; t < net.n; t++) std::printf(" %8.8s", net.names[t].c_str());
+    std::printf("\n");
+    for (int s = 0; s < net.n; s++)
+    {
+        std::printf("%-10.10s", net.names[s].c_str());
+        for (int t = 0; t < net.n; t++)
+        {
+            uint32_t d = net.time(s, t);
+            if (d == TT_INF) std::printf(" %8s", "-");
+            else             std::printf(" %5u:%02u", d / 60, d % 60);
+        }
+        std::printf("\n");
+    }
+}
+#endif
+
+// --------------------------- Timetable Delay Propagation ---------------------------
+// The timetable as an event-activity graph: every arrival and departure is
+// an event, and activities (run, dwell, headway, transfer) link them. Each
+// activity has a minimum duration; its scheduled duration adds a buffer. An
+// event happens at max(scheduled + its own delay, predecessor + minimum) over
+// its incoming activities. Events are numbered in scheduled-time order,
+// which is a topological order because every minimum is positive. A delay
+// is pushed through a min-heap of event numbers, and only an event whose
+// time changed wakes its successors, so propagation stops where slack
+// absorbs the delay. Lines are maximal chains of consecutive segments in
+// network order; each runs both ways from 05:30 to 00:30.
+static const int32_t TT_FIRST = 5 * 3600 + 1800, TT_LAST = 24 * 3600 + 1800;
+static const int32_t TT_HEADWAY = 300, TT_MIN_HEADWAY = 90;
+static const int32_t TT_DWELL = 30, TT_MIN_DWELL = 20;
+static const int32_t TT_TRANSFER = 120, TT_MIN_TRANSFER = 60;
+
+struct TtTrip
+{
+    int32_t from, to;          // terminal stations
+    int32_t dep, arr;          // scheduled seconds of day
+};
+
+struct Timetable
+{
+    int n = 0;
+    std::vector<int32_t> sched, time, delay;   // per event, seconds of day
+    std::vector<int32_t> station, trip;
+    std::vector<uint8_t> dep;                  // departure (1) or arrival (0)
+    int trips = 0;
+    std::vector<TtTrip> runs;                  // per trip, end to end
+
+    // CSR both ways: out[outOff[e] .. outOff[e+1]), in likewise
+    std::vector<int32_t> outOff, outTo, outMin;
+    std::vector<int32_t> inOff, inFrom, inMin;
+
+    // Propagation scratch
+    std::vector<uint8_t> queued;
+};
+
+struct TtLine
+{
+    std::vector<int> stations;
+    std::vector<uint32_t> secs;    // run time to the next station
+};
+
+#ifndef METRO_LIBRARY
+static std::vector<TtLine> networkLines(const Network& net)
+{
+    std::vector<TtLine> lines;
+    for (size_t i = 0; i < net.segs.size(); i++)
+    {
+        const Segment& s = net.segs[i];
+        if (i == 0 || net.segs[i - 1].b != s.a)
+        {
+            lines.push_back(TtLine());
+            lines.back().stations.push_back(s.a);
+        }
+        lines.back().stations.push_back(s.b);
+        lines.back().secs.push_back(s.secs);
+    }
+    return lines;
+}
+
+static void buildTimetable(Timetable& tt, const Network& net)
+{
+    struct Act { int32_t from, to, min; };
+    std::vector<Act> acts;
+    std::vector<int32_t> sched, station, trip;
+    std::vector<uint8_t> dep;
+    auto event = [&](int32_t t, int st, int tr, bool d)
+    {
+        sched.push_back(t); station.push_back(st); trip.push_back(tr); dep.push_back(d);
+        return (int32_t)sched.size() - 1;
+    };
+
+    // Departures per station and line direction, for transfers
+    struct Dep { int32_t t, e; };
+    std::vector<std::vector<std::vector<Dep>>> deps(net.segs.empty() ? 0 : net.names.size());
+    std::vector<Dep> arrivals;
+    std::vector<int> arrivalDir;
+
+    std::vector<TtLine> lines = networkLines(net);
+    int nDir = (int)lines.size() * 2, tripId = 0;
+    for (auto &d : deps) d.resize(nDir);
+    for (int l = 0; l < (int)lines.size(); l++)
+        for (int dir = 0; dir < 2; dir++)
+        {
+            TtLine line = lines[l];
+            if (dir)
+            {
+                std::reverse(line.stations.begin(), line.stations.end());
+                std::reverse(line.secs.begin(), line.secs.end());
+            }
+            int ld = 2 * l + dir;
+            int32_t offset = (l * 97 + dir * 150) % TT_HEADWAY;   // stagger the lines
+            std::vector<int32_t> prevDep;                          // previous trip's departures
+            for (int32_t start = TT_FIRST + offset; start <= TT_LAST; start += TT_HEADWAY, tripId++)
+            {
+                std::vector<int32_t> depE;
+                int32_t t = start;
+                for (size_t i = 0; i < line.stations.size(); i++)
+                {
+                    int st = line.stations[i];
+                    if (i > 0)
+                    {
+                        int32_t run = (int32_t)line.secs[i - 1];
+                        int32_t a = event(t += run + (run + 19) / 20, st, tripId, false);   // 5% running buffer
+                        acts.push_back({ depE.back(), a, run });
+                        if (i + 1 == line.stations.size()) break;
+                        arrivals.push_back({ t, a });
+                        arrivalDir.push_back(ld);
+                        int32_t d = event(t += TT_DWELL, st, tripId, true);
+                        acts.push_back({ a, d, TT_MIN_DWELL });
+                        depE.push_back(d);
+                    }
+                    else depE.push_back(event(t, st, tripId, true));
+                    deps[st][ld].push_back({ sched[depE.back()], depE.back() });
+                }
+                tt.runs.push_back({ line.stations.front(), line.stations.back(), start, t });
+                for (size_t i = 0; i < prevDep.size() && i < depE.size(); i++)
+                    acts.push_back({ prevDep[i], depE[i], TT_MIN_HEADWAY });
+                prevDep = depE;
+            }
+        }
+    tt.trips = tripId;
+
+    // Transfers: an arrival holds the next departure of every other line
+    // direction at that station scheduled at least TT_TRANSFER later
+    for (size_t i = 0; i < arrivals.size(); i++)
+    {
+        int st = station[arrivals[i].e];
+        for (int ld = 0; ld < nDir; ld++)
+        {
+            if (ld / 2 == arrivalDir[i] / 2) continue;
+            const std::vector<Dep>& ds = deps[st][ld];
+            auto it = std::lower_bound(ds.begin(), ds.end(), arrivals[i].t + TT_TRANSFER,
+                                       [](const Dep& d, int32_t t) { return d.t < t; });
+            if (it != ds.end()) acts.push_back({ arrivals[i].e, it->e, TT_MIN_TRANSFER });
+        }
+    }
+
+    // Renumber in scheduled order (topological), then build both CSRs
+    int n = (int)sched.size();
+    std::vector<int32_t> order(n), rank(n);
+    for (int i = 0; i < n; i++) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](int32_t a, int32_t b) { return sched[a] < sched[b]; });
+    for (int i = 0; i < n; i++) rank[order[i]] = i;
+
+    tt.n = n;
+    tt.sched.resize(n); tt.station.resize(n); tt.trip.resize(n); tt.dep.resize(n);
+    for (int i = 0; i < n; i++)
+    {
+        tt.sched[i] = sched[order[i]]; tt.station[i] = station[order[i]];
+        tt.trip[i] = trip[order[i]]; tt.dep[i] = dep[order[i]];
+    }
+    tt.outOff.assign(n + 1, 0);
+    tt.inOff.assign(n + 1, 0);
+    for (auto &a : acts) { a.from = rank[a.from]; a.to = rank[a.to]; tt.outOff[a.from + 1]++; tt.inOff[a.to + 1]++; }
+    for (int i = 0; i < n; i++) { tt.outOff[i + 1] += tt.outOff[i]; tt.inOff[i + 1] += tt.inOff[i]; }
+    tt.outTo.resize(acts.size()); tt.outMin.resize(acts.size());
+    tt.inFrom.resize(acts.size()); tt.inMin.resize(acts.size());
+    std::vector<int32_t> fo(tt.outOff.begin(), tt.outOff.end() - 1), fi(tt.inOff.begin(), tt.inOff.end() - 1);
+    for (auto &a : acts)
+    {
+        tt.outTo[fo[a.from]] = a.to; tt.outMin[fo[a.from]++] = a.min;
+        tt.inFrom[fi[a.to]] = a.from; tt.inMin[fi[a.to]++] = a.min;
+    }
+
+    tt.delay.assign(n, 0);
+    tt.time = tt.sched;
+    tt.queued.assign(n, 0);
+}
+
+static int32_t eventTime(const Timetable& tt, int v)
+{
+    int32_t t = tt.sched[v] + tt.delay[v];
+    for (int k = tt.inOff[v]; k < tt.inOff[v + 1]; k++)
+        t = std::max(t, tt.time[tt.inFrom[k]] + tt.inMin[k]);
+    return t;
+}
+
+// Every event in order: the reference the incremental update must match
+static void propagateAll(Timetable& tt)
+{
+    for (int v = 0; v < tt.n; v++) tt.time[v] = eventTime(tt, v);
+}
+
+// Set event e's own (source) delay, which may also shrink it, and repair
+// only the events whose time changes. Returns the events re-evaluated.
+static int setEventDelay(Timetable& tt, int e, int32_t secs)
+{
+    tt.delay[e] = secs;
+    std::priority_queue<int32_t, std::vector<int32_t>, std::greater<int32_t>> heap;
+    heap.push(e);
+    tt.queued[e] = 1;
+    int touched = 0;
+    while (!heap.empty())
+    {
+        int v = heap.top();
+        heap.pop();
+        tt.queued[v] = 0;
+        touched++;
+        int32_t t = eventTime(tt, v);
+        if (t == tt.time[v]) continue;             // absorbed: cut off here
+        tt.time[v] = t;
+        for (int k = tt.outOff[v]; k < tt.outOff[v + 1]; k++)
+        {
+            int w = tt.outTo[k];
+            if (!tt.queued[w]) { tt.queued[w] = 1; heap.push(w); }
+        }
+    }
+    return touched;
+}
+
+static void delayStats(const Timetable& tt, int& late, int& trips, int64_t& totalSecs)
+{
+    late = 0; totalSecs = 0;
+    std::vector<uint8_t> tripLate(tt.trips, 0);
+    for (int v = 0; v < tt.n; v++)
+        if (tt.time[v] > tt.sched[v]) { late++; totalSecs += tt.time[v] - tt.sched[v]; tripLate[tt.trip[v]] = 1; }
+    trips = 0;
+    for (uint8_t t : tripLate) trips += t;
+}
+
+// Square grid of crossing lines: side x side stations, 2 * side lines
+static void gridNetwork(Network& net, int side)
+{
+    auto name = [](int r, int c) { return std::to_string(r) + "/" + std::to_string(c); };
+    for (int r = 0; r < side; r++)
+        for (int c = 0; c + 1 < side; c++) addSegment(net, name(r, c), name(r, c + 1), 90 + (r * 7 + c * 13) % 60);
+    for (int c = 0; c < side; c++)
+        for (int r = 0; r + 1 < side; r++) addSegment(net, name(r, c), name(r + 1, c), 90 + (c * 11 + r * 5) % 60);
+}
+
+static void benchTimetable(const char* label, const Network& net, int disruptions)
+{
+    Timetable tt;
+    auto t0 = std::chrono::steady_clock::now();
+    buildTimetable(tt, net);
+    auto t1 = std::chrono::steady_clock::now();
+    propagateAll(tt);
+    auto t2 = std::chrono::steady_clock::now();
+    auto us = [](std::chrono::steady_clock::time_point a, std::chrono::steady_clock::time_point b)
+    {
+        return std::chrono::duration<double, std::micro>(b - a).count();
+    };
+    std::printf("%s: %zu lines, %d trips, %d events, %zu activities; built in %.1f ms, "
+                "full propagation %.0f us\n", label, networkLines(net).size(), tt.trips, tt.n,
+                tt.outTo.size(), us(t0, t1) / 1000.0, us(t1, t2));
+
+    // Delay then recover one departure at a time
+    uint64_t rng = 0x243f6a8885a308d3ull;
+    auto next = [&]() { rng ^= rng >> 12; rng ^= rng << 25; rng ^= rng >> 27; return rng * 2685821657736338717ull; };
+    double sumUs = 0;
+    int64_t sumTouched = 0, sumLate = 0;
+    for (int i = 0; i < disruptions; i++)
+    {
+        int e = (int)(next() % (uint64_t)tt.n);
+        int32_t secs = 60 + (int32_t)(next() % 540);
+        auto a = std::chrono::steady_clock::now();
+        sumTouched += setEventDelay(tt, e, secs);
+        auto b = std::chrono::steady_clock::now();
+        sumUs += us(a, b);
+        int late, trips;
+        int64_t total;
+        if (i < 64) { delayStats(tt, late, trips, total); sumLate += late; }
+        setEventDelay(tt, e, 0);
+    }
+    std::printf("  %d disruptions (1-10 min): %.2f us each, %.0f events re-evaluated, "
+                "%.0f events late on average\n", disruptions, sumUs / disruptions,
+                (double)sumTouched / disruptions, (double)sumLate / std::min(disruptions, 64));
+
+    // Many delays at once: the incremental times must equal a full pass
+    std::vector<int32_t> held;
+    for (int i = 0; i < 200; i++)
+    {
+        int e = (int)(next() % (uint64_t)tt.n);
+        setEventDelay(tt, e, 60 + (int32_t)(next() % 900));
+        held.push_back(e);
+    }
+    for (int i = 0; i < 50; i++) setEventDelay(tt, held[i], 0);   // some recover
+    std::vector<int32_t> inc = tt.time;
+    propagateAll(tt);
+    std::printf("  200 concurrent delays, 50 recovered: incremental %s full propagation\n",
+                inc == tt.time ? "==" : "!=");
+}
+
+// --delay-bench <n>
+static void benchDelays(const Network& net, int disruptions)
+{
+    benchTimetable("network", net, disruptions);
+
+    // One departure from the busiest interchange, in the morning peak
+    Timetable tt;
+    buildTimetable(tt, net);
+    int best = -1;
+    for (int v = 0; v < tt.n && best < 0; v++)
+        if (tt.dep[v] && tt.sched[v] >= 8 * 3600 && net.off[tt.station[v] + 1] - net.off[tt.station[v]] > 2)
+            best = v;
+    if (best >= 0)
+    {
+        int touched = setEventDelay(tt, best, 180);
+        int late, trips;
+        int64_t total;
+        delayStats(tt, late, trips, total);
+        std::printf("  e.g. %s departure %02d:%02d held 3 min: %d events on %d trip(s) late, %.1f train-min "
+                    "in total (%d events re-evaluated)\n", net.names[tt.station[best]].c_str(),
+                    tt.sched[best] / 3600, tt.sched[best] / 60 % 60, late, trips, total / 60.0, touched);
+    }
+
+    Network grid;
+    gridNetwork(grid, 12);
+    buildAdjacency(grid);
+    benchTimetable("12x12 grid", grid, disruptions);
+}
+#endif
+
+// --------------------------- Rolling-Stock Circulation ---------------------------
+// Trips are linked into trainset circulations by a min-cost flow over a
+// time-space network. Each terminal has a time-ordered chain of nodes: a
+// trip needs a vehicle at its departure node and hands it back to its
+// destination's chain once the turnaround has passed. Vehicles wait along
+// a chain for free, may run empty to a terminal within DEADHEAD_MAX, and
+// cross the night through the yard, where the fleet is counted and capped.
+// Costs are lexicographic: trainsets first, then seconds of empty running.
+static const int32_t DEADHEAD_MAX = 900;
+static const int64_t TRAINSET_COST = 1000000000;
+
+struct FlowGraph
+{
+    struct Arc { int32_t to, cap; int64_t cost; };
+    std::vector<Arc> arcs;               // arc i pairs with its reverse i ^ 1
+    std::vector<int32_t> head, next;
+
+    int node() { head.push_back(-1); return (int)head.size() - 1; }
+    int arc(int a, int b, int32_t cap, int64_t cost)
+    {
+        arcs.push_back({ b, cap, cost });
+        next.push_back(head[a]); head[a] = (int32_t)arcs.size() - 1;
+        arcs.push_back({ a, 0, -cost });
+        next.push_back(head[b]); head[b] = (int32_t)arcs.size() - 1;
+        return (int)arcs.size() - 2;
+    }
+    int32_t flow(int a) const { return arcs[a ^ 1].cap; }
+};
+
+struct FlowSearch
+{
+    FlowGraph& g;
+    std::vector<int64_t> pi;             // node potentials
+    std::vector<int32_t> level, cur;
+    int t;
+
+    bool admissible(int u, const FlowGraph::Arc& e) const
+    {
+        return e.cap > 0 && e.cost + pi[u] - pi[e.to] == 0;
+    }
+
+    int32_t push(int u, int32_t f)
+    {
+        if (u == t) return f;
+        for (int32_t& a = cur[u]; a >= 0; a = g.next[a])
+        {
+            FlowGraph::Arc& e = g.arcs[a];
+            if (level[e.to] != level[u] + 1 || !admissible(u, e)) continue;
+            int32_t d = push(e.to, std::min(f, e.cap));
+            if (d > 0)
+            {
+                e.cap -= d;
+                g.arcs[a ^ 1].cap += d;
+                return d;
+            }
+        }
+        return 0;
+    }
+};
+
+#ifndef METRO_LIBRARY
+// Primal-dual: Dijkstra on reduced costs sets the potentials, then a
+// blocking flow (Dinic) saturates every shortest path of that length at
+// once. Arc costs start non-negative. Returns the flow sent.
+static int32_t minCostFlow(FlowGraph& g, int s, int t)
+{
+    const int64_t INF = INT64_MAX / 4;
+    int n = (int)g.head.size();
+    FlowSearch fs{ g, std::vector<int64_t>(n, 0), std::vector<int32_t>(n), std::vector<int32_t>(n), t };
+    std::vector<int64_t> dist(n);
+    std::vector<int32_t> bfs(n);
+    int32_t flow = 0;
+    for (;;)
+    {
+        std::fill(dist.begin(), dist.end(), INF);
+        std::priority_queue<std::pair<int64_t, int32_t>, std::vector<std::pair<int64_t, int32_t>>,
+                            std::greater<std::pair<int64_t, int32_t>>> heap;
+        dist[s] = 0;
+        heap.push({ 0, s });
+        while (!heap.empty())
+        {
+            auto [d, u] = heap.top();
+            heap.pop();
+            if (d > dist[u]) continue;
+            for (int32_t a = g.head[u]; a >= 0; a = g.next[a])
+            {
+                const FlowGraph::Arc& e = g.arcs[a];
+                if (!e.cap) continue;
+                int64_t nd = d + e.cost + fs.pi[u] - fs.pi[e.to];
+                if (nd < dist[e.to]) { dist[e.to] = nd; heap.push({ nd, e.to }); }
+            }
+        }
+        if (dist[t] >= INF) break;
+        for (int v = 0; v < n; v++) fs.pi[v] += std::min(dist[v], dist[t]);
+
+        for (;;)
+        {
+            std::fill(fs.level.begin(), fs.level.end(), -1);
+            int qh = 0, qt = 0;
+            bfs[qt++] = s;
+            fs.level[s] = 0;
+            while (qh < qt)
+            {
+                int u = bfs[qh++];
+                for (int32_t a = g.head[u]; a >= 0; a = g.next[a])
+                {
+                    const FlowGraph::Arc& e = g.arcs[a];
+                    if (fs.level[e.to] < 0 && fs.admissible(u, e)) { fs.level[e.to] = fs.level[u] + 1; bfs[qt++] = e.to; }
+                }
+            }
+            if (fs.level[t] < 0) break;
+            fs.cur = g.head;
+            while (int32_t f = fs.push(s, INT32_MAX)) flow += f;
+        }
+    }
+    return flow;
+}
+#endif
+
+struct Circulation
+{
+    int trips = 0, terminals = 0;
+    int fleet = 0;               // trainsets through the yard
+    int covered = 0;             // trips with a vehicle
+    int emptyRuns = 0;
+    int64_t emptySecs = 0;
+    int peak = 0, peakAt = 0;    // most vehicles busy at once: a lower bound
+    double ms = 0.0;
+};
+
+#ifndef METRO_LIBRARY
+// fleetLimit <= 0: unlimited
+static Circulation planCirculation(const Network& net, const std::vector<TtTrip>& trips,
+                                   int32_t turnaround, int fleetLimit)
+{
+    auto t0 = std::chrono::steady_clock::now();
+    Circulation c;
+    c.trips = (int)trips.size();
+
+    // Terminal chains: (time, kind, trip); at equal times a ready vehicle
+    // sorts before the departure it can serve
+    struct Stop { int32_t t; int32_t kind; int32_t trip; };
+    std::vector<int> termOf(net.names.size(), -1), termStation;
+    for (const TtTrip& r : trips)
+        for (int st : { r.from, r.to })
+            if (termOf[st] < 0) { termOf[st] = (int)termStation.size(); termStation.push_back(st); }
+    c.terminals = (int)termStation.size();
+    std::vector<std::vector<Stop>> chain(termStation.size());
+    for (int i = 0; i < c.trips; i++)
+    {
+        chain[termOf[trips[i].from]].push_back({ trips[i].dep, 1, i });
+        chain[termOf[trips[i].to]].push_back({ trips[i].arr + turnaround, 0, i });
+    }
+
+    FlowGraph g;
+    int s = g.node(), t = g.node(), yardIn = g.node(), yardOut = g.node();
+    std::vector<std::vector<int32_t>> nodes(chain.size());
+    for (size_t k = 0; k < chain.size(); k++)
+    {
+        std::sort(chain[k].begin(), chain[k].end(), [](const Stop& a, const Stop& b)
+        {
+            return a.t != b.t ? a.t < b.t : a.kind < b.kind;
+        });
+        for (size_t i = 0; i < chain[k].size(); i++)
+        {
+            int v = g.node();
+            nodes[k].push_back(v);
+            if (chain[k][i].kind) g.arc(v, t, 1, 0);
+            else g.arc(s, v, 1, 0);
+            if (i) g.arc(v - 1, v, INT32_MAX, 0);
+        }
+        g.arc(nodes[k].back(), yardIn, INT32_MAX, 0);
+        g.arc(yardOut, nodes[k].front(), INT32_MAX, 0);
+    }
+    int yard = g.arc(yardIn, yardOut, fleetLimit > 0 ? fleetLimit : INT32_MAX, TRAINSET_COST);
+
+    std::vector<int> empties;
+    for (size_t a = 0; a < chain.size(); a++)
+        for (size_t b = 0; b < chain.size(); b++)
+        {
+            uint32_t secs = a == b ? UINT32_MAX : net.time(termStation[a], termStation[b]);
+            if (secs > (uint32_t)DEADHEAD_MAX) continue;
+            size_t j = 0;
+            for (size_t i = 0; i < chain[a].size(); i++)
+            {
+                if (chain[a][i].kind) continue;
+                int32_t reach = chain[a][i].t + (int32_t)secs;     // t already includes the turnaround
+                while (j < chain[b].size() && chain[b][j].t < reach) j++;
+                if (j == chain[b].size()) break;
+                empties.push_back(g.arc(nodes[a][i], nodes[b][j], INT32_MAX, secs));
+            }
+        }
+
+    c.covered = minCostFlow(g, s, t);
+    c.fleet = g.flow(yard);
+    for (int a : empties)
+        if (int32_t f = g.flow(a)) { c.emptyRuns += f; c.emptySecs += (int64_t)f * g.arcs[a].cost; }
+
+    std::vector<std::pair<int32_t, int>> busy;
+    for (const TtTrip& r : trips) { busy.push_back({ r.dep, 1 }); busy.push_back({ r.arr + turnaround, -1 }); }
+    std::sort(busy.begin(), busy.end());
+    int now = 0;
+    for (auto &b : busy)
+        if ((now += b.second) > c.peak) { c.peak = now; c.peakAt = b.first; }
+
+    c.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    return c;
+}
+
+static void printCirculation(const char* label, const Circulation& c, int fleetLimit)
+{
+    std::printf("%s: %d trips between %d terminals\n", label, c.trips, c.terminals);
+    if (c.covered < c.trips)
+        std::printf("  %d trainsets cannot cover the day: %d trip connection(s) short\n",
+                    fleetLimit, c.trips - c.covered);
+    else
+        std::printf("  %d trainsets (at least %d busy at %02d:%02d), %d empty runs (%.1f min)\n",
+                    c.fleet, c.peak, c.peakAt / 3600 % 24, c.peakAt / 60 % 60, c.emptyRuns, c.emptySecs / 60.0);
+    std::printf("  solved in %.1f ms\n", c.ms);
+}
+
+// --circulation [--fleet-limit n] [--turnaround s]
+static void runCirculation(const Network& net, int32_t turnaround, int fleetLimit)
+{
+    Timetable tt;
+    buildTimetable(tt, net);
+    printCirculation("network", planCirculation(net, tt.runs, turnaround, fleetLimit), fleetLimit);
+
+    Network grid;
+    gridNetwork(grid, 12);
+    buildTravelMatrix(grid);
+    Timetable gt;
+    buildTimetable(gt, grid);
+    printCirculation("12x12 grid", planCirculation(grid, gt.runs, turnaround, fleetLimit), fleetLimit);
+
+    // One-way event shuttle: every trip runs out, so sets come back empty
+    Network shuttle;
+    addSegment(shuttle, "Stadium", "Park & Ride", 300);
+    buildTravelMatrix(shuttle);
+    std::vector<TtTrip> out;
+    for (int i = 0; i < 30; i++) out.push_back({ 0, 1, 22 * 3600 + i * 180, 22 * 3600 + i * 180 + 300 });
+    printCirculation("one-way shuttle", planCirculation(shuttle, out, turnaround, fleetLimit), fleetLimit);
+}
+#endif
+
+// --------------------------- State Machine Update ---------------------------
+static void updateStateMachine(Sim& sim, float dt)
+{
+    sim.stateTimer += dt;
+
+    // Wheel rotation increases while moving
+    auto wheelAdvance = [&](float speedFactor)
+    {
+        sim.wheelAngle -= 360.0f * speedFactor * dt;  // negative for forward
+        if (sim.wheelAngle < -360.0f) sim.wheelAngle += 360.0f;
+    };
+
+    switch (sim.state)
+    {
+        case TS_MOVING_TO_STATION:
+        {
+            sim.signalGreen = true;
+            sim.doorOpen = 0.0f;
+
+            sim.trainX += sim.trainSpeed * dt;
+            wheelAdvance(1.2f);
+
+            // When near station stop point -> arriving (slowdown)
+            if (sim.trainX >= STATION_STOP_X)
+            {
+                sim.trainX = STATION_STOP_X;
+                sim.state = TS_ARRIVING;
+                sim.stateTimer = 0.0f;
+            }
+        } break;
+
+        case TS_ARRIVING:
+        {
+            // Small pause to feel like arrival
+            sim.signalGreen = true;
+            if (sim.stateTimer > 0.35f)
+            {
+                sim.state = TS_STOPPED_SIGNAL_RED;
+                sim.stateTimer = 0.0f;
+            }
+        } break;
+
+        case TS_STOPPED_SIGNAL_RED:
+        {
+            sim.signalGreen = false;
+            // Wait then open doors
+            if (sim.stateTimer > 0.6f + sim.hold)
+            {
+                sim.hold = 0.0f;
+                sim.state = TS_DOORS_OPENING;
+                sim.stateTimer = 0.0f;
+            }
+        } break;
+
+        case TS_DOORS_OPENING:
+        {
+            sim.signalGreen = false;
+            sim.doorOpen = std::min(1.0f, sim.doorOpen + 1.3f * dt);
+
+            if (sim.doorOpen >= 1.0f && sim.stateTimer > 0.2f)
+            {
+                for (auto &p : sim.passengers)
+                    if (p.active) p.boarding = true;
+                sim.state = TS_PASSENGERS_BOARDING;
+                sim.stateTimer = 0.0f;
+            }
+        } break;
+
+        case TS_PASSENGERS_BOARDING:
+        {
+            sim.signalGreen = false;
+
+            float doorX = trainDoorWorldX(sim) + 65.0f; // door frame-ish center
+            // Move passengers toward door; when inside => disappear
+            auto movePassenger = [&](Passenger& p)
+            {
+                if (!p.active || !p.boarding) return;
+                float targetX = doorX;
+                float dx = targetX - p.x;
+                float step = p.speed * dt;
+
+                if (std::fabs(dx) <= step)
+                    p.x = targetX;
+                else
+                    p.x += (dx > 0 ? step : -step);
+
+                p.legPhase += 8.0f * dt;
+
+                // "Enter train" condition (near door + doors open)
+                if (std::fabs(p.x - targetX) < 2.0f && sim.doorOpen > 0.95f)
+                {
+                    p.active = false; // disappears after boarding (required)
+                    sim.boarded++;
+                }
+            };
+
+            bool allBoarded = true;
+            for (auto &p : sim.passengers)
+            {
+                movePassenger(p);
+                if (p.active && p.boarding) allBoarded = false;
+            }
+
+            // When everyone waiting at door-open has boarded, close doors
+            if (allBoarded && sim.stateTimer > 0.4f)
+            {
+                sim.state = TS_DOORS_CLOSING;
+                sim.stateTimer = 0.0f;
+            }
+        } break;
+
+        case TS_DOORS_CLOSING:
+        {
+            sim.signalGreen = false;
+            sim.doorOpen = std::max(0.0f, sim.doorOpen - 1.3f * dt);
+
+            if (sim.doorOpen <= 0.0f)
+            {
+                sim.state = TS_SIGNAL_GREEN_WAIT;
+                sim.stateTimer = 0.0f;
+            }
+        } break;
+
+        case TS_SIGNAL_GREEN_WAIT:
+        {
+            // Turn signal green, then depart
+            sim.signalGreen = true;
+            if (sim.stateTimer > 0.5f)
+            {
+                sim.state = TS_MOVING_AWAY;
+                sim.stateTimer = 0.0f;
+            }
+        } break;
+
+        case TS_MOVING_AWAY:
+        {
+            sim.signalGreen = true;
+            sim.trainX += sim.trainSpeed * dt;
+            wheelAdvance(1.2f);
+
+            // Once fully off screen to right, reset cycle
+            if (sim.trainX > (float)W + 50.0f)
+            {
+                sim.trainX = -TRAIN_LENGTH;
+                sim.doorOpen = 0.0f;
+
+                // New passengers each cycle (required)
+                sim.cycle++;
+                spawnPassengers(sim);
+
+                sim.state = TS_MOVING_TO_STATION;
+                sim.stateTimer = 0.0f;
+            }
+        } break;
+    }
+}
+
+// --------------------------- Crowd Density Heatmap ---------------------------
+// Riders are binned into a coarse platform grid. Each passenger remembers its
+// cell, so a tick only touches the counts of riders that crossed a cell edge.
+// A few times a second the counts are box-filtered (separable, two passes)
+// and colourised into a small RGBA image that is drawn stretched over the
+// platform and cached by version in the backend.
+static int crowdCell(float x, float y)
+{
+    int cx = (int)std::floor(x / CROWD_CELL);
+    int cy = (int)std::floor((y - CROWD_Y0) / CROWD_CELL);
+    if ((unsigned)cx >= (unsigned)CROWD_GX || (unsigned)cy >= (unsigned)CROWD_GY) return -1;
+    return cy * CROWD_GX + cx;
+}
+
+static void refreshCrowdImage(CrowdGrid& g)
+{
+    const int r = CROWD_BLUR;
+    const float norm = 1.0f / ((2 * r + 1) * (2 * r + 1));
+    float tmp[CROWD_GX * CROWD_GY];
+
+    // Horizontal running sum, then vertical
+    for (int y = 0; y < CROWD_GY; y++)
+    {
+        const int32_t* row = &g.counts[y * CROWD_GX];
+        int32_t acc = 0;
+        for (int x = 0; x <= r && x < CROWD_GX; x++) acc += row[x];
+        for (int x = 0; x < CROWD_GX; x++)
+        {
+            tmp[y * CROWD_GX + x] = (float)acc;
+            if (x + r + 1 < CROWD_GX) acc += row[x + r + 1];
+            if (x - r >= 0) acc -= row[x - r];
+        }
+    }
+    for (int x = 0; x < CROWD_GX; x++)
+    {
+        float acc = 0;
+        for (int y = 0; y <= r && y < CROWD_GY; y++) acc += tmp[y * CROWD_GX + x];
+        for (int y = 0; y < CROWD_GY; y++)
+        {
+            g.density[y * CROWD_GX + x] = acc * norm;
+            if (y + r + 1 < CROWD_GY) acc += tmp[(y + r + 1) * CROWD_GX + x];
+            if (y - r >= 0) acc -= tmp[(y - r) * CROWD_GX + x];
+        }
+    }
+
+    // green -> yellow -> red, alpha grows with density
+    for (int i = 0; i < CROWD_GX * CROWD_GY; i++)
+    {
+        float d = std::min(1.0f, g.density[i] / CROWD_FULL);
+        uint8_t* px = &g.rgba[4 * i];
+        px[0] = (uint8_t)(255.0f * std::min(1.0f, 2.0f * d));
+        px[1] = (uint8_t)(255.0f * std::min(1.0f, 2.0f * (1.0f - d)));
+        px[2] = 0;
+        px[3] = (uint8_t)(d > 0.0f ? 60.0f + 140.0f * d : 0.0f);
+    }
+    g.version++;
+}
+
+// Rebin riders that moved to another cell; refresh the image at CROWD_HZ
+static void updateCrowd(Sim& sim)
+{
+    CrowdGrid& g = sim.crowd;
+    int32_t* counts = g.counts.data();
+    for (auto &p : sim.passengers)
+    {
+        int c = p.active ? crowdCell(p.x, p.y) : -1;
+        if (c == p.cell) continue;
+        if (p.cell >= 0) counts[p.cell]--;
+        if (c >= 0) counts[c]++;
+        p.cell = c;
+    }
+
+    if (sim.time >= g.nextRefresh)
+    {
+        refreshCrowdImage(g);
+        g.nextRefresh = sim.time + 1.0 / CROWD_HZ;
+    }
+}
+
+static void drawCrowdOverlay(const Sim& sim)
+{
+    if (!sim.showCrowd || sim.crowd.version == 0) return;
+    gGfx->image(0, CROWD_Y0, CROWD_GX * CROWD_CELL, CROWD_GY * CROWD_CELL,
+                sim.crowd.rgba.data(), CROWD_GX, CROWD_GY, IMG_CROWD, sim.crowd.version);
+}
+
+#ifndef METRO_LIBRARY
+// Headless: n riders random-walking on the platform
+static void benchCrowd(int n, int ticks)
+{
+    Sim sim;
+    sim.showCrowd = true;
+    uint64_t rng = 88172645463325252ull;
+    auto rnd = [&]() { rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17; return (float)(rng >> 40) / 16777216.0f; };
+    sim.passengers.resize(n);
+    for (auto &p : sim.passengers) { p.x = rnd() * W; p.y = CROWD_Y0 + rnd() * CROWD_GY * CROWD_CELL; }
+
+    double msBin = 0, msRefresh = 0;
+    for (int t = 0; t < ticks; t++)
+    {
+        for (auto &p : sim.passengers) p.x = std::fmod(p.x + (rnd() - 0.5f) * 3.0f + W, (float)W);
+        sim.time += DT;
+        auto t0 = std::chrono::steady_clock::now();
+        updateCrowd(sim);
+        msBin += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    }
+    for (int t = 0; t < 100; t++)
+    {
+        auto t0 = std::chrono::steady_clock::now();
+        refreshCrowdImage(sim.crowd);
+        msRefresh += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    }
+    std::printf("crowd %d agents: bin update %.3f ms/tick (incl. %g Hz refresh), filter+colour %.4f ms\n",
+                n, msBin / ticks, CROWD_HZ, msRefresh / 100);
+}
+#endif
+
+// --------------------------- Display ---------------------------
+static void drawSky(const Sim& sim)
+{
+    setColorUnlit(sim.light.sky[0], sim.light.sky[1], sim.light.sky[2]);
+    rectFilled(0, 0, W, H);
+}
+
+// Drawn after the sun and moon so they set behind it
+static void drawGround(const Sim& sim)
+{
+    setColorUnlit(sim.light.ground[0], sim.light.ground[1], sim.light.ground[2]);
+    rectFilled(0, 0, W, 150);
+}
+
+// Scene layers, in draw order (recorded separately by the frame task graph)
+static void drawStaticLayer(const Sim& sim)
+{
+    setLighting(sim);
+    drawSky(sim);
+    drawSunMoon(sim);
+    drawGround(sim);
+    drawBuildings(sim);
+    drawStation(sim);
+    drawTrack(sim);
+}
+
+static void drawSignalLayer(const Sim& sim)
+{
+    setLighting(sim);
+    drawSignal(sim, sim.signalGreen);
+}
+
+static void drawCloudLayer(const Sim& sim)
+{
+    setLighting(sim);
+    // Moving clouds; scale is baked into the sprites
+    const CloudPlace clouds[3] =
+    {
+        { sim.c1x, 520.0f, 0, 1 }, { sim.c2x, 480.0f, 1, 2 }, { sim.c3x, 540.0f, 2, 0 }
+    };
+    drawClouds(sim, clouds, 3);
+}
+
+static void drawDynamicLayer(const Sim& sim)
+{
+    setLighting(sim);
+    // Crowding under the riders
+    drawCrowdOverlay(sim);
+
+    // Passengers
+    for (auto &p : sim.passengers)
+        drawPassenger(sim, p, 1.0f);
+
+    // Train
+    drawTrain(sim);
+}
+
+static void drawScene(const Sim& sim)
+{
+    drawStaticLayer(sim);
+    drawSignalLayer(sim);
+    drawCloudLayer(sim);
+    drawDynamicLayer(sim);
+}
+
+// --------------------------- Render Trace Capture / Replay ---------------------------
+// A trace is the complete stream of backend calls for one frame, stored as
+// 32-bit opcode + payload (everything stays 4-byte aligned). Replaying it
+// against each backend in a tight loop measures backend cost alone,
+// independent of simulation/scene code.
+static const uint32_t TRACE_MAGIC = 0x4352544du;   // "MTRC"
+static const uint32_t TRACE_VERSION = 4;     // 3: OP_PATTERN, 4: OP_SPRITES
+
+enum TraceOp : uint32_t
+{
+    OP_CLEAR = 1, OP_COLOR, OP_RECT, OP_RECT_LINE, OP_POINT_SIZE, OP_POINTS,
+    OP_PUSH, OP_POP, OP_TRANSLATE, OP_ROTATE, OP_SCALE, OP_IMAGE, OP_PATTERN,
+    OP_SPRITES
+};
+
+// Records calls into a byte buffer; optionally forwards them (capture while drawing)
+struct TraceRecorder : RenderBackend
+{
+    std::vector<uint8_t> bytes;
+    RenderBackend* forward = nullptr;
+
+    const char* name() const override { return "trace"; }
+
+    void op(TraceOp o) { uint32_t v = o; put(&v, sizeof v); }
+    void put(const void* p, size_t n)
+    {
+        const uint8_t* b = (const uint8_t*)p;
+        bytes.insert(bytes.end(), b, b + n);
+    }
+    void putf(float f) { put(&f, sizeof f); }
+
+    void clear() override { op(OP_CLEAR); if (forward) forward->clear(); }
+    void color(float r, float g, float b) override
+    {
+        op(OP_COLOR); putf(r); putf(g); putf(b);
+        if (forward) forward->color(r, g, b);
+    }
+    void rect(float x, float y, float w, float h) override
+    {
+        op(OP_RECT); putf(x); putf(y); putf(w); putf(h);
+        if (forward) forward->rect(x, y, w, h);
+    }
+    void rectLine(float x, float y, float w, float h) override
+    {
+        op(OP_RECT_LINE); putf(x); putf(y); putf(w); putf(h);
+        if (forward) forward->rectLine(x, y, w, h);
+    }
+    void pointSize(float s) override { op(OP_POINT_SIZE); putf(s); if (forward) forward->pointSize(s); }
+    void points(const int* xy, int count) override
+    {
+        op(OP_POINTS);
+        uint32_t n = (uint32_t)count;
+        put(&n, sizeof n);
+        put(xy, sizeof(int) * 2 * (size_t)count);
+        if (forward) forward->points(xy, count);
+    }
+    void push() override { op(OP_PUSH); if (forward) forward->push(); }
+    void pop() override { op(OP_POP); if (forward) forward->pop(); }
+    void translate(float x, float y) override { op(OP_TRANSLATE); putf(x); putf(y); if (forward) forward->translate(x, y); }
+    void rotate(float deg) override { op(OP_ROTATE); putf(deg); if (forward) forward->rotate(deg); }
+    void scale(float sx, float sy) override { op(OP_SCALE); putf(sx); putf(sy); if (forward) forward->scale(sx, sy); }
+    void putImage(TraceOp o, float x, float y, float w, float h, const uint8_t* rgba,
+                  int iw, int ih, uint32_t slot, uint32_t version)
+    {
+        op(o); putf(x); putf(y); putf(w); putf(h);
+        uint32_t hdr[4] = { (uint32_t)iw, (uint32_t)ih, slot, version };
+        put(hdr, sizeof hdr);
+        put(rgba, (size_t)iw * ih * 4);
+    }
+    void image(float x, float y, float w, float h, const uint8_t* rgba,
+               int iw, int ih, uint32_t slot, uint32_t version) override
+    {
+        putImage(OP_IMAGE, x, y, w, h, rgba, iw, ih, slot, version);
+        if (forward) forward->image(x, y, w, h, rgba, iw, ih, slot, version);
+    }
+    void pattern(float x, float y, float w, float h, const uint8_t* tile,
+                 int tw, int th, uint32_t slot, uint32_t version) override
+    {
+        putImage(OP_PATTERN, x, y, w, h, tile, tw, th, slot, version);
+        if (forward) forward->pattern(x, y, w, h, tile, tw, th, slot, version);
+    }
+    void sprites(const SpriteQuad* q, int count, const uint8_t* atlas, int aw, int ah,
+                 float tint, uint32_t slot, uint32_t version) override
+    {
+        op(OP_SPRITES); putf(tint);
+        uint32_t hdr[5] = { (uint32_t)aw, (uint32_t)ah, slot, version, (uint32_t)count };
+        put(hdr, sizeof hdr);
+        put(q, sizeof(SpriteQuad) * (size_t)count);
+        put(atlas, (size_t)aw * ah * 4);
+        if (forward) forward->sprites(q, count, atlas, aw, ah, tint, slot, version);
+    }
+};
+
+// Discards everything; replaying into it measures decode overhead only
+struct NullBackend : RenderBackend
+{
+    const char* name() const override { return "null"; }
+    void clear() override {}
+    void color(float, float, float) override {}
+    void rect(float, float, float, float) override {}
+    void rectLine(float, float, float, float) override {}
+    void pointSize(float) override {}
+    void points(const int*, int) override {}
+    void push() override {}
+    void pop() override {}
+    void translate(float, float) override {}
+    void rotate(float) override {}
+    void scale(float, float) override {}
+    void image(float, float, float, float, const uint8_t*, int, int, uint32_t, uint32_t) override {}
+    void pattern(float, float, float, float, const uint8_t*, int, int, uint32_t, uint32_t) override {}
+    void sprites(const SpriteQuad*, int, const uint8_t*, int, int, float, uint32_t, uint32_t) override {}
+};
+
+static NullBackend gNullBackend;
+
+#ifndef METRO_LIBRARY
+static bool saveTrace(const char* path, const std::vector<uint8_t>& ops)
+{
+    FILE* f = std::fopen(path, "wb");
+    if (!f) return false;
+    uint32_t hdr[4] = { TRACE_MAGIC, TRACE_VERSION, (uint32_t)W, (uint32_t)H };
+    bool ok = std::fwrite(hdr, sizeof hdr, 1, f) == 1 &&
+              std::fwrite(ops.data(), 1, ops.size(), f) == ops.size();
+    std::fclose(f);
+    return ok;
+}
+
+static bool loadTrace(const char* path, std::vector<uint8_t>& ops)
+{
+    FILE* f = std::fopen(path, "rb");
+    if (!f) return false;
+    uint32_t hdr[4];
+    bool ok = std::fread(hdr, sizeof hdr, 1, f) == 1 &&
+              hdr[0] == TRACE_MAGIC && hdr[1] == TRACE_VERSION;
+    ops.clear();
+    if (ok)
+    {
+        uint8_t buf[1 << 16];
+        size_t n;
+        while ((n = std::fread(buf, 1, sizeof buf, f)) > 0) ops.insert(ops.end(), buf, buf + n);
+    }
+    std::fclose(f);
+    return ok;
+}
+
+// Decode and issue every op; returns false on a malformed trace
+static bool replayTrace(const uint8_t* p, size_t len, RenderBackend& be)
+{
+    const uint8_t* end = p + len;
+    float f[4];
+    auto getf = [&](int n)
+    {
+        if ((size_t)(end - p) < sizeof(float) * n) return false;
+        std::memcpy(f, p, sizeof(float) * n);
+        p += sizeof(float) * n;
+        return true;
+    };
+
+    while (end - p >= 4)
+    {
+        uint32_t o;
+        std::memcpy(&o, p, sizeof o);
+        p += sizeof o;
+        switch (o)
+        {
+            case OP_CLEAR: be.clear(); break;
+            case OP_COLOR: if (!getf(3)) return false; be.color(f[0], f[1], f[2]); break;
+            case OP_RECT: if (!getf(4)) return false; be.rect(f[0], f[1], f[2], f[3]); break;
+            case OP_RECT_LINE: if (!getf(4)) return false; be.rectLine(f[0], f[1], f[2], f[3]); break;
+            case OP_POINT_SIZE: if (!getf(1)) return false; be.pointSize(f[0]); break;
+            case OP_POINTS:
+            {
+                uint32_t n;
+                if ((size_t)(end - p) < sizeof n) return false;
+                std::memcpy(&n, p, sizeof n);
+                p += sizeof n;
+                size_t bytes = sizeof(int) * 2 * (size_t)n;
+                if ((size_t)(end - p) < bytes) return false;
+                be.points((const int*)p, (int)n);
+                p += bytes;
+            } break;
+            case OP_PUSH: be.push(); break;
+            case OP_POP: be.pop(); break;
+            case OP_TRANSLATE: if (!getf(2)) return false; be.translate(f[0], f[1]); break;
+            case OP_ROTATE: if (!getf(1)) return false; be.rotate(f[0]); break;
+            case OP_SCALE: if (!getf(2)) return false; be.scale(f[0], f[1]); break;
+            case OP_IMAGE:
+            case OP_PATTERN:
+            {
+                uint32_t hdr[4];
+                if (!getf(4) || (size_t)(end - p) < sizeof hdr) return false;
+                std::memcpy(hdr, p, sizeof hdr);
+                p += sizeof hdr;
+                size_t bytes = (size_t)hdr[0] * hdr[1] * 4;
+                if ((size_t)(end - p) < bytes) return false;
+                if (o == OP_IMAGE) be.image(f[0], f[1], f[2], f[3], p, (int)hdr[0], (int)hdr[1], hdr[2], hdr[3]);
+                else be.pattern(f[0], f[1], f[2], f[3], p, (int)hdr[0], (int)hdr[1], hdr[2], hdr[3]);
+                p += bytes;
+            } break;
+            case OP_SPRITES:
+            {
+                uint32_t hdr[5];
+                if (!getf(1) || (size_t)(end - p) < sizeof hdr) return false;
+                std::memcpy(hdr, p, sizeof hdr);
+                p += sizeof hdr;
+                size_t quads = sizeof(RenderBackend::SpriteQuad) * (size_t)hdr[4];
+                size_t bytes = (size_t)hdr[0] * hdr[1] * 4;
+                if ((size_t)(end - p) < quads || (size_t)(end - p) - quads < bytes) return false;
+                const RenderBackend::SpriteQuad* q = (const RenderBackend::SpriteQuad*)p;
+                for (uint32_t i = 0; i < hdr[4]; i++)   // texel rects inside the atlas
+                    if (q[i].u < 0 || q[i].v < 0 || q[i].tw <= 0 || q[i].th <= 0 ||
+                        (uint32_t)q[i].u + q[i].tw > hdr[0] || (uint32_t)q[i].v + q[i].th > hdr[1]) return false;
+                be.sprites(q, (int)hdr[4], p + quads,
+                           (int)hdr[0], (int)hdr[1], f[0], hdr[2], hdr[3]);
+                p += quads + bytes;
+            } break;
+            default: return false;
+        }
+    }
+    return p == end;
+}
+
+// Replay the trace `iters` times, reporting median/min per-frame time.
+// `finish` blocks until the backend has really finished (e.g. glFinish).
+static void benchReplay(const std::vector<uint8_t>& ops, RenderBackend& be, int iters,
+                        void (*finish)() = nullptr)
+{
+    std::vector<double> ms;
+    ms.reserve(iters);
+    for (int i = 0; i < iters; i++)
+    {
+        auto t0 = std::chrono::steady_clock::now();
+        replayTrace(ops.data(), ops.size(), be);
+        if (finish) finish();
+        auto t1 = std::chrono::steady_clock::now();
+        ms.push_back(std::chrono::duration<double, std::milli>(t1 - t0).count());
+    }
+    std::sort(ms.begin(), ms.end());
+    std::printf("%-8s frames=%d  median=%.4f ms  min=%.4f ms  p90=%.4f ms\n",
+                be.name(), iters, ms[ms.size() / 2], ms.front(), ms[ms.size() * 9 / 10]);
+}
+#endif
+
+// --------------------------- Change Tracking ---------------------------
+// Hash of everything that affects visible pixels, quantised to whole pixels.
+// The window only redraws when it changes, so the redraw rate drops to the
+// true animation rate (e.g. clouds crossing a pixel every few ticks).
+struct StateHash
+{
+    uint64_t h = 1469598103934665603ull;   // FNV-1a 64
+    void add(int32_t v)
+    {
+        for (int i = 0; i < 4; i++) { h ^= (uint8_t)(v >> (8 * i)); h *= 1099511628211ull; }
+    }
+};
+
+#ifndef METRO_LIBRARY
+// Angle (degrees) rotating a point at `radius` px -> arc length in pixels
+static int arcPixels(float deg, float radius) { return iround(deg * radius * 0.0174533f); }
+#endif
+
+// Everything the day clock changes in the static layer, as drawn
+static uint64_t lightKey(const Sim& sim)
+{
+    const DayLight& l = sim.light;
+    StateHash s;
+    s.add(sim.night);
+    s.add(iround(l.sunX)); s.add(iround(l.sunY));
+    s.add(iround(l.moonX)); s.add(iround(l.moonY));
+    for (int c = 0; c < 3; c++)
+    {
+        s.add(iround(l.sky[c] * 255.0f));
+        s.add(iround(l.ground[c] * 255.0f));
+    }
+    s.add(iround(l.ambient * 255.0f));
+    s.add((int32_t)gCacheGeneration.load(std::memory_order_relaxed));   // direct -> cached drawing
+    return s.h;
+}
+
+// Scene layers, bottom to top, each with its own cached surface in the
+// layer compositor
+enum { LAYER_STATIC, LAYER_SIGNAL, LAYER_CLOUDS, LAYER_DYNAMIC, LAYER_COUNT };
+static const char* const LAYER_NAME[LAYER_COUNT] = { "static", "signal", "clouds", "dynamic" };
+
+#ifndef METRO_LIBRARY
+// What one layer shows, quantised to whole pixels: while its key holds, the
+// layer would draw the same pixels again
+static uint64_t layerKey(const Sim& sim, int layer)
+{
+    uint64_t light = lightKey(sim);
+    StateHash s;
+    s.add((int32_t)(light >> 32));
+    s.add((int32_t)light);
+    switch (layer)
+    {
+    case LAYER_SIGNAL:
+        s.add(sim.signalGreen);
+        break;
+    case LAYER_CLOUDS:
+        s.add(iround(sim.c1x));
+        s.add(iround(sim.c2x));
+        s.add(iround(sim.c3x));
+        break;
+    case LAYER_DYNAMIC:
+        s.add(iround(sim.trainX));
+        s.add(arcPixels(sim.wheelAngle, 12.0f));
+        s.add(iround(sim.doorOpen * 20.0f));        // door panel slide in px
+        s.add(sim.showCrowd ? (int32_t)sim.crowd.version : -1);
+        for (auto &p : sim.passengers)
+        {
+            if (!p.active) continue;
+            s.add(iround(p.x));
+            s.add(iround(p.y));
+            s.add(arcPixels(std::sin(p.legPhase) * 22.0f, 14.0f));
+        }
+        break;
+    }
+    return s.h;
+}
+
+static uint64_t visibleStateHash(const Sim& sim)
+{
+    StateHash s;
+    for (int l = 0; l < LAYER_COUNT; l++)
+    {
+        uint64_t k = layerKey(sim, l);
+        s.add((int32_t)(k >> 32));
+        s.add((int32_t)k);
+    }
+    return s.h;
+}
+#endif
+
+// --------------------------- Simulation Step ---------------------------
+static void initSim(Sim& sim)
+{
+    buildInterior(sim.station, 4, 1, 1);
+    applyClock(sim);
+
+    // Start passengers for first cycle
+    spawnPassengers(sim);
+    sim.state = TS_MOVING_TO_STATION;
+    sim.stateTimer = 0.0f;
+}
+
+static void stepClouds(Sim& sim, float dt)
+{
+    // Clouds move
+    sim.c1x += sim.cloudSpeed * dt;
+    sim.c2x += (sim.cloudSpeed * 0.8f) * dt;
+    sim.c3x += (sim.cloudSpeed * 1.1f) * dt;
+
+    if (sim.c1x > W + 60) sim.c1x = -60;
+    if (sim.c2x > W + 60) sim.c2x = -60;
+    if (sim.c3x > W + 60) sim.c3x = -60;
+}
+
+// One fixed tick of the whole simulation
+static void stepSim(Sim& sim, float dt, const ArrivalFn& onArrival = nullptr)
+{
+    stepClouds(sim, dt);
+    stepClock(sim, dt);
+
+    // Tap-driven arrivals, then state machine update
+    sim.time += dt;
+    updateTapSpawns(sim);
+    updateStationInterior(sim, onArrival);
+    updateStateMachine(sim, dt);
+    if (sim.showCrowd) updateCrowd(sim);
+}
+
+// --------------------------- Queueing Surrogate ---------------------------
+// Closed-form estimate of the station interior and platform for quick
+// what-if questions: each server node is an M/G/c queue (Erlang C scaled by
+// the Allen-Cunneen factor (ca^2 + cs^2) / 2, exact Pollaczek-Khinchine for
+// c = 1), arrival variability is carried node to node with Whitt's QNA
+// linking equations, shortest-queue branches are pooled into one queue over
+// all their servers, and the platform is a periodic bulk server with the
+// train cycle as headway. Costs microseconds; --surrogate-check compares it
+// with the event-driven interior and the headless sim and flags where it
+// breaks down.
+struct NodeKpi
+{
+    const char* name = "";
+    double lambda = 0;       // arrivals per second
+    double rho = 0;          // server utilisation
+    double wq = 0;           // mean queueing delay, s
+    double lq = 0;           // mean queue length
+    double ca2 = 1;          // arrival squared coefficient of variation
+};
+
+struct SurrogateKpi
+{
+    std::vector<NodeKpi> nodes;
+    double transit = 0;        // mean gate-to-platform time, s
+    double stairsShare = 0;    // riders taking the stairs
+    double headway = 0;        // train cycle, s
+    double dwell = 0;          // stopped at the platform, s
+    double platformWait = 0;   // mean time on the platform, s
+    double platformCrowd = 0;  // mean riders on the platform
+    double peakCrowd = 0;      // riders waiting when the doors open
+    bool unstable = false;     // some node has rho >= 1 (queues grow without bound)
+    bool heavy = false;        // some node has rho > 0.9 (approximation least accurate)
+};
+
+// Erlang B (loss probability of M/M/c/c) by the stable recursion
+static double erlangB(int c, double a)
+{
+    double b = 1.0;
+    for (int k = 1; k <= c; k++) b = a * b / (k + a * b);
+    return b;
+}
+
+// Erlang C: probability an arrival waits in M/M/c with offered load a = lambda/mu
+static double erlangC(int c, double a)
+{
+    double b = erlangB(c, a), rho = a / c;
+    return b / (1.0 - rho * (1.0 - b));
+}
+
+// Mean M/G/c queueing delay (Allen-Cunneen); infinite when saturated
+static double mgcWait(int c, double lambda, double mu, double ca2, double cs2)
+{
+    if (lambda >= c * mu) return INFINITY;
+    return erlangC(c, lambda / mu) / (c * mu - lambda) * (ca2 + cs2) * 0.5;
+}
+
+// Ticks a phase lasts when it ends on "timer > secs"
+static double phaseTicks(double secs) { return std::floor(secs / DT) + 1.0; }
+
+static SurrogateKpi surrogateKpi(const Interior& in, double perHour, float trainSpeed, float riderSpeed)
+{
+    SurrogateKpi k;
+    double lambda = perHour / 3600.0;
+    size_t n = in.nodes.size();
+    k.nodes.resize(n);
+    std::vector<double> lam(n, 0.0), ca2w(n, 0.0);   // rate and rate-weighted SCV in
+    std::vector<double> pooled(n, -1.0);             // shared wait of a shortest-queue branch
+    if (n) { lam[0] = lambda; ca2w[0] = lambda; }    // Poisson taps at the gates
+
+    // Successors always have higher indices, so one pass in order suffices
+    double escPlatformX = 0, stairsPlatformX = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        const QNode& q = in.nodes[i];
+        NodeKpi& o = k.nodes[i];
+        o.name = q.name;
+        o.lambda = lam[i];
+        o.ca2 = lam[i] > 0 ? ca2w[i] / lam[i] : 1.0;
+        double cs2 = (double)q.serviceCv * q.serviceCv;
+        double cd2 = o.ca2;                          // delay links pass variability on
+        if (q.servers > 0 && o.lambda > 0)
+        {
+            double mu = 1.0 / q.serviceMean;
+            o.rho = o.lambda / mu / q.servers;
+            o.wq = pooled[i] >= 0.0 ? pooled[i] : mgcWait(q.servers, o.lambda, mu, o.ca2, cs2);
+            o.lq = o.lambda * o.wq;
+            if (o.rho >= 1.0 || std::isinf(o.wq)) k.unstable = true;
+            else
+            {
+                cd2 = 1.0 + (1.0 - o.rho * o.rho) * (o.ca2 - 1.0) +
+                      o.rho * o.rho * (cs2 - 1.0) / std::sqrt((double)q.servers);
+            }
+            k.heavy |= o.rho > 0.9;
+        }
+        k.transit += lambda > 0 ? o.lambda / lambda * (o.wq + q.serviceMean + q.transit) : 0.0;
+
+        // Shortest-queue split: ties go to the first branch, so at light
+        // load the second only takes the first's overflow (Erlang B), and
+        // once both queue it takes its share of capacity. Both branches then
+        // wait about as long as one queue in front of all their servers.
+        double p1 = 0.0;
+        if (q.nextCount == 2)
+        {
+            const QNode& b0 = in.nodes[q.next[0]];
+            const QNode& b1 = in.nodes[q.next[1]];
+            double cap0 = b0.servers / b0.serviceMean, cap1 = b1.servers / b1.serviceMean;
+            p1 = std::min(erlangB(b0.servers, o.lambda * b0.serviceMean), cap1 / (cap0 + cap1));
+            k.stairsShare = p1;
+            int c = b0.servers + b1.servers;
+            double cs2 = (cap0 * b0.serviceCv * b0.serviceCv + cap1 * b1.serviceCv * b1.serviceCv) / (cap0 + cap1);
+            pooled[q.next[0]] = pooled[q.next[1]] = mgcWait(c, o.lambda, (cap0 + cap1) / c, cd2, cs2);
+        }
+        for (int j = 0; j < q.nextCount; j++)
+        {
+            double p = q.nextCount == 2 ? (j ? p1 : 1.0 - p1) : 1.0;
+            int to = q.next[j];
+            if (to < 0) continue;
+            lam[to] += p * o.lambda;
+            ca2w[to] += p * o.lambda * (p * cd2 + 1.0 - p);   // thinned stream
+        }
+        if (q.next[0] < 0)
+            (i == Q_STAIRS ? stairsPlatformX : escPlatformX) = q.platformX;
+    }
+
+    // A saturated node passes on only its capacity
+    double rhoMax = 1.0;
+    for (auto &o : k.nodes) rhoMax = std::max(rhoMax, o.rho);
+    lambda /= rhoMax;
+
+    // Train cycle, phase by phase as the state machine times it
+    double doorX = STATION_STOP_X + 240.0f + 65.0f;
+    double escWalk = std::fabs(escPlatformX - doorX) / riderSpeed;
+    double stairsWalk = std::fabs(stairsPlatformX - doorX) / riderSpeed;
+    double run = std::ceil((STATION_STOP_X + TRAIN_LENGTH) / (trainSpeed * DT)) +
+                 std::ceil(((float)W + 50.0f - STATION_STOP_X) / (trainSpeed * DT));
+    double doors = std::max(std::ceil(1.0 / (1.3 * DT)), phaseTicks(0.2)) + std::ceil(1.0 / (1.3 * DT));
+    double fixed = phaseTicks(0.35) + phaseTicks(0.6) + doors + phaseTicks(0.5);
+    double headway = (run + fixed) * DT, boarding = 0;
+    for (int it = 0; it < 4; it++)                 // boarding depends on riders per train
+    {
+        double perTrain = lambda * headway;
+        double pStairs = 1.0 - std::pow(1.0 - k.stairsShare, perTrain);
+        double walk = pStairs * stairsWalk + (1.0 - pStairs) * escWalk;
+        boarding = std::max(phaseTicks(0.4), std::ceil(walk / DT) + 1.0) * DT;
+        headway = (run + fixed) * DT + boarding;
+    }
+    k.headway = headway;
+    k.dwell = fixed * DT + boarding;
+    k.peakCrowd = lambda * headway;
+    k.platformWait = 0.5 * headway + 0.5 * boarding;
+    k.platformCrowd = lambda * k.platformWait;
+    return k;
+}
+
+#ifndef METRO_LIBRARY
+static void printSurrogate(const SurrogateKpi& k, double perHour, double us)
+{
+    std::printf("surrogate: %.0f pax/h in %.1f us%s%s\n", perHour, us,
+                k.unstable ? "  UNSTABLE: a queue grows without bound" : "",
+                !k.unstable && k.heavy ? "  (utilisation > 0.9: expect larger error)" : "");
+    for (auto &o : k.nodes)
+        std::printf("  %-10s %6.2f /s  rho %5.3f  wait %7.2f s  queue %7.2f  ca2 %4.2f\n",
+                    o.name, o.lambda, o.rho, o.wq, o.lq, o.ca2);
+    std::printf("  gate-to-platform %.2f s (stairs %.0f%%), headway %.2f s, dwell %.2f s\n",
+                k.transit, 100.0 * k.stairsShare, k.headway, k.dwell);
+    std::printf("  platform: mean wait %.2f s, mean crowd %.1f, at doors opening %.1f\n",
+                k.platformWait, k.platformCrowd, k.peakCrowd);
+}
+
+// --surrogate <pax/h>: the scene's station (4 gates, 1 escalator, 1 stairs)
+static void runSurrogate(double perHour)
+{
+    Interior in;
+    buildInterior(in, 4, 1, 1);
+    Sim sim;
+    auto t0 = std::chrono::steady_clock::now();
+    SurrogateKpi k;
+    const int reps = 1000;
+    for (int r = 0; r < reps; r++) k = surrogateKpi(in, perHour, sim.trainSpeed, 80.0f);
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count() / reps;
+    printSurrogate(k, perHour, us);
+}
+#endif
+
+struct SimulatedKpi
+{
+    std::vector<double> wq;
+    double transit = 0, headway = 0, platformCrowd = 0, platformWait = 0;
+};
+
+// Headless reference: the scene sim with the clock frozen at 03:00 (no
+// built-in riders) and Poisson taps into its interior
+static SimulatedKpi simulateKpi(double perHour, double seconds, uint64_t seed)
+{
+    Sim sim;
+    sim.clock = 180.0;
+    sim.clockRate = 0.0f;
+    initSim(sim);
+    double lambda = perHour / 3600.0, next = 0.0;
+    auto uniform = [&]()
+    {
+        seed ^= seed >> 12; seed ^= seed << 25; seed ^= seed >> 27;
+        return ((seed * 2685821657736338717ull) >> 11) * (1.0 / 9007199254740992.0) + 1e-17;
+    };
+    next = -std::log(uniform()) / lambda;
+
+    SimulatedKpi s;
+    double crowdSum = 0.0, transitSum = 0.0, reached = 0.0, warm = 120.0;
+    int ticks = 0, cycle0 = -1;
+    double cycleT0 = 0.0;
+    uint64_t boarded0 = 0;
+    std::vector<uint64_t> served0;
+    std::vector<double> wait0;
+    while (sim.time < warm + seconds)
+    {
+        while (next <= sim.time + DT)
+        {
+            interiorArrive(sim.station, next, 80.0f, 0.0f, 0.0f);
+            next += -std::log(uniform()) / lambda;
+        }
+        bool measuring = sim.time >= warm;
+        if (measuring && cycle0 < 0)
+        {
+            cycle0 = sim.cycle; cycleT0 = sim.time; boarded0 = sim.boarded;
+            for (auto &q : sim.station.nodes) { served0.push_back(q.served); wait0.push_back(q.waitSum); }
+        }
+        stepSim(sim, DT, [&](const QPax& p, double at)
+        {
+            if (measuring) { transitSum += at - p.tapAt; reached += 1.0; }
+        });
+        if (!measuring) continue;
+        int onPlatform = 0;
+        for (auto &p : sim.passengers) onPlatform += p.active;
+        crowdSum += onPlatform;
+        ticks++;
+    }
+    for (size_t i = 0; i < sim.station.nodes.size(); i++)
+    {
+        const QNode& q = sim.station.nodes[i];
+        uint64_t served = q.served - served0[i];
+        s.wq.push_back(served ? (q.waitSum - wait0[i]) / served : 0.0);
+    }
+    s.transit = reached > 0 ? transitSum / reached : 0.0;
+    s.headway = sim.cycle > cycle0 ? (sim.time - cycleT0) / (sim.cycle - cycle0) : 0.0;
+    s.platformCrowd = ticks ? crowdSum / ticks : 0.0;
+    double throughput = (double)(sim.boarded - boarded0) / seconds;
+    s.platformWait = throughput > 0 ? s.platformCrowd / throughput : 0.0;   // Little's law
+    return s;
+}
+
+#ifndef METRO_LIBRARY
+// Relative error with a small absolute floor (waits near zero)
+static double kpiError(double predicted, double simulated, double floor)
+{
+    return std::fabs(predicted - simulated) / std::max(std::fabs(simulated), floor);
+}
+
+// --surrogate-check: sweep demand on the scene's station and compare
+static void checkSurrogate()
+{
+    const double rates[] = { 1000, 3000, 5000, 7000, 8000, 9000, 9500, 11000 };
+    const double tolerance = 0.15;
+    Interior in;
+    buildInterior(in, 4, 1, 1);
+    Sim ref;
+    std::printf("%7s %5s | %-15s | %-15s | %-15s | %-15s | %-15s\n", "pax/h", "rho",
+                "gate wait", "escalator wait", "gate->platform", "headway", "platform crowd");
+    for (double r : rates)
+    {
+        auto t0 = std::chrono::steady_clock::now();
+        SurrogateKpi k = surrogateKpi(in, r, ref.trainSpeed, 80.0f);
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+        auto t1 = std::chrono::steady_clock::now();
+        SimulatedKpi s = simulateKpi(r, 3600.0, 0x9e3779b97f4a7c15ull ^ (uint64_t)r);
+        double simMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t1).count();
+
+        double rho = 0;
+        for (auto &o : k.nodes) rho = std::max(rho, o.rho);
+        struct { double p, s, floor; } kpi[5] = {
+            { k.nodes[Q_GATES].wq, s.wq[Q_GATES], 0.2 },
+            { k.nodes[Q_ESCALATOR].wq, s.wq[Q_ESCALATOR], 0.2 },
+            { k.transit, s.transit, 1.0 },
+            { k.headway, s.headway, 1.0 },
+            { k.platformCrowd, s.platformCrowd, 1.0 } };
+        std::printf("%7.0f %5.2f", r, rho);
+        bool off = false;
+        for (auto &v : kpi)
+        {
+            bool bad = !(kpiError(v.p, v.s, v.floor) <= tolerance);
+            off |= bad;
+            std::printf(" | %6.2f %6.2f %c", v.p, v.s, bad ? '!' : ' ');
+        }
+        std::printf("  %.1f us vs %.0f ms%s\n", us, simMs,
+                    k.unstable ? "  unstable" : off ? (k.heavy ? "  breaks down (heavy traffic)" : "  breaks down") : "");
+    }
+    std::printf("(surrogate | simulated; ! = off by more than %.0f%%)\n", tolerance * 100.0);
+}
+#endif
+
+// --------------------------- Importance Sampling ---------------------------
+// Overcrowding is a tail event: it needs a burst of demand or a train held
+// at the signal, which plain Monte Carlo almost never draws. Stress runs
+// draw from a biased model and carry the likelihood ratio of the nominal
+// model to it, so averaging weight * [event] stays unbiased.
+//  - Demand: Poisson arrivals tilted to tilt * lambda over the window.
+//    Ratio (1/tilt)^N * exp((tilt - 1) * lambda * T).
+//  - Delays: each stop is held with probability DELAY_PROB for an Exp
+//    (DELAY_MEAN) time. The proposal is a mixture. It picks one of the K
+//    stops the window nominally sees and holds it for Exp(holdMean); the
+//    other stops stay nominal. The weight is K / sum_k r_k, where r_k is the
+//    biased-to-nominal density ratio of stop k's draw. An undrawn stop
+//    counts as 1. Only one stop is biased, so the weight stays bounded.
+static const double DELAY_PROB = 0.05;
+static const double DELAY_MEAN = 15.0;     // s
+static const double STRESS_WARM = 120.0;   // nominal lead-in before the window
+static const double STRESS_MIN_ESS = 30.0;  // below either, no variance-reduction claim
+static const int STRESS_MIN_HITS = 10;
+
+struct StressOutcome
+{
+    double peak = 0;        // most riders on the platform at once in the window
+    double logWeight = 0;   // log likelihood ratio nominal / proposal
+};
+
+// holdMean 0 and tilt 1 is plain Monte Carlo
+static StressOutcome stressRun(double perHour, double window, uint64_t seed, double tilt, double holdMean)
+{
+    Sim sim;
+    sim.clock = 180.0;          // no built-in riders
+    sim.clockRate = 0.0f;
+    initSim(sim);
+    auto uniform = [&]()
+    {
+        seed ^= seed >> 12; seed ^= seed << 25; seed ^= seed >> 27;
+        return ((seed * 2685821657736338717ull) >> 11) * (1.0 / 9007199254740992.0) + 1e-17;
+    };
+
+    double lambda = perHour / 3600.0, end = STRESS_WARM + window;
+    Interior ref;
+    buildInterior(ref, 4, 1, 1);
+    int stops = std::max(1, (int)std::ceil(window / surrogateKpi(ref, perHour, sim.trainSpeed, 80.0f).headway));
+    bool biased = holdMean > 0.0;
+    int pick = biased ? (int)(uniform() * stops) % stops : -1;
+
+    StressOutcome o;
+    double next = -std::log(uniform()) / lambda, ratioSum = 0.0;
+    int stop = 0, arrivals = 0;
+    TrainState prev = sim.state;
+    while (sim.time < end)
+    {
+        bool inWindow = sim.time >= STRESS_WARM;
+        double rate = inWindow ? lambda * tilt : lambda;
+        while (next <= sim.time + DT)
+        {
+            interiorArrive(sim.station, next, 80.0f, 0.0f, 0.0f);
+            arrivals += next >= STRESS_WARM && next < end;
+            double from = next;
+            next += -std::log(uniform()) / rate;
+            // The rate changes at the window start: redraw past it (memoryless)
+            if (from < STRESS_WARM && next >= STRESS_WARM && tilt != 1.0)
+                next = STRESS_WARM - std::log(uniform()) / (lambda * tilt);
+        }
+
+        // A stop's delay is drawn as the train reaches the red signal
+        if (sim.state == TS_STOPPED_SIGNAL_RED && prev != TS_STOPPED_SIGNAL_RED)
+        {
+            bool counted = inWindow && stop < stops;
+            double h = 0.0;
+            if (counted && stop == pick) h = -std::log(uniform()) * holdMean;
+            else if (uniform() < DELAY_PROB) h = -std::log(uniform()) * DELAY_MEAN;
+            sim.hold = (float)h;
+            if (counted && biased)
+                ratioSum += h > 0.0 ? (std::exp(-h / holdMean) / holdMean) /
+                                      (DELAY_PROB * std::exp(-h / DELAY_MEAN) / DELAY_MEAN) : 0.0;
+            stop += inWindow;
+        }
+        prev = sim.state;
+
+        stepSim(sim, DT);
+        if (sim.time < STRESS_WARM) continue;
+        int onPlatform = 0;
+        for (auto &p : sim.passengers) onPlatform += p.active;
+        o.peak = std::max(o.peak, (double)onPlatform);
+    }
+
+    if (biased)
+    {
+        ratioSum += std::max(0, stops - stop);        // stops the window never reached
+        o.logWeight = std::log((double)stops / ratioSum);
+    }
+    o.logWeight += -arrivals * std::log(tilt) + (tilt - 1.0) * lambda * window;
+    return o;
+}
+
+// --------------------------- Batch Worker Farm ---------------------------
+// Batch runs load the scenario once (network, travel-time matrix, day
+// table) and then fork() workers, which share all of it copy-on-write: a
+// worker's own memory is only what its simulations write. Jobs go to each
+// worker over its own pipe, results come back over one shared pipe (each
+// record is smaller than PIPE_BUF, so writes never interleave), and a
+// worker gets its next job as soon as a result arrives. The farm stays up
+// across calls so studies can dispatch further waves. A worker that dies
+// is reaped while the parent waits on the result pipe, and the jobs it
+// had queued go back to the others.
+enum { KPI_GATE_WAIT, KPI_ESC_WAIT, KPI_TRANSIT, KPI_HEADWAY, KPI_CROWD, KPI_PLATFORM_WAIT, BATCH_KPIS };
+static const char* const BATCH_KPI_NAME[BATCH_KPIS] = {
+    "gate wait", "escalator wait", "gate->platform", "headway", "platform crowd", "platform wait" };
+static const char* const BATCH_KPI_KEY[BATCH_KPIS] = {   // for --target
+    "gate", "escalator", "transit", "headway", "crowd", "wait" };
+
+enum { JOB_KPI, JOB_STRESS };
+
+struct BatchJob
+{
+    int32_t id;
+    int32_t kind;              // JOB_*
+    double perHour;
+    double seconds;
+    uint64_t seed;
+    double tilt, holdMean;     // stress proposal (see "Importance Sampling")
+};
+
+struct BatchResult
+{
+    int32_t id, worker;
+    double kpi[BATCH_KPIS];
+    double ms;                 // job CPU time
+    double privateKb;          // worker memory not shared with the parent
+    StressOutcome stress;
+};
+
+// Private (unshared) resident memory of this process, from smaps_rollup
+static double privateMemoryKb(const char* field = "Private_")
+{
+    double kb = 0.0;
+    FILE* f = std::fopen("/proc/self/smaps_rollup", "r");
+    if (!f) return 0.0;
+    char line[256];
+    size_t n = std::strlen(field);
+    while (std::fgets(line, sizeof line, f))
+        if (std::strncmp(line, field, n) == 0)
+            kb += std::atof(std::strchr(line, ':') + 1);
+    std::fclose(f);
+    return kb;
+}
+
+static BatchResult runBatchJob(const BatchJob& j)
+{
+    std::clock_t c0 = std::clock();
+    BatchResult r{};
+    r.id = j.id;
+    if (j.kind == JOB_STRESS)
+    {
+        r.stress = stressRun(j.perHour, j.seconds, j.seed, j.tilt, j.holdMean);
+        r.ms = 1000.0 * (std::clock() - c0) / CLOCKS_PER_SEC;
+        return r;
+    }
+    SimulatedKpi s = simulateKpi(j.perHour, j.seconds, j.seed);
+    r.kpi[KPI_GATE_WAIT] = s.wq[Q_GATES];
+    r.kpi[KPI_ESC_WAIT] = s.wq[Q_ESCALATOR];
+    r.kpi[KPI_TRANSIT] = s.transit;
+    r.kpi[KPI_HEADWAY] = s.headway;
+    r.kpi[KPI_CROWD] = s.platformCrowd;
+    r.kpi[KPI_PLATFORM_WAIT] = s.platformWait;
+    r.ms = 1000.0 * (std::clock() - c0) / CLOCKS_PER_SEC;
+    return r;
+}
+
+struct WorkerFarm
+{
+    int workers = 0;           // 0 = run jobs in this process
+    std::vector<int> pids;     // -1 once a worker has died
+    std::vector<int> jobFd;    // write ends, one per worker (-1: closed)
+    int resultFd = -1;         // read end shared by all workers
+};
+
+#ifdef METRO_FORK
+static bool writeAll(int fd, const void* p, size_t n)
+{
+    const char* c = (const char*)p;
+    while (n)
+    {
+        ssize_t w = write(fd, c, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        c += w; n -= (size_t)w;
+    }
+    return true;
+}
+
+static bool readAll(int fd, void* p, size_t n)
+{
+    char* c = (char*)p;
+    while (n)
+    {
+        ssize_t r = read(fd, c, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        c += r; n -= (size_t)r;
+    }
+    return true;
+}
+
+#ifndef METRO_LIBRARY
+static void workerLoop(int index, int jobIn, int resultOut)
+{
+    BatchJob j;
+    while (readAll(jobIn, &j, sizeof j))
+    {
+        BatchResult r = runBatchJob(j);
+        r.worker = index;
+        r.privateKb = privateMemoryKb();
+        if (!writeAll(resultOut, &r, sizeof r)) break;
+    }
+    _exit(0);
+}
+
+// No threads may be running here: only the forking thread survives in a child
+static bool startFarm(WorkerFarm& f, int workers)
+{
+    int res[2];
+    if (pipe(res) != 0) return false;
+    signal(SIGPIPE, SIG_IGN);      // a write to a dead worker fails with EPIPE instead
+    std::fflush(nullptr);
+    for (int w = 0; w < workers; w++)
+    {
+        int job[2];
+        if (pipe(job) != 0) break;
+        pid_t pid = fork();
+        if (pid < 0) { close(job[0]); close(job[1]); break; }
+        if (pid == 0)
+        {
+            // Drop every write end but our result pipe, so EOF reaches each worker
+            for (int fd : f.jobFd) close(fd);
+            close(job[1]);
+            close(res[0]);
+            workerLoop(w, job[0], res[1]);
+        }
+        close(job[0]);
+        f.pids.push_back(pid);
+        f.jobFd.push_back(job[1]);
+    }
+    close(res[1]);
+    f.resultFd = res[0];
+    f.workers = (int)f.pids.size();
+    return f.workers == workers;
+}
+
+static void stopFarm(WorkerFarm& f)
+{
+    for (int fd : f.jobFd) if (fd >= 0) close(fd);
+    for (int pid : f.pids) if (pid > 0) waitpid(pid, nullptr, 0);
+    if (f.resultFd >= 0) close(f.resultFd);
+    f = WorkerFarm();
+}
+#endif
+#elif !defined(METRO_LIBRARY)
+static bool startFarm(WorkerFarm&, int) { return false; }
+static void stopFarm(WorkerFarm& f) { f = WorkerFarm(); }
+#endif
+
+// Run all jobs, calling onResult as each finishes (in completion order);
+// each worker has up to two jobs queued so it never idles on a round trip.
+// Workers answer their jobs in order, so a result retires the oldest job
+// queued to its worker. The pipe is only checked for dead workers once it
+// is drained, so every result a dead worker wrote is counted before its
+// remaining jobs are requeued. False if every worker is gone.
+template <class Fn>
+static bool farmRun(WorkerFarm& f, const std::vector<BatchJob>& jobs, Fn onResult)
+{
+#ifdef METRO_FORK
+    if (f.workers > 0)
+    {
+        std::deque<size_t> todo;
+        for (size_t i = 0; i < jobs.size(); i++) todo.push_back(i);
+        std::vector<std::deque<size_t>> queued(f.pids.size());
+        size_t done = 0;
+        while (done < jobs.size())
+        {
+            for (size_t w = 0; w < f.pids.size(); w++)
+                while (f.jobFd[w] >= 0 && queued[w].size() < 2 && !todo.empty())
+                {
+                    if (!writeAll(f.jobFd[w], &jobs[todo.front()], sizeof(BatchJob)))
+                    {
+                        close(f.jobFd[w]);          // EPIPE: it exited, reaped below
+                        f.jobFd[w] = -1;
+                        break;
+                    }
+                    queued[w].push_back(todo.front());
+                    todo.pop_front();
+                }
+            if (f.workers == 0) return false;
+
+            pollfd p = { f.resultFd, POLLIN, 0 };
+            int n = poll(&p, 1, 200);
+            if (n < 0 && errno != EINTR) return false;
+            if (n > 0 && (p.revents & POLLIN))
+            {
+                BatchResult r;
+                if (!readAll(f.resultFd, &r, sizeof r)) return false;
+                if (r.worker >= 0 && r.worker < (int)queued.size() && !queued[r.worker].empty())
+                    queued[r.worker].pop_front();
+                done++;
+                onResult(r);
+                continue;
+            }
+
+            for (size_t w = 0; w < f.pids.size(); w++)
+            {
+                if (f.pids[w] < 0 || waitpid(f.pids[w], nullptr, WNOHANG) != f.pids[w]) continue;
+                std::fprintf(stderr, "worker %zu died, requeueing %zu job(s)\n", w, queued[w].size());
+                for (auto it = queued[w].rbegin(); it != queued[w].rend(); ++it) todo.push_front(*it);
+                queued[w].clear();
+                if (f.jobFd[w] >= 0) close(f.jobFd[w]);
+                f.jobFd[w] = -1;
+                f.pids[w] = -1;
+                f.workers--;
+            }
+        }
+        return true;
+    }
+#else
+    (void)f;
+#endif
+    for (auto &j : jobs)
+    {
+        BatchResult r = runBatchJob(j);
+        r.privateKb = privateMemoryKb();
+        onResult(r);
+    }
+    return true;
+}
+
+#ifndef METRO_LIBRARY
+// Everything jobs read but never write, built before forking
+static void loadBatchScenario()
+{
+    buildDayTable();
+}
+#endif
+
+// Running mean and variance (Welford)
+struct KpiStats
+{
+    int n = 0;
+    double mean = 0.0, m2 = 0.0;
+    void add(double x)
+    {
+        n++;
+        double d = x - mean;
+        mean += d / n;
+        m2 += d * (x - mean);
+    }
+    double sd() const { return n > 1 ? std::sqrt(m2 / (n - 1)) : 0.0; }
+};
+
+#ifndef METRO_LIBRARY
+// Standard normal quantile (Abramowitz & Stegun 26.2.23, |error| < 4.5e-4)
+static double normalQuantile(double p)
+{
+    double q = p < 0.5 ? p : 1.0 - p;
+    double t = std::sqrt(-2.0 * std::log(q));
+    double z = t - (2.515517 + 0.802853 * t + 0.010328 * t * t) /
+                   (1.0 + 1.432788 * t + 0.189269 * t * t + 0.001308 * t * t * t);
+    return p < 0.5 ? -z : z;
+}
+
+// Student t quantile by the Cornish-Fisher expansion (A&S 26.7.5)
+static double studentQuantile(double p, int dof)
+{
+    double z = normalQuantile(p), v = std::max(1, dof);
+    double z2 = z * z, z3 = z2 * z, z5 = z3 * z2, z7 = z5 * z2;
+    return z + (z3 + z) / (4.0 * v) + (5.0 * z5 + 16.0 * z3 + 3.0 * z) / (96.0 * v * v) +
+           (3.0 * z7 + 19.0 * z5 + 17.0 * z3 - 15.0 * z) / (384.0 * v * v * v);
+}
+
+// Confidence half-width of the mean
+static double halfWidth(const KpiStats& s, double confidence)
+{
+    if (s.n < 2) return INFINITY;
+    return studentQuantile(0.5 + 0.5 * confidence, s.n - 1) * s.sd() / std::sqrt((double)s.n);
+}
+
+// --batch <n>: replications of the scene station at --batch-rate pax/h.
+// Without targets that is n runs in one go. With targets (relative
+// half-width per KPI, 0 = not tracked) runs go out in waves of at least one
+// per worker: after each wave the half-widths are checked, the runs still
+// needed are estimated from the current variance, and the study stops as
+// soon as every target is met, or at n runs. Stopping is only decided at
+// wave ends, so a run's duration cannot bias which runs are counted.
+static bool runBatch(int maxRuns, int workers, double perHour, double seconds,
+                     const double* target, double confidence)
+{
+    auto t0 = std::chrono::steady_clock::now();
+    loadBatchScenario();
+    double loadMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+    WorkerFarm farm;
+    auto t1 = std::chrono::steady_clock::now();
+    if (workers > 1 && !startFarm(farm, workers))
+        std::fprintf(stderr, "fork failed, running %d of %d workers\n", farm.workers, workers);
+    double forkMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t1).count();
+    int slots = std::max(1, farm.workers);
+
+    bool sequential = false;
+    for (int k = 0; k < BATCH_KPIS; k++) sequential |= target[k] > 0.0;
+
+    KpiStats stats[BATCH_KPIS];
+    double jobMs = 0.0, maxPrivate = 0.0;
+    int issued = 0, waves = 0;
+    bool ok = true, met = !sequential;
+    auto t2 = std::chrono::steady_clock::now();
+    // Pilot wave big enough for a usable variance estimate
+    int wave = sequential ? std::min(maxRuns, std::max(10, 2 * slots)) : maxRuns;
+    while (ok && wave > 0)
+    {
+        std::vector<BatchJob> jobs;
+        for (int i = 0; i < wave; i++, issued++)
+            jobs.push_back({ issued, JOB_KPI, perHour, seconds, 0x9e3779b97f4a7c15ull * (uint64_t)(issued + 1), 1.0, 0.0 });
+        ok = farmRun(farm, jobs, [&](const BatchResult& r)
+        {
+            for (int k = 0; k < BATCH_KPIS; k++) stats[k].add(r.kpi[k]);
+            jobMs += r.ms;
+            maxPrivate = std::max(maxPrivate, r.privateKb);
+        });
+        waves++;
+        if (!sequential) break;
+
+        // Runs each target still needs: n * (half-width / goal)^2
+        int need = 0;
+        met = true;
+        std::printf("wave %d: %d runs", waves, stats[0].n);
+        for (int k = 0; k < BATCH_KPIS; k++)
+        {
+            if (target[k] <= 0.0) continue;
+            double hw = halfWidth(stats[k], confidence), goal = target[k] * std::fabs(stats[k].mean);
+            std::printf("  %s +-%.2f%%", BATCH_KPI_NAME[k], 100.0 * hw / std::max(1e-12, std::fabs(stats[k].mean)));
+            if (hw <= goal) continue;
+            met = false;
+            double ratio = goal > 0.0 ? hw / goal : 1e3;
+            need = std::max(need, (int)std::ceil(stats[k].n * ratio * ratio) - stats[k].n);
+        }
+        std::printf("\n");
+        if (met) break;
+        // Round up to whole waves so no worker idles
+        wave = std::min(maxRuns - issued, (std::max(need, 1) + slots - 1) / slots * slots);
+    }
+    double wallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t2).count();
+    int forked = farm.workers, got = stats[0].n;
+    stopFarm(farm);
+
+    std::printf("batch: %d runs of %.0f s at %.0f pax/h on %d worker%s%s\n", got, seconds, perHour,
+                std::max(1, forked), forked > 1 ? "s" : "", forked ? "" : " (in process)");
+    if (sequential)
+        std::printf("%s after %d wave%s (%.0f%% confidence, at most %d runs)\n",
+                    met ? "all targets met" : "run limit reached before the targets", waves,
+                    waves == 1 ? "" : "s", 100.0 * confidence, maxRuns);
+    std::printf("scenario loaded once in %.2f ms, workers forked in %.2f ms\n", loadMs, forkMs);
+    std::printf("%.1f ms wall, %.1f ms of simulation CPU time (%.2fx)\n", wallMs, jobMs, jobMs / std::max(1e-9, wallMs));
+    std::printf("memory: parent resident %.0f KB, largest worker private %.0f KB\n",
+                privateMemoryKb("Rss"), maxPrivate);
+    for (int k = 0; k < BATCH_KPIS && got; k++)
+    {
+        std::printf("  %-15s mean %8.3f  sd %7.3f  +- %7.3f", BATCH_KPI_NAME[k], stats[k].mean, stats[k].sd(),
+                    halfWidth(stats[k], confidence));
+        if (target[k] > 0.0) std::printf("  (target +-%.2f%%)", 100.0 * target[k]);
+        std::printf("\n");
+    }
+    if (!ok) std::fprintf(stderr, "a worker exited early; %d of %d runs finished\n", got, issued);
+    return ok;
+}
+
+// --stress <n>: P(platform crowd > --capacity within a --stress-window
+// window) from n stress runs, by importance sampling and, for comparison,
+// by as many plain Monte Carlo runs
+static bool runImportance(int runs, int workers, double perHour, double window, double capacity,
+                          double tilt, double holdMean)
+{
+    loadBatchScenario();
+    WorkerFarm farm;
+    if (workers > 1 && !startFarm(farm, workers))
+        std::fprintf(stderr, "fork failed, running %d of %d workers\n", farm.workers, workers);
+
+    struct Estimate { double sum = 0, sq = 0, wsum = 0, w2sum = 0, peak = 0, p = 0, hw = 0; int hits = 0, n = 0; };
+    auto study = [&](bool biased, Estimate& e)
+    {
+        std::vector<BatchJob> jobs;
+        for (int i = 0; i < runs; i++)
+            jobs.push_back({ i, JOB_STRESS, perHour, window, 0xd1b54a32d192ed03ull * (uint64_t)(i + 1) + biased,
+                             biased ? tilt : 1.0, biased ? holdMean : 0.0 });
+        auto t0 = std::chrono::steady_clock::now();
+        bool ok = farmRun(farm, jobs, [&](const BatchResult& r)
+        {
+            double w = std::exp(r.stress.logWeight), x = r.stress.peak > capacity ? w : 0.0;
+            e.sum += x; e.sq += x * x;
+            e.wsum += w; e.w2sum += w * w;
+            e.hits += r.stress.peak > capacity;
+            e.peak = std::max(e.peak, r.stress.peak);
+            e.n++;
+        });
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        double p = e.p = e.sum / std::max(1, e.n);
+        double var = e.n > 1 ? (e.sq / e.n - p * p) * e.n / (e.n - 1) : 0.0;
+        double hw = e.hw = 1.96 * std::sqrt(std::max(0.0, var) / std::max(1, e.n));
+        std::printf("  %-17s P = %.3e +- %.1e (95%%)  %d of %d runs over capacity, highest %.0f  %.0f ms\n",
+                    biased ? "importance" : "plain Monte Carlo", p, hw, e.hits, e.n, e.peak, ms);
+        return ok;
+    };
+
+    std::printf("stress: %.0f pax/h, %.0f s window, capacity %.0f riders, stops held with p %.2f "
+                "for Exp(%.0f s)\n", perHour, window, capacity, DELAY_PROB, DELAY_MEAN);
+    std::printf("proposal: demand x%.2f, one stop held for Exp(%.0f s)\n", tilt, holdMean);
+    Estimate is, mc;
+    bool ok = study(true, is) && study(false, mc);
+    stopFarm(farm);
+
+    // Runs plain Monte Carlo would need for the importance estimate's
+    // precision. With a handful of hits or a few dominant weights the sample
+    // variance itself is unreliable, so the ratio is withheld.
+    double p = is.p;
+    double varIs = std::max(1e-300, is.sq / std::max(1, is.n) - p * p);
+    double ess = is.wsum * is.wsum / std::max(1e-300, is.w2sum);
+    if (p <= 0.0)
+        std::printf("no importance run went over capacity: no estimate\n");
+    else if (ess < STRESS_MIN_ESS || is.hits < STRESS_MIN_HITS)
+        std::printf("variance reduction not reported: effective sample size %.0f, %d runs over capacity "
+                    "(need %.0f and %d); relative half-width %.2g\n",
+                    ess, is.hits, STRESS_MIN_ESS, STRESS_MIN_HITS, is.hw / p);
+    else
+        std::printf("variance reduction %.2gx (plain Monte Carlo would need about %.2g runs), relative "
+                    "half-width %.2g; effective sample size %.0f\n", p * (1.0 - p) / varIs,
+                    runs * p * (1.0 - p) / varIs, is.hw / p, ess);
+    return ok;
+}
+#endif
+
+// --------------------------- What-If Branches ---------------------------
+// "What happens over the next half hour if we hold this train?" The live
+// sim is fork()ed once per intervention: each child starts from an exact
+// copy-on-write snapshot (only pages it writes get copied), applies its
+// change, runs headless faster than real time and sends its KPIs back over
+// a pipe. The live sim keeps running; results are collected as they land.
+struct WhatIf
+{
+    const char* name;
+    float hold;          // seconds the next train is held at the signal
+    int gates, escalators;   // change in open servers
+};
+
+static const WhatIf WHAT_IFS[] = {
+    { "as is",                 0.0f,  0, 0 },
+    { "hold next train 1 min", 60.0f, 0, 0 },
+    { "hold next train 2 min", 120.0f, 0, 0 },
+    { "close one gate",        0.0f, -1, 0 },
+    { "open a 2nd escalator",  0.0f,  0, 1 },
+};
+static const int WHAT_IF_COUNT = (int)(sizeof WHAT_IFS / sizeof WHAT_IFS[0]);
+
+struct BranchKpi
+{
+    int32_t branch;
+    double boarded;        // riders who boarded within the horizon
+    double trains;         // departures
+    double meanCrowd, peakCrowd;
+    double stationDelay;   // mean queueing inside the station per rider, s
+    double ms, privateKb;
+};
+
+#ifndef METRO_LIBRARY
+// The branch runs the day clock at real time, so `minutes` of sim time is
+// also `minutes` on the clock the study is labelled with
+static BranchKpi runBranch(Sim& sim, int branch, double minutes)
+{
+    std::clock_t c0 = std::clock();
+    const WhatIf& w = WHAT_IFS[branch];
+    sim.clockRate = 1.0f / 60.0f;
+    sim.hold += w.hold;
+    QNode& gates = sim.station.nodes[Q_GATES];
+    QNode& esc = sim.station.nodes[Q_ESCALATOR];
+    gates.servers = std::max(1, gates.servers + w.gates);
+    esc.servers = std::max(1, esc.servers + w.escalators);
+    sim.showCrowd = false;
+
+    uint64_t boarded0 = sim.boarded, served0 = gates.served;
+    int cycle0 = sim.cycle;
+    double wait0 = 0.0;
+    for (auto &n : sim.station.nodes) wait0 += n.waitSum;
+
+    BranchKpi k{};
+    k.branch = branch;
+    long ticks = (long)(minutes * 60.0 / DT);
+    double crowdSum = 0.0;
+    for (long t = 0; t < ticks; t++)
+    {
+        stepSim(sim, DT);
+        int onPlatform = 0;
+        for (auto &p : sim.passengers) onPlatform += p.active;
+        crowdSum += onPlatform;
+        k.peakCrowd = std::max(k.peakCrowd, (double)onPlatform);
+    }
+    double wait = -wait0;
+    for (auto &n : sim.station.nodes) wait += n.waitSum;
+    uint64_t riders = gates.served - served0;
+
+    k.boarded = (double)(sim.boarded - boarded0);
+    k.trains = sim.cycle - cycle0;
+    k.meanCrowd = ticks ? crowdSum / ticks : 0.0;
+    k.stationDelay = riders ? wait / riders : 0.0;
+    k.ms = 1000.0 * (std::clock() - c0) / CLOCKS_PER_SEC;
+    return k;
+}
+#endif
+
+struct WhatIfStudy
+{
+    bool running = false;
+    double minutes = 0, startClock = 0;
+    int fd = -1;
+    std::vector<int> pids;
+    std::vector<BranchKpi> results;
+    ThreadPool* pool = nullptr;      // no fork: branches run on copies here
+    std::atomic<int> pending{ 0 };
+    std::chrono::steady_clock::time_point start;
+};
+
+#ifndef METRO_LIBRARY
+// Fork one branch per intervention from `sim`; the caller keeps running.
+// Without fork, or when other threads are running (!mayFork), each branch
+// runs on a copy on a thread pool (tap records not followed).
+static bool startWhatIf(WhatIfStudy& s, Sim& sim, double minutes, bool mayFork = true)
+{
+    if (s.running) return false;
+    s.fd = -1;
+    s.pids.clear();
+    s.results.clear();
+    s.minutes = minutes;
+    s.startClock = sim.clock;
+    s.start = std::chrono::steady_clock::now();
+#ifdef METRO_FORK
+    int res[2];
+    if (mayFork && pipe(res) == 0)
+    {
+        std::fflush(nullptr);
+        for (int b = 0; b < WHAT_IF_COUNT; b++)
+        {
+            pid_t pid = fork();
+            if (pid < 0) break;
+            if (pid == 0)
+            {
+                close(res[0]);
+                BranchKpi k = runBranch(sim, b, minutes);   // the child's own copy
+                k.privateKb = privateMemoryKb();
+                writeAll(res[1], &k, sizeof k);
+                _exit(0);
+            }
+            s.pids.push_back(pid);
+        }
+        close(res[1]);
+        fcntl(res[0], F_SETFL, fcntl(res[0], F_GETFL) | O_NONBLOCK);
+        s.fd = res[0];
+        s.running = true;
+        return !s.pids.empty();
+    }
+#else
+    (void)mayFork;
+#endif
+    s.results.resize(WHAT_IF_COUNT);
+    s.pending = WHAT_IF_COUNT;
+    s.pool = new ThreadPool(std::min(WHAT_IF_COUNT, (int)std::max(1u, std::thread::hardware_concurrency())));
+    WhatIfStudy* sp = &s;
+    for (int b = 0; b < WHAT_IF_COUNT; b++)
+    {
+        std::shared_ptr<Sim> copy = std::make_shared<Sim>(sim);
+        copy->taps = TapStream();
+        s.pool->submit([sp, copy, b, minutes]()
+        {
+            sp->results[b] = runBranch(*copy, b, minutes);
+            sp->pending--;
+        });
+    }
+    s.running = true;
+    return true;
+}
+
+static void printWhatIf(const WhatIfStudy& s)
+{
+    std::vector<BranchKpi> r = s.results;
+    std::sort(r.begin(), r.end(), [](const BranchKpi& a, const BranchKpi& b) { return a.branch < b.branch; });
+    double wallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - s.start).count();
+    int hh = (int)s.startClock / 60, mm = (int)s.startClock % 60;
+    std::printf("what-if from %02d:%02d, next %.0f min (%zu branches, %.0f ms wall):\n",
+                hh, mm, s.minutes, r.size(), wallMs);
+    std::printf("  %-22s %8s %7s %10s %10s %13s %9s %10s\n", "branch", "boarded", "trains",
+                "mean crowd", "peak crowd", "station delay", "run ms", "private KB");
+    for (auto &k : r)
+        std::printf("  %-22s %8.0f %7.0f %10.1f %10.0f %11.2f s %9.0f %10.0f\n", WHAT_IFS[k.branch].name,
+                    k.boarded, k.trains, k.meanCrowd, k.peakCrowd, k.stationDelay, k.ms, k.privateKb);
+    for (int b = 0, i = 0; b < WHAT_IF_COUNT; b++)
+    {
+        if (i < (int)r.size() && r[i].branch == b) { i++; continue; }
+        std::printf("  %-22s (no result: branch died)\n", WHAT_IFS[b].name);
+    }
+}
+
+#ifdef METRO_FORK
+// Read the branches that have finished off the pipe; false while more are
+// to come. A branch that dies just closes its end of the pipe, so the read
+// still ends once every child has exited.
+static bool readBranches(WhatIfStudy& s, bool wait)
+{
+    if (wait) fcntl(s.fd, F_SETFL, fcntl(s.fd, F_GETFL) & ~O_NONBLOCK);
+    BranchKpi k;
+    for (;;)
+    {
+        ssize_t n = read(s.fd, &k, sizeof k);
+        if (n == (ssize_t)sizeof k) { s.results.push_back(k); continue; }
+        if (n < 0 && errno == EINTR) continue;
+        if (n == 0 || s.results.size() == s.pids.size()) break;   // all written
+        if (n < 0 && errno == EAGAIN) return false;                 // more to come
+        break;
+    }
+    close(s.fd);
+    for (int pid : s.pids) waitpid(pid, nullptr, 0);
+    return true;
+}
+#endif
+
+// Non-blocking: collect whatever branches have finished; true when all are in
+static bool pollWhatIf(WhatIfStudy& s, bool wait = false)
+{
+    if (!s.running) return false;
+    if (s.pool)
+    {
+        if (!wait && s.pending.load() > 0) return false;
+        delete s.pool;      // joins the workers once the branches are done
+        s.pool = nullptr;
+    }
+#ifdef METRO_FORK
+    else if (!readBranches(s, wait)) return false;
+#endif
+    s.running = false;
+    printWhatIf(s);
+    return true;
+}
+
+// --what-if <minutes>: run --ticks of the scene, then branch and compare
+static void runWhatIfStudy(Sim& sim, int ticks, double minutes)
+{
+    for (int t = 0; t < ticks; t++) stepSim(sim, DT);
+    WhatIfStudy s;
+    startWhatIf(s, sim, minutes);
+    if (s.running) pollWhatIf(s, true);
+    else printWhatIf(s);
+}
+#endif
+
+// --------------------------- Train Fleet (SoA) ---------------------------
+// Fleet-scale version of the train state machine: one array per field, and
+// boarding abstracted to a rider count (each rider adds FLEET_BOARD_SECS to
+// the dwell). fleetStepScalar is the per-train switch, a direct transcription
+// of updateStateMachine. fleetStepMasked evaluates every state's update for
+// each train and keeps the right one with selects, so there is no branch on
+// state; with SSE2 it runs four trains per step. The two must produce
+// bit-identical fleets (holds as long as the compiler does not contract
+// x + speed * dt into an FMA in only one of them).
+static const float FLEET_BOARD_SECS = 0.25f;
+
+struct Fleet
+{
+    int n = 0;
+    std::vector<int32_t> state;
+    std::vector<float> timer;
+    std::vector<float> x;
+    std::vector<float> speed;
+    std::vector<float> wheel;
+    std::vector<float> door;
+    std::vector<int32_t> signal;
+    std::vector<int32_t> riders;    // waiting to board at next stop
+    std::vector<int32_t> cycle;
+    uint64_t boarded = 0;
+};
+
+static int32_t fleetRiders(int i, int32_t cycle) { return 2 + (i * 7 + cycle * 3) % 9; }
+
+static void initFleet(Fleet& f, int n)
+{
+    f.n = n;
+    f.state.assign(n, TS_MOVING_TO_STATION);
+    f.timer.assign(n, 0.0f);
+    f.x.resize(n);
+    f.speed.resize(n);
+    f.wheel.assign(n, 0.0f);
+    f.door.assign(n, 0.0f);
+    f.signal.assign(n, 1);
+    f.riders.resize(n);
+    f.cycle.assign(n, 0);
+    f.boarded = 0;
+    for (int i = 0; i < n; i++)
+    {
+        // Staggered starts and speeds so every state is populated
+        f.x[i] = -TRAIN_LENGTH + (float)((i * 37) % 900);
+        f.speed[i] = 180.0f + (float)((i * 13) % 80);
+        f.riders[i] = fleetRiders(i, 0);
+    }
+}
+
+static void fleetStepScalar(Fleet& f, float dt)
+{
+    for (int i = 0; i < f.n; i++)
+    {
+        f.timer[i] += dt;
+
+        auto wheelAdvance = [&]()
+        {
+            f.wheel[i] -= 360.0f * 1.2f * dt;
+            if (f.wheel[i] < -360.0f) f.wheel[i] += 360.0f;
+        };
+        auto go = [&](TrainState s) { f.state[i] = s; f.timer[i] = 0.0f; };
+
+        switch ((TrainState)f.state[i])
+        {
+            case TS_MOVING_TO_STATION:
+                f.signal[i] = 1;
+                f.door[i] = 0.0f;
+                f.x[i] += f.speed[i] * dt;
+                wheelAdvance();
+                if (f.x[i] >= STATION_STOP_X) { f.x[i] = STATION_STOP_X; go(TS_ARRIVING); }
+                break;
+
+            case TS_ARRIVING:
+                f.signal[i] = 1;
+                if (f.timer[i] > 0.35f) go(TS_STOPPED_SIGNAL_RED);
+                break;
+
+            case TS_STOPPED_SIGNAL_RED:
+                f.signal[i] = 0;
+                if (f.timer[i] > 0.6f) go(TS_DOORS_OPENING);
+                break;
+
+            case TS_DOORS_OPENING:
+                f.signal[i] = 0;
+                f.door[i] = std::min(1.0f, f.door[i] + 1.3f * dt);
+                if (f.door[i] >= 1.0f && f.timer[i] > 0.2f) go(TS_PASSENGERS_BOARDING);
+                break;
+
+            case TS_PASSENGERS_BOARDING:
+                f.signal[i] = 0;
+                if (f.timer[i] > 0.4f + FLEET_BOARD_SECS * f.riders[i])
+                {
+                    f.boarded += f.riders[i];
+                    f.riders[i] = 0;
+                    go(TS_DOORS_CLOSING);
+                }
+                break;
+
+            case TS_DOORS_CLOSING:
+                f.signal[i] = 0;
+                f.door[i] = std::max(0.0f, f.door[i] - 1.3f * dt);
+                if (f.door[i] <= 0.0f) go(TS_SIGNAL_GREEN_WAIT);
+                break;
+
+            case TS_SIGNAL_GREEN_WAIT:
+                f.signal[i] = 1;
+                if (f.timer[i] > 0.5f) go(TS_MOVING_AWAY);
+                break;
+
+            case TS_MOVING_AWAY:
+                f.signal[i] = 1;
+                f.x[i] += f.speed[i] * dt;
+                wheelAdvance();
+                if (f.x[i] > (float)W + 50.0f)
+                {
+                    f.x[i] = -TRAIN_LENGTH;
+                    f.door[i] = 0.0f;
+                    f.cycle[i]++;
+                    f.riders[i] = fleetRiders(i, f.cycle[i]);
+                    go(TS_MOVING_TO_STATION);
+                }
+                break;
+        }
+    }
+}
+
+// Branch-free update of train i (tail / non-SSE2 path of fleetStepMasked)
+static void fleetLaneMasked(Fleet& f, int i, float dt)
+{
+    const int s = f.state[i];
+    const float t = f.timer[i] + dt;
+    const bool mTo = s == TS_MOVING_TO_STATION, mAway = s == TS_MOVING_AWAY;
+    const bool opening = s == TS_DOORS_OPENING, closing = s == TS_DOORS_CLOSING;
+    const bool board = s == TS_PASSENGERS_BOARDING;
+    const bool moving = mTo | mAway;
+
+    float nx = f.x[i] + f.speed[i] * dt;
+    float w = f.wheel[i] - 360.0f * 1.2f * dt;
+    w = w < -360.0f ? w + 360.0f : w;
+
+    float dOpen = std::min(1.0f, f.door[i] + 1.3f * dt);
+    float dClose = std::max(0.0f, f.door[i] - 1.3f * dt);
+
+    float th = s == TS_ARRIVING ? 0.35f : s == TS_STOPPED_SIGNAL_RED ? 0.6f :
+               opening ? 0.2f : s == TS_SIGNAL_GREEN_WAIT ? 0.5f :
+               0.4f + FLEET_BOARD_SECS * f.riders[i];
+    bool cTimer = t > th;
+    bool cArr = mTo & (nx >= STATION_STOP_X);
+    bool cWrap = mAway & (nx > (float)W + 50.0f);
+    bool c = (cArr | cWrap) | (opening & (dOpen >= 1.0f) & cTimer) | (closing & (dClose <= 0.0f)) |
+             (!(moving | opening | closing) & cTimer);
+
+    f.x[i] = moving ? (cArr ? STATION_STOP_X : cWrap ? -TRAIN_LENGTH : nx) : f.x[i];
+    f.wheel[i] = moving ? w : f.wheel[i];
+    f.door[i] = (mTo | cWrap) ? 0.0f : opening ? dOpen : closing ? dClose : f.door[i];
+    f.signal[i] = (s <= TS_ARRIVING) | (s >= TS_SIGNAL_GREEN_WAIT);
+
+    bool cb = board & c;
+    f.boarded += cb ? (uint64_t)f.riders[i] : 0;
+    f.cycle[i] += cWrap;
+    f.riders[i] = cb ? 0 : cWrap ? fleetRiders(i, f.cycle[i]) : f.riders[i];
+    f.state[i] = c ? (s + 1) & 7 : s;
+    f.timer[i] = c ? 0.0f : t;
+}
+
+static void fleetStepMasked(Fleet& f, float dt)
+{
+    int i = 0;
+#ifdef METRO_SSE2
+    const __m128 vdt = _mm_set1_ps(dt);
+    const __m128 wheelStep = _mm_set1_ps(360.0f * 1.2f * dt);
+    const __m128 doorStep = _mm_set1_ps(1.3f * dt);
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+    const __m128i izero = _mm_setzero_si128();
+    auto sel = [](__m128 m, __m128 a, __m128 b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); };
+    auto isel = [](__m128i m, __m128i a, __m128i b) { return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b)); };
+    auto stateIs = [](__m128i s, int v) { return _mm_castsi128_ps(_mm_cmpeq_epi32(s, _mm_set1_epi32(v))); };
+
+    for (; i + 4 <= f.n; i += 4)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i*)&f.state[i]);
+        __m128i riders = _mm_loadu_si128((const __m128i*)&f.riders[i]);
+        __m128 t = _mm_add_ps(_mm_loadu_ps(&f.timer[i]), vdt);
+        __m128 x = _mm_loadu_ps(&f.x[i]);
+        __m128 door = _mm_loadu_ps(&f.door[i]);
+        __m128 wheel = _mm_loadu_ps(&f.wheel[i]);
+
+        __m128 mTo = stateIs(s, TS_MOVING_TO_STATION), mAway = stateIs(s, TS_MOVING_AWAY);
+        __m128 opening = stateIs(s, TS_DOORS_OPENING), closing = stateIs(s, TS_DOORS_CLOSING);
+        __m128 board = stateIs(s, TS_PASSENGERS_BOARDING);
+        __m128 moving = _mm_or_ps(mTo, mAway);
+
+        __m128 nx = _mm_add_ps(x, _mm_mul_ps(_mm_loadu_ps(&f.speed[i]), vdt));
+        __m128 w = _mm_sub_ps(wheel, wheelStep);
+        w = sel(_mm_cmplt_ps(w, _mm_set1_ps(-360.0f)), _mm_add_ps(w, _mm_set1_ps(360.0f)), w);
+
+        __m128 dOpen = _mm_min_ps(_mm_add_ps(door, doorStep), one);
+        __m128 dClose = _mm_max_ps(_mm_sub_ps(door, doorStep), zero);
+
+        __m128 th = _mm_add_ps(_mm_set1_ps(0.4f), _mm_mul_ps(_mm_set1_ps(FLEET_BOARD_SECS), _mm_cvtepi32_ps(riders)));
+        th = sel(stateIs(s, TS_ARRIVING), _mm_set1_ps(0.35f), th);
+        th = sel(stateIs(s, TS_STOPPED_SIGNAL_RED), _mm_set1_ps(0.6f), th);
+        th = sel(opening, _mm_set1_ps(0.2f), th);
+        th = sel(stateIs(s, TS_SIGNAL_GREEN_WAIT), _mm_set1_ps(0.5f), th);
+        __m128 cTimer = _mm_cmpgt_ps(t, th);
+
+        __m128 cArr = _mm_and_ps(mTo, _mm_cmpge_ps(nx, _mm_set1_ps(STATION_STOP_X)));
+        __m128 cWrap = _mm_and_ps(mAway, _mm_cmpgt_ps(nx, _mm_set1_ps((float)W + 50.0f)));
+        __m128 other = _mm_andnot_ps(_mm_or_ps(moving, _mm_or_ps(opening, closing)), _mm_castsi128_ps(_mm_set1_epi32(-1)));
+        __m128 c = _mm_or_ps(_mm_or_ps(cArr, cWrap),
+                   _mm_or_ps(_mm_and_ps(opening, _mm_and_ps(_mm_cmpge_ps(dOpen, one), cTimer)),
+                   _mm_or_ps(_mm_and_ps(closing, _mm_cmple_ps(dClose, zero)), _mm_and_ps(other, cTimer))));
+
+        __m128 mx = sel(cArr, _mm_set1_ps(STATION_STOP_X), sel(cWrap, _mm_set1_ps(-TRAIN_LENGTH), nx));
+        _mm_storeu_ps(&f.x[i], sel(moving, mx, x));
+        _mm_storeu_ps(&f.wheel[i], sel(moving, w, wheel));
+        __m128 nd = sel(opening, dOpen, sel(closing, dClose, door));
+        _mm_storeu_ps(&f.door[i], sel(_mm_or_ps(mTo, cWrap), zero, nd));
+
+        // Green in MOVING_TO_STATION, ARRIVING, SIGNAL_GREEN_WAIT, MOVING_AWAY
+        __m128i green = _mm_or_si128(_mm_cmplt_epi32(s, _mm_set1_epi32(TS_STOPPED_SIGNAL_RED)),
+                                     _mm_cmpgt_epi32(s, _mm_set1_epi32(TS_DOORS_CLOSING)));
+        _mm_storeu_si128((__m128i*)&f.signal[i], _mm_and_si128(green, _mm_set1_epi32(1)));
+
+        __m128i ic = _mm_castps_si128(c);
+        __m128i cb = _mm_and_si128(_mm_castps_si128(board), ic);
+        __m128i got = _mm_and_si128(cb, riders);
+        alignas(16) int32_t lanes[4];
+        _mm_store_si128((__m128i*)lanes, got);
+        f.boarded += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+        __m128i iwrap = _mm_castps_si128(cWrap);
+        __m128i cyc = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)&f.cycle[i]), iwrap);  // mask is -1
+        _mm_storeu_si128((__m128i*)&f.cycle[i], cyc);
+        _mm_storeu_si128((__m128i*)&f.riders[i], isel(cb, izero, riders));
+        if (_mm_movemask_ps(cWrap))
+        {
+            // New riders on wrap (rare): integer modulo has no SSE2 form
+            int m = _mm_movemask_ps(cWrap);
+            for (int k = 0; k < 4; k++)
+                if (m & (1 << k)) f.riders[i + k] = fleetRiders(i + k, f.cycle[i + k]);
+        }
+
+        __m128i next = _mm_and_si128(_mm_add_epi32(s, _mm_set1_epi32(1)), _mm_set1_epi32(7));
+        _mm_storeu_si128((__m128i*)&f.state[i], isel(ic, next, s));
+        _mm_storeu_ps(&f.timer[i], sel(c, zero, t));
+    }
+#endif
+    for (; i < f.n; i++) fleetLaneMasked(f, i, dt);
+}
+
+#ifndef METRO_LIBRARY
+static bool fleetsEqual(const Fleet& a, const Fleet& b)
+{
+    return a.state == b.state && a.timer == b.timer && a.x == b.x && a.wheel == b.wheel &&
+           a.door == b.door && a.signal == b.signal && a.riders == b.riders &&
+           a.cycle == b.cycle && a.boarded == b.boarded;
+}
+
+// Run both steppers side by side; report per-tick cost and equivalence
+static bool benchFleet(int trains, int ticks)
+{
+    Fleet a, b;
+    initFleet(a, trains);
+    initFleet(b, trains);
+
+    double msScalar = 0, msMasked = 0;
+    int firstDiff = -1;
+    for (int t = 0; t < ticks; t++)
+    {
+        auto t0 = std::chrono::steady_clock::now();
+        fleetStepScalar(a, DT);
+        auto t1 = std::chrono::steady_clock::now();
+        fleetStepMasked(b, DT);
+        auto t2 = std::chrono::steady_clock::now();
+        msScalar += std::chrono::duration<double, std::milli>(t1 - t0).count();
+        msMasked += std::chrono::duration<double, std::milli>(t2 - t1).count();
+        if (firstDiff < 0 && !fleetsEqual(a, b)) firstDiff = t;
+    }
+
+    std::printf("fleet %d trains x %d ticks: scalar %.4f ms/tick, masked %.4f ms/tick, boarded %llu\n",
+                trains, ticks, msScalar / ticks, msMasked / ticks, (unsigned long long)b.boarded);
+    if (firstDiff >= 0) std::printf("MISMATCH first at tick %d\n", firstDiff);
+    else                std::printf("results identical\n");
+    return firstDiff < 0;
+}
+#endif
+
+// --------------------------- Software Rasterizer ---------------------------
+// Renders into a caller-owned RGBA8 buffer (rows top-down), no window or GL
+// needed. Follows GL's fill rules closely enough that the output matches the
+// windowed scene: pixel centres decide rect coverage, points are size x size
+// squares centred on the transformed vertex.
+//
+// Anti-aliasing modes: AA_OFF is the above. AA_HARD and AA_COVERAGE take
+// lines and circles as geometry; AA_HARD covers a pixel by its centre (what
+// supersampling renders at a multiple of the size), AA_COVERAGE blends it
+// by the covered fraction: exact area for axis-aligned rects and points,
+// distance to the edge for strokes and rotated quads.
+enum { AA_OFF, AA_HARD, AA_COVERAGE };
+
+struct SoftBackend : RenderBackend
+{
+    // x' = a*x + c*y + e ; y' = b*x + d*y + f  (scene units -> pixels)
+    struct Mat { float a, b, c, d, e, f; };
+
+    uint8_t* px = nullptr;
+    int fbW = 0, fbH = 0;
+    size_t stride = 0;           // bytes per row
+
+    Mat m;
+    std::vector<Mat> stack;
+    uint32_t rgba = 0;
+    float ptSize = 1.0f;
+    float unit = 1.0f;           // pixels per scene unit (point size scaling)
+    bool bgra = false;           // write B,G,R,A (X11 TrueColor) instead of R,G,B,A
+    int aa = AA_OFF;
+
+    // Pixels written since resetTouched(): [tx0,tx1) x [ty0,ty1)
+    int tx0 = 0, ty0 = 0, tx1 = 0, ty1 = 0;
+
+    const char* name() const override { return "soft"; }
+
+    void resetTouched() { tx0 = fbW; ty0 = fbH; tx1 = 0; ty1 = 0; }
+    void touch(int x0, int y0, int x1, int y1)
+    {
+        if (x0 >= x1 || y0 >= y1) return;
+        tx0 = std::min(tx0, x0); ty0 = std::min(ty0, y0);
+        tx1 = std::max(tx1, x1); ty1 = std::max(ty1, y1);
+    }
+
+    void target(uint8_t* pixels, int w, int h, size_t rowBytes)
+    {
+        px = pixels; fbW = w; fbH = h; stride = rowBytes;
+        // Scene is y-up over W x H; buffer rows go top-down
+        m = { (float)w / W, 0, 0, -(float)h / H, 0, (float)h };
+        unit = (float)w / W;
+        stack.clear();
+    }
+
+    uint32_t* row(int y) { return (uint32_t*)(px + (size_t)y * stride); }
+
+    void xform(float x, float y, float& ox, float& oy) const
+    {
+        ox = m.a * x + m.c * y + m.e;
+        oy = m.b * x + m.d * y + m.f;
+    }
+
+    // Fill pixels whose centres lie in [x0,x1) x [y0,y1) (pixel space)
+    void fillBox(float x0, float y0, float x1, float y1)
+    {
+        int ix0 = std::max(0, (int)std::ceil(x0 - 0.5f));
+        int ix1 = std::min(fbW, (int)std::ceil(x1 - 0.5f));
+        int iy0 = std::max(0, (int)std::ceil(y0 - 0.5f));
+        int iy1 = std::min(fbH, (int)std::ceil(y1 - 0.5f));
+        touch(ix0, iy0, ix1, iy1);
+        for (int y = iy0; y < iy1; y++)
+            std::fill(row(y) + ix0, row(y) + std::max(ix0, ix1), rgba);
+    }
+
+    // Convex quad (any winding) via edge functions over its bounding box
+    void fillQuad(const float* qx, const float* qy)
+    {
+        float minX = std::min(std::min(qx[0], qx[1]), std::min(qx[2], qx[3]));
+        float maxX = std::max(std::max(qx[0], qx[1]), std::max(qx[2], qx[3]));
+        float minY = std::min(std::min(qy[0], qy[1]), std::min(qy[2], qy[3]));
+        float maxY = std::max(std::max(qy[0], qy[1]), std::max(qy[2], qy[3]));
+        int pad = aa == AA_COVERAGE ? 1 : 0;
+        int ix0 = std::max(0, (int)std::floor(minX) - pad), ix1 = std::min(fbW, (int)std::ceil(maxX) + pad);
+        int iy0 = std::max(0, (int)std::floor(minY) - pad), iy1 = std::min(fbH, (int)std::ceil(maxY) + pad);
+        touch(ix0, iy0, ix1, iy1);
+
+        float area = 0;
+        for (int i = 0; i < 4; i++)
+            area += qx[i] * qy[(i + 1) & 3] - qx[(i + 1) & 3] * qy[i];
+        float sgn = area < 0 ? -1.0f : 1.0f;
+
+        if (aa == AA_COVERAGE)
+        {
+            // Signed distance to the nearest edge, +0.5 px
+            float inv[4];
+            for (int i = 0; i < 4; i++)
+            {
+                int j = (i + 1) & 3;
+                float len = std::hypot(qx[j] - qx[i], qy[j] - qy[i]);
+                inv[i] = len > 0 ? sgn / len : 0.0f;
+            }
+            for (int y = iy0; y < iy1; y++)
+                for (int x = ix0; x < ix1; x++)
+                {
+                    float cx = x + 0.5f, cy = y + 0.5f, d = 1e9f;
+                    for (int i = 0; i < 4; i++)
+                    {
+                        int j = (i + 1) & 3;
+                        if (inv[i] != 0)
+                            d = std::min(d, ((qx[j] - qx[i]) * (cy - qy[i]) - (qy[j] - qy[i]) * (cx - qx[i])) * inv[i]);
+                    }
+                    cover(x, y, d + 0.5f);
+                }
+            return;
+        }
+
+        for (int y = iy0; y < iy1; y++)
+        {
+            float cy = y + 0.5f;
+            uint32_t* r = row(y);
+            for (int x = ix0; x < ix1; x++)
+            {
+                float cx = x + 0.5f;
+                bool in = true;
+                for (int i = 0; i < 4 && in; i++)
+                {
+                    int j = (i + 1) & 3;
+                    float e = (qx[j] - qx[i]) * (cy - qy[i]) - (qy[j] - qy[i]) * (cx - qx[i]);
+                    in = e * sgn >= 0;
+                }
+                if (in) r[x] = rgba;
+            }
+        }
+    }
+
+    // Blend the current colour into a pixel by coverage c (AA_HARD: all or nothing)
+    void cover(int x, int y, float c)
+    {
+        uint32_t* p = row(y) + x;
+        if (aa == AA_HARD ? c >= 0.5f : c >= 1.0f) { *p = rgba; return; }
+        int a = aa == AA_HARD ? 0 : (int)(c * 255.0f + 0.5f);
+        if (a <= 0) return;
+        const uint8_t* s = (const uint8_t*)&rgba;
+        uint8_t* d = (uint8_t*)p;
+        for (int k = 0; k < 3; k++) d[k] = (uint8_t)((s[k] * a + d[k] * (255 - a) + 127) / 255);
+        d[3] = (uint8_t)((255 * a + d[3] * (255 - a) + 127) / 255);
+    }
+
+    // Area coverage of [x0,x1) x [y0,y1): the interior is filled, the rim
+    // pixels blended by the fraction inside
+    void fillBoxCoverage(float x0, float y0, float x1, float y1)
+    {
+        int ix0 = std::max(0, (int)std::floor(x0)), ix1 = std::min(fbW, (int)std::ceil(x1));
+        int iy0 = std::max(0, (int)std::floor(y0)), iy1 = std::min(fbH, (int)std::ceil(y1));
+        if (ix0 >= ix1 || iy0 >= iy1) return;
+        touch(ix0, iy0, ix1, iy1);
+        int fx0 = std::max(ix0, (int)std::ceil(x0)), fx1 = std::min(ix1, (int)std::floor(x1));
+        for (int y = iy0; y < iy1; y++)
+        {
+            float cy = std::min(y + 1.0f, y1) - std::max((float)y, y0);
+            if (cy >= 1.0f && fx0 < fx1)
+            {
+                std::fill(row(y) + fx0, row(y) + fx1, rgba);
+                for (int x = ix0; x < fx0; x++) cover(x, y, std::min(x + 1.0f, x1) - std::max((float)x, x0));
+                for (int x = fx1; x < ix1; x++) cover(x, y, std::min(x + 1.0f, x1) - std::max((float)x, x0));
+                continue;
+            }
+            for (int x = ix0; x < ix1; x++)
+                cover(x, y, cy * (std::min(x + 1.0f, x1) - std::max((float)x, x0)));
+        }
+    }
+
+    // x range of row centre cy where lo <= a * (x - ox) + b <= hi
+    static void clipRow(float a, float b, float ox, float lo, float hi, float& xa, float& xb)
+    {
+        if (std::fabs(a) < 1e-6f)
+        {
+            if (b < lo || b > hi) xb = xa - 1.0f;
+            return;
+        }
+        float u = ox + (lo - b) / a, v = ox + (hi - b) / a;
+        xa = std::max(xa, std::min(u, v));
+        xb = std::min(xb, std::max(u, v));
+    }
+
+    // Capsule of half width hw around a -> b (pixel space)
+    void stroke(float ax, float ay, float bx, float by, float hw)
+    {
+        float dx = bx - ax, dy = by - ay, len = std::hypot(dx, dy);
+        float ux = len > 0 ? dx / len : 1.0f, uy = len > 0 ? dy / len : 0.0f;
+        float r = hw + 1.0f;
+        int y0 = std::max(0, (int)std::floor(std::min(ay, by) - r));
+        int y1 = std::min(fbH, (int)std::ceil(std::max(ay, by) + r));
+        for (int y = y0; y < y1; y++)
+        {
+            float cy = y + 0.5f;
+            float xa = std::min(ax, bx) - r, xb = std::max(ax, bx) + r;
+            clipRow(-uy, ux * (cy - ay), ax, -r, r, xa, xb);              // across
+            clipRow(ux, uy * (cy - ay), ax, -r, len + r, xa, xb);         // along
+            int x0 = std::max(0, (int)std::floor(xa)), x1 = std::min(fbW, (int)std::ceil(xb) + 1);
+            if (x0 >= x1) continue;
+            touch(x0, y, x1, y + 1);
+            for (int x = x0; x < x1; x++)
+            {
+                float px = x + 0.5f - ax, py = cy - ay;
+                float t = std::min(len, std::max(0.0f, px * ux + py * uy));
+                cover(x, y, hw + 0.5f - std::hypot(px - t * ux, py - t * uy));
+            }
+        }
+    }
+
+    // Ring of half width hw at radius rad around (cx, cy) (pixel space)
+    void ring(float cx, float cy, float rad, float hw)
+    {
+        float ro = rad + hw + 1.0f, ri = rad - hw - 1.0f;
+        int y0 = std::max(0, (int)std::floor(cy - ro)), y1 = std::min(fbH, (int)std::ceil(cy + ro));
+        for (int y = y0; y < y1; y++)
+        {
+            float py = y + 0.5f - cy;
+            if (std::fabs(py) > ro) continue;
+            float wo = std::sqrt(ro * ro - py * py);
+            float wi = ri > 0 && std::fabs(py) < ri ? std::sqrt(ri * ri - py * py) : -1.0f;
+            int x0 = std::max(0, (int)std::floor(cx - wo)), x1 = std::min(fbW, (int)std::ceil(cx + wo) + 1);
+            if (x0 >= x1) continue;
+            touch(x0, y, x1, y + 1);
+            int hole0 = wi > 0 ? (int)std::ceil(cx - wi) : x1, hole1 = wi > 0 ? (int)std::floor(cx + wi) : x1;
+            for (int x = x0; x < x1; x++)
+            {
+                if (x >= hole0 && x < hole1) { x = hole1 - 1; continue; }
+                cover(x, y, hw + 0.5f - std::fabs(std::hypot(x + 0.5f - cx, py) - rad));
+            }
+        }
+    }
+
+    bool smooth() const override { return aa != AA_OFF; }
+
+    float strokeHalf() const { return (float)std::max(1, iround(ptSize * unit)) * 0.5f; }
+
+    void segment(float x1, float y1, float x2, float y2) override
+    {
+        float ax, ay, bx, by;
+        xform(x1, y1, ax, ay);
+        xform(x2, y2, bx, by);
+        stroke(ax, ay, bx, by, strokeHalf());
+    }
+
+    void circle(float xc, float yc, float r) override
+    {
+        float cx, cy;
+        xform(xc, yc, cx, cy);
+        ring(cx, cy, r * std::sqrt(std::fabs(m.a * m.d - m.b * m.c)), strokeHalf());
+    }
+
+    void plot(int x, int y)
+    {
+        if ((unsigned)x < (unsigned)fbW && (unsigned)y < (unsigned)fbH)
+        {
+            row(y)[x] = rgba;
+            touch(x, y, x + 1, y + 1);
+        }
+    }
+
+    void line(int x1, int y1, int x2, int y2)
+    {
+        int dx = std::abs(x2 - x1), dy = std::abs(y2 - y1);
+        int sx = (x1 < x2) ? 1 : -1, sy = (y1 < y2) ? 1 : -1;
+        int err = dx - dy;
+        while (true)
+        {
+            plot(x1, y1);
+            if (x1 == x2 && y1 == y2) break;
+            int e2 = 2 * err;
+            if (e2 > -dy) { err -= dy; x1 += sx; }
+            if (e2 <  dx) { err += dx; y1 += sy; }
+        }
+    }
+
+    void clear() override
+    {
+        const uint8_t black[4] = { 0, 0, 0, 255 };
+        uint32_t c;
+        std::memcpy(&c, black, 4);
+        for (int y = 0; y < fbH; y++) std::fill(row(y), row(y) + fbW, c);
+    }
+
+    void color(float r, float g, float b) override
+    {
+        uint8_t c[4] = { (uint8_t)iround(std::min(1.0f, std::max(0.0f, r)) * 255.0f),
+                         (uint8_t)iround(std::min(1.0f, std::max(0.0f, g)) * 255.0f),
+                         (uint8_t)iround(std::min(1.0f, std::max(0.0f, b)) * 255.0f), 255 };
+        if (bgra) std::swap(c[0], c[2]);
+        std::memcpy(&rgba, c, 4);
+    }
+
+    void rect(float x, float y, float w, float h) override
+    {
+        float qx[4], qy[4];
+        xform(x, y, qx[0], qy[0]);
+        xform(x + w, y, qx[1], qy[1]);
+        xform(x + w, y + h, qx[2], qy[2]);
+        xform(x, y + h, qx[3], qy[3]);
+        if (m.b == 0 && m.c == 0 && aa == AA_COVERAGE)
+            fillBoxCoverage(std::min(qx[0], qx[2]), std::min(qy[0], qy[2]),
+                            std::max(qx[0], qx[2]), std::max(qy[0], qy[2]));
+        else if (m.b == 0 && m.c == 0)
+            fillBox(std::min(qx[0], qx[2]), std::min(qy[0], qy[2]),
+                    std::max(qx[0], qx[2]), std::max(qy[0], qy[2]));
+        else
+            fillQuad(qx, qy);
+    }
+
+    void rectLine(float x, float y, float w, float h) override
+    {
+        float qx[4], qy[4];
+        xform(x, y, qx[0], qy[0]);
+        xform(x + w, y, qx[1], qy[1]);
+        xform(x + w, y + h, qx[2], qy[2]);
+        xform(x, y + h, qx[3], qy[3]);
+        for (int i = 0; i < 4; i++)
+        {
+            int j = (i + 1) & 3;
+            if (aa != AA_OFF)
+                stroke(qx[i], qy[i], qx[j], qy[j], 0.5f * std::max(1.0f, unit));
+            else
+                line((int)std::floor(qx[i]), (int)std::floor(qy[i]),
+                     (int)std::floor(qx[j]), (int)std::floor(qy[j]));
+        }
+    }
+
+    void pointSize(float s) override { ptSize = s; }
+
+    void points(const int* xy, int count) override
+    {
+        float half = (float)std::max(1, iround(ptSize * unit)) * 0.5f;
+        for (int i = 0; i < count; i++)
+        {
+            float x, y;
+            xform((float)xy[2 * i], (float)xy[2 * i + 1], x, y);
+            if (aa == AA_COVERAGE)
+            {
+                fillBoxCoverage(x - half, y - half, x + half, y + half);
+                continue;
+            }
+            // GL snaps the point centre to the pixel grid before covering
+            x = std::floor(x + 0.5f);
+            y = std::floor(y + 0.5f);
+            fillBox(x - half, y - half, x + half, y + half);
+        }
+    }
+
+    void push() override { stack.push_back(m); }
+    void pop() override { if (!stack.empty()) { m = stack.back(); stack.pop_back(); } }
+
+    void translate(float x, float y) override
+    {
+        m.e += m.a * x + m.c * y;
+        m.f += m.b * x + m.d * y;
+    }
+
+    void rotate(float deg) override
+    {
+        float r = deg * 3.14159265f / 180.0f;
+        float cs = std::cos(r), sn = std::sin(r);
+        Mat n = m;
+        n.a = m.a * cs + m.c * sn;  n.b = m.b * cs + m.d * sn;
+        n.c = -m.a * sn + m.c * cs; n.d = -m.b * sn + m.d * cs;
+        m = n;
+    }
+
+    void scale(float sx, float sy) override
+    {
+        m.a *= sx; m.b *= sx;
+        m.c *= sy; m.d *= sy;
+    }
+
+    // Blend n texels (byte offsets `col` into `srow`) over the pixels at d,
+    // colour scaled by lit / 255. Destination alpha becomes a + d(1 - a), so
+    // blending onto a transparent layer surface leaves premultiplied colour;
+    // an opaque target stays opaque.
+    void blendSpan(uint8_t* d, const uint8_t* srow, const int* col, int n, int lit) const
+    {
+        const int r = bgra ? 2 : 0, b = bgra ? 0 : 2;
+        int i = 0;
+#ifdef METRO_SSE2
+        // Four pixels at a time in 16-bit lanes; (t + (t >> 8)) >> 8 with
+        // t = x + 128 is the same rounding as the scalar (x + 127) / 255
+        const __m128i zero = _mm_setzero_si128(), c128 = _mm_set1_epi16(128);
+        const __m128i c255 = _mm_set1_epi16(255), alphaOne = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+        const __m128i litv = _mm_set_epi16(255, (short)lit, (short)lit, (short)lit, 255, (short)lit, (short)lit, (short)lit);
+        for (; i + 4 <= n; i += 4, d += 16)
+        {
+            __m128i sv;
+            if (col[i + 3] - col[i] == 12)    // unit scale: adjacent texels
+                sv = _mm_loadu_si128((const __m128i*)(srow + col[i]));
+            else
+            {
+                uint32_t t[4];
+                for (int k = 0; k < 4; k++) std::memcpy(&t[k], srow + col[i + k], 4);
+                sv = _mm_loadu_si128((const __m128i*)t);
+            }
+            __m128i dv = _mm_loadu_si128((const __m128i*)d);
+            __m128i out[2];
+            for (int half = 0; half < 2; half++)
+            {
+                __m128i s16 = half ? _mm_unpackhi_epi8(sv, zero) : _mm_unpacklo_epi8(sv, zero);
+                __m128i d16 = half ? _mm_unpackhi_epi8(dv, zero) : _mm_unpacklo_epi8(dv, zero);
+                __m128i a16 = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s16, 0xff), 0xff);
+                if (bgra)
+                    s16 = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s16, _MM_SHUFFLE(3, 0, 1, 2)),
+                                              _MM_SHUFFLE(3, 0, 1, 2));
+                if (lit < 255)
+                {
+                    __m128i x = _mm_add_epi16(_mm_mullo_epi16(s16, litv), c128);
+                    s16 = _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+                }
+                s16 = _mm_or_si128(s16, alphaOne);   // alpha lane: 255 * a + d * (255 - a)
+                __m128i x = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(s16, a16),
+                                                        _mm_mullo_epi16(d16, _mm_sub_epi16(c255, a16))), c128);
+                out[half] = _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+            }
+            _mm_storeu_si128((__m128i*)d, _mm_packus_epi16(out[0], out[1]));
+        }
+#endif
+        for (; i < n; i++, d += 4)
+        {
+            const uint8_t* s = srow + col[i];
+            int a = s[3];
+            if (!a) continue;
+            int s0 = s[0], s1 = s[1], s2 = s[2];
+            if (lit < 255)
+            {
+                s0 = (s0 * lit + 127) / 255; s1 = (s1 * lit + 127) / 255; s2 = (s2 * lit + 127) / 255;
+            }
+            if (a == 255) { d[r] = (uint8_t)s0; d[1] = (uint8_t)s1; d[b] = (uint8_t)s2; d[3] = 255; continue; }
+            d[r] = (uint8_t)((s0 * a + d[r] * (255 - a) + 127) / 255);
+            d[1] = (uint8_t)((s1 * a + d[1] * (255 - a) + 127) / 255);
+            d[b] = (uint8_t)((s2 * a + d[b] * (255 - a) + 127) / 255);
+            d[3] = (uint8_t)((255 * a + d[3] * (255 - a) + 127) / 255);
+        }
+    }
+
+    // Nearest-texel stretch with alpha blend (axis-aligned transforms only).
+    // Texel columns are looked up once per call, not per pixel.
+    std::vector<int> texCol;
+
+    void image(float x, float y, float w, float h, const uint8_t* src,
+               int iw, int ih, uint32_t, uint32_t) override
+    {
+        float x0, y0, x1, y1;
+        xform(x, y, x0, y0);            // image bottom-left
+        xform(x + w, y + h, x1, y1);    // image top-right
+        int px0 = std::max(0, (int)std::ceil(std::min(x0, x1) - 0.5f));
+        int px1 = std::min(fbW, (int)std::ceil(std::max(x0, x1) - 0.5f));
+        int py0 = std::max(0, (int)std::ceil(std::min(y0, y1) - 0.5f));
+        int py1 = std::min(fbH, (int)std::ceil(std::max(y0, y1) - 0.5f));
+        if (px0 >= px1) return;
+        touch(px0, py0, px1, py1);
+
+        texCol.resize(px1 - px0);
+        for (int px = px0; px < px1; px++)
+            texCol[px - px0] = 4 * std::min(iw - 1, (int)((px + 0.5f - x0) / (x1 - x0) * iw));
+
+        for (int py = py0; py < py1; py++)
+        {
+            int v = std::min(ih - 1, (int)((py + 0.5f - y0) / (y1 - y0) * ih));
+            blendSpan((uint8_t*)(row(py) + px0), src + 4 * (size_t)v * iw, texCol.data(), px1 - px0, 255);
+        }
+    }
+
+    // Sprite batch in one pass over the rows it covers. Per row the spans
+    // are walked front to back against a bitset of pixels already hidden by
+    // an opaque texel of a later sprite; the visible pieces are kept, their
+    // opaque texels marked, and the pieces blended back to front. A texel of
+    // alpha 255 replaces what is under it, so this is exact: the same pixels
+    // as drawing every sprite in full, but a crowded sky costs about the
+    // area it covers rather than the sum of its sprites. Per slot and
+    // version the atlas's opaque and non-clear texels are kept as bitmasks,
+    // so unit-scale spans work a word at a time and skip clear texels.
+    // Axis-aligned only.
+    struct SpriteSpan { int x0, x1, y0, y1, col, v, th; float fy0, fy1; bool unit; };
+    struct SpritePiece { int k, x0, x1; };
+    std::vector<SpriteSpan> spriteSpans;
+    std::vector<int> spriteCol, spriteOrder, rowSprites;
+    std::vector<const uint8_t*> rowTexels;
+    std::vector<SpritePiece> pieces;
+    std::vector<uint32_t> hidden, spanBits;    // one bit per pixel of the batch's box / a span
+    std::vector<uint32_t> opaqueBits, inkBits;  // atlas texels with alpha 255 / alpha > 0
+    const uint8_t* maskAtlas = nullptr;
+    uint32_t maskSlot = 0, maskVersion = 0;
+    int maskW = 0, maskH = 0, maskStride = 0;   // stride in words
+
+    void buildAtlasMasks(const uint8_t* atlas, int aw, int ah, uint32_t slot, uint32_t version)
+    {
+        if (version && atlas == maskAtlas && slot == maskSlot && version == maskVersion &&
+            aw == maskW && ah == maskH) return;
+        maskAtlas = atlas; maskSlot = slot; maskVersion = version; maskW = aw; maskH = ah;
+        maskStride = (aw + 31) / 32 + 1;
+        opaqueBits.assign((size_t)maskStride * ah, 0);
+        inkBits.assign((size_t)maskStride * ah, 0);
+        for (int y = 0; y < ah; y++)
+            for (int x = 0; x < aw; x++)
+            {
+                uint8_t a = atlas[4 * ((size_t)y * aw + x) + 3];
+                size_t w = (size_t)y * maskStride + (x >> 5);
+                if (a == 255) opaqueBits[w] |= 1u << (x & 31);
+                if (a) inkBits[w] |= 1u << (x & 31);
+            }
+    }
+
+    // The 32 bits of a bit row from bit `at` on (rows carry a spare word)
+    static uint32_t bitsAt(const uint32_t* bits, int at)
+    {
+        uint64_t pair = bits[at >> 5] | (uint64_t)bits[(at >> 5) + 1] << 32;
+        return (uint32_t)(pair >> (at & 31));
+    }
+
+    // First bit in [x, end) equal to `set` (end if none)
+    static int findBit(const uint32_t* bits, int x, int end, bool set)
+    {
+        while (x < end)
+        {
+            uint32_t w = (set ? bits[x >> 5] : ~bits[x >> 5]) & (~0u << (x & 31));
+            if (w) return std::min(end, (x & ~31) + lowBit(w));
+            x = (x & ~31) + 32;
+        }
+        return end;
+    }
+
+    void sprites(const SpriteQuad* q, int count, const uint8_t* atlas, int aw, int ah,
+                 float tint, uint32_t slot, uint32_t version) override
+    {
+        spriteSpans.clear();
+        spriteCol.clear();
+        int bx0 = fbW, bx1 = 0, by0 = fbH, by1 = 0, widest = 0;
+        for (int i = 0; i < count; i++)
+        {
+            float x0, y0, x1, y1;
+            xform(q[i].x, q[i].y, x0, y0);
+            xform(q[i].x + q[i].w, q[i].y + q[i].h, x1, y1);
+            int px0 = std::max(0, (int)std::ceil(std::min(x0, x1) - 0.5f));
+            int px1 = std::min(fbW, (int)std::ceil(std::max(x0, x1) - 0.5f));
+            int py0 = std::max(0, (int)std::ceil(std::min(y0, y1) - 0.5f));
+            int py1 = std::min(fbH, (int)std::ceil(std::max(y0, y1) - 0.5f));
+            if (px0 >= px1 || py0 >= py1) continue;
+            SpriteSpan sp{ px0, px1, py0, py1, (int)spriteCol.size(), q[i].v, q[i].th, y0, y1, true };
+            for (int px = px0; px < px1; px++)
+            {
+                spriteCol.push_back(4 * (q[i].u + std::min(q[i].tw - 1, (int)((px + 0.5f - x0) / (x1 - x0) * q[i].tw))));
+                if (px > px0 && spriteCol.back() != spriteCol[spriteCol.size() - 2] + 4) sp.unit = false;
+            }
+            spriteSpans.push_back(sp);
+            bx0 = std::min(bx0, px0); bx1 = std::max(bx1, px1);
+            by0 = std::min(by0, py0); by1 = std::max(by1, py1);
+            widest = std::max(widest, px1 - px0);
+        }
+        if (spriteSpans.empty()) return;
+        touch(bx0, by0, bx1, by1);
+        const int lit = std::min(255, std::max(0, iround(tint * 255.0f)));
+        buildAtlasMasks(atlas, aw, ah, slot, version);
+        hidden.assign((bx1 - bx0 + 31) / 32 + 2, 0);
+        spanBits.resize((widest + 31) / 32 + 1);
+        rowTexels.resize(spriteSpans.size());
+
+        // Sweep down the rows; rowSprites holds the spans on the row in
+        // draw order
+        spriteOrder.resize(spriteSpans.size());
+        for (int k = 0; k < (int)spriteSpans.size(); k++) spriteOrder[k] = k;
+        std::stable_sort(spriteOrder.begin(), spriteOrder.end(),
+                         [&](int a, int b) { return spriteSpans[a].y0 < spriteSpans[b].y0; });
+        rowSprites.clear();
+        size_t started = 0;
+        for (int py = by0; py < by1; py++)
+        {
+            rowSprites.erase(std::remove_if(rowSprites.begin(), rowSprites.end(),
+                                            [&](int k) { return spriteSpans[k].y1 <= py; }), rowSprites.end());
+            for (; started < spriteOrder.size() && spriteSpans[spriteOrder[started]].y0 <= py; started++)
+            {
+                int k = spriteOrder[started];
+                rowSprites.insert(std::lower_bound(rowSprites.begin(), rowSprites.end(), k), k);
+            }
+            if (rowSprites.empty()) continue;
+
+            // Front to back: keep what is not hidden yet, then hide what
+            // its opaque texels cover
+            pieces.clear();
+            for (int i = (int)rowSprites.size() - 1; i >= 0; i--)
+            {
+                int k = rowSprites[i];
+                const SpriteSpan& sp = spriteSpans[k];
+                int v = sp.v + std::min(sp.th - 1, (int)((py + 0.5f - sp.fy0) / (sp.fy1 - sp.fy0) * sp.th));
+                const uint8_t* srow = rowTexels[k] = atlas + 4 * (size_t)v * aw;
+                int h = sp.x0 - bx0, n = sp.x1 - sp.x0;
+                if (sp.unit)
+                {
+                    // Visible = inked and not hidden, a word at a time
+                    const uint32_t* ink = &inkBits[(size_t)v * maskStride];
+                    const uint32_t* opaque = &opaqueBits[(size_t)v * maskStride];
+                    int t = spriteCol[sp.col] / 4;
+                    bool any = false;
+                    for (int w = 0; w * 32 < n; w++)
+                    {
+                        uint32_t bits = bitsAt(ink, t + w * 32) & ~bitsAt(hidden.data(), h + w * 32);
+                        if (n - w * 32 < 32) bits &= (1u << (n - w * 32)) - 1;
+                        spanBits[w] = bits;
+                        any |= bits != 0;
+                    }
+                    if (!any) continue;
+                    // Gaps of under 8 clear texels are blended through (a
+                    // no-op) rather than splitting the piece
+                    for (int a = findBit(spanBits.data(), 0, n, true); a < n; )
+                    {
+                        int b = findBit(spanBits.data(), a, n, false), next;
+                        while ((next = findBit(spanBits.data(), b, n, true)) < n && next - b < 8)
+                            b = findBit(spanBits.data(), next, n, false);
+                        pieces.push_back({ k, sp.x0 + a, sp.x0 + b });
+                        a = next;
+                    }
+                    for (int w = 0; w * 32 < n; w++)
+                    {
+                        uint32_t bits = bitsAt(opaque, t + w * 32);
+                        if (n - w * 32 < 32) bits &= (1u << (n - w * 32)) - 1;
+                        int to = h + w * 32;
+                        hidden[to >> 5] |= bits << (to & 31);
+                        if (to & 31) hidden[(to >> 5) + 1] |= bits >> (32 - (to & 31));
+                    }
+                    continue;
+                }
+                const int* col = &spriteCol[sp.col] - h;
+                for (int a = findBit(hidden.data(), h, h + n, false); a < h + n; )
+                {
+                    int b = findBit(hidden.data(), a, h + n, true);
+                    pieces.push_back({ k, a + bx0, b + bx0 });
+                    for (int x = a; x < b; x++)
+                        if (srow[col[x] + 3] == 255) hidden[x >> 5] |= 1u << (x & 31);
+                    a = findBit(hidden.data(), b, h + n, false);
+                }
+            }
+
+            // Back to front: blend the visible pieces, then clear the bits
+            for (int i = (int)pieces.size() - 1; i >= 0; i--)
+            {
+                const SpritePiece& pc = pieces[i];
+                const SpriteSpan& sp = spriteSpans[pc.k];
+                blendSpan((uint8_t*)(row(py) + pc.x0), rowTexels[pc.k], &spriteCol[sp.col + (pc.x0 - sp.x0)],
+                          pc.x1 - pc.x0, lit);
+            }
+            for (int k : rowSprites)
+                for (int w = (spriteSpans[k].x0 - bx0) >> 5; w <= (spriteSpans[k].x1 - 1 - bx0) >> 5; w++) hidden[w] = 0;
+        }
+    }
+
+    // Each tile row is expanded into one span: the first period is sampled,
+    // then the span doubles itself with memcpy, so a long track costs a few
+    // copies more than a short one. The span and its opaque runs are reused
+    // while consecutive rows hit identical tile rows. Periods that are not a
+    // whole number of pixels (odd framebuffer scales) are sampled per pixel.
+    std::vector<uint32_t> span;
+    std::vector<std::pair<int, int>> runs;
+
+    void pattern(float x, float y, float w, float h, const uint8_t* tile,
+                 int tw, int th, uint32_t, uint32_t) override
+    {
+        float x0, y0, x1, y1;
+        xform(x, y, x0, y0);
+        xform(x + w, y + h, x1, y1);
+        int px0 = std::max(0, (int)std::ceil(std::min(x0, x1) - 0.5f));
+        int px1 = std::min(fbW, (int)std::ceil(std::max(x0, x1) - 0.5f));
+        int py0 = std::max(0, (int)std::ceil(std::min(y0, y1) - 0.5f));
+        int py1 = std::min(fbH, (int)std::ceil(std::max(y0, y1) - 0.5f));
+        int len = px1 - px0;
+        if (len <= 0 || py0 >= py1) return;
+        touch(px0, py0, px1, py1);
+
+        float sx = (x1 - x0) / w, sy = (y1 - y0) / h;   // pixels per scene unit
+        float period = tw * std::fabs(sx);
+        int P = (int)std::lround(period);
+        bool exact = P > 0 && std::fabs(period - P) < 1e-3f;
+
+        auto texel = [&](const uint32_t* trow, int px)
+        {
+            int u = (int)std::floor((px + 0.5f - x0) / sx) % tw;
+            uint32_t t = trow[u < 0 ? u + tw : u];
+            if (bgra) std::swap(((uint8_t*)&t)[0], ((uint8_t*)&t)[2]);
+            return t;
+        };
+
+        span.resize(len);
+        uint32_t* sp = span.data();
+        const uint32_t* lastRow = nullptr;
+        for (int py = py0; py < py1; py++)
+        {
+            int v = (int)std::floor((py + 0.5f - y0) / sy) % th;
+            if (v < 0) v += th;
+            const uint32_t* trow = (const uint32_t*)(tile + 4 * (size_t)v * tw);
+            if (!lastRow || (trow != lastRow && std::memcmp(trow, lastRow, 4 * (size_t)tw) != 0))
+            {
+                int first = exact ? std::min(P, len) : len;
+                for (int i = 0; i < first; i++) sp[i] = texel(trow, px0 + i);
+                for (int n = first; n < len; n *= 2)
+                    std::memcpy(sp + n, sp, sizeof(uint32_t) * std::min(n, len - n));
+
+                // Opaque runs of the span, so rows are stored with memcpy
+                runs.clear();
+                for (int i = 0; i < len; )
+                {
+                    while (i < len && ((const uint8_t*)&sp[i])[3] < 128) i++;
+                    int start = i;
+                    while (i < len && ((const uint8_t*)&sp[i])[3] >= 128) i++;
+                    if (i > start) runs.push_back({ start, i - start });
+                }
+            }
+            lastRow = trow;
+
+            uint32_t* dst = row(py) + px0;
+            for (auto &r : runs) std::memcpy(dst + r.first, sp + r.first, sizeof(uint32_t) * r.second);
+        }
+    }
+};
+
+// Render one frame of `sim` into an RGBA8 buffer
+static void renderSoftware(const Sim& sim, SoftBackend& be, uint8_t* rgba, int w, int h, size_t stride)
+{
+    RenderBackend* prev = gGfx;
+    be.target(rgba, w, h, stride);
+    gGfx = &be;
+    gGfx->clear();
+    drawScene(sim);
+    gGfx = prev;
+}
+
+// Supersampling: render `factor` times the size in `mode`, then average
+// each factor x factor block. AA_OFF is the plain raster path with points
+// scaled up by the backend's unit; AA_HARD (geometry) is for references.
+static void renderSupersampled(const Sim& sim, SoftBackend& be, std::vector<uint8_t>& big,
+                               uint8_t* rgba, int w, int h, size_t stride, int factor, int mode)
+{
+    int bw = w * factor, bh = h * factor;
+    big.resize((size_t)bw * bh * 4);
+    int aa = be.aa;
+    be.aa = mode;
+    renderSoftware(sim, be, big.data(), bw, bh, (size_t)bw * 4);
+    be.aa = aa;
+
+    const uint32_t n = (uint32_t)(factor * factor);
+    const size_t bigStride = (size_t)bw * 4;
+    for (int y = 0; y < h; y++)
+    {
+        const uint8_t* src = big.data() + (size_t)y * factor * bigStride;
+        uint8_t* dst = rgba + y * stride;
+        int x = 0;
+#ifdef METRO_SSE2
+        // 2x2: four source pixels of two rows make two output pixels
+        if (factor == 2)
+        {
+            const __m128i zero = _mm_setzero_si128(), two = _mm_set1_epi16(2);
+            for (; x + 2 <= w; x += 2, src += 16, dst += 8)
+            {
+                __m128i r0 = _mm_loadu_si128((const __m128i*)src);
+                __m128i r1 = _mm_loadu_si128((const __m128i*)(src + bigStride));
+                __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(r0, zero), _mm_unpacklo_epi8(r1, zero));
+                __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(r0, zero), _mm_unpackhi_epi8(r1, zero));
+                lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+                hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+                __m128i s = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(lo, hi), two), 2);
+                _mm_storel_epi64((__m128i*)dst, _mm_packus_epi16(s, zero));
+            }
+        }
+#endif
+        for (; x < w; x++, src += 4 * factor, dst += 4)
+        {
+            uint32_t s[4] = { n / 2, n / 2, n / 2, n / 2 };
+            for (int sy = 0; sy < factor; sy++)
+            {
+                const uint8_t* p = src + sy * bigStride;
+                for (int sx = 0; sx < factor; sx++, p += 4)
+                    for (int c = 0; c < 4; c++) s[c] += p[c];
+            }
+            for (int c = 0; c < 4; c++) dst[c] = (uint8_t)(s[c] / n);
+        }
+    }
+}
+
+#ifndef METRO_LIBRARY
+// Headless: aliased, analytic coverage and 4x supersampled frames against a
+// 16x supersampled reference, for time per frame and error at the pixels
+// where anti-aliasing matters (those that differ between the reference and
+// the aliased frame)
+static void benchAntialias(int frames)
+{
+    Sim sim;
+    initSim(sim);
+    for (int i = 0; i < 600; i++) stepSim(sim, DT);   // train and riders in view
+
+    size_t bytes = (size_t)W * H * 4;
+    std::vector<uint8_t> ref(bytes), out[3], big;
+    for (auto &o : out) o.resize(bytes);
+    SoftBackend be;
+    const char* names[3] = { "aliased", "analytic coverage", "4x supersampled" };
+    double ms[3] = { 0, 0, 0 };
+
+    renderSupersampled(sim, be, big, ref.data(), W, H, (size_t)W * 4, 4, AA_HARD);
+    for (int f = 0; f < frames; f++)
+        for (int k = 0; k < 3; k++)
+        {
+            auto t0 = std::chrono::steady_clock::now();
+            be.aa = k == 1 ? AA_COVERAGE : AA_OFF;
+            if (k == 2) renderSupersampled(sim, be, big, out[k].data(), W, H, (size_t)W * 4, 2, AA_OFF);
+            else renderSoftware(sim, be, out[k].data(), W, H, (size_t)W * 4);
+            ms[k] += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        }
+
+    std::vector<uint8_t> edge(bytes / 4, 0);
+    int edges = 0;
+    for (size_t i = 0; i < bytes / 4; i++)
+        if (std::memcmp(&ref[4 * i], &out[0][4 * i], 3)) { edge[i] = 1; edges++; }
+    std::printf("%d frames, %d edge pixels (vs 16x supersampled reference)\n", frames, edges);
+    for (int k = 0; k < 3; k++)
+    {
+        double err = 0, sq = 0;
+        for (size_t i = 0; i < bytes / 4; i++)
+            for (int c = 0; c < 3; c++)
+            {
+                double d = (double)out[k][4 * i + c] - ref[4 * i + c];
+                sq += d * d;
+                if (edge[i]) err += std::fabs(d);
+            }
+        double psnr = sq > 0 ? 10.0 * std::log10(255.0 * 255.0 * 3.0 * (bytes / 4) / sq) : 99.0;
+        std::printf("  %-18s %7.3f ms/frame, edge error %5.1f, PSNR %.1f dB\n", names[k], ms[k] / frames,
+                    edges ? err / (3.0 * edges) : 0.0, psnr);
+    }
+}
+
+// Headless: bake time, SIMD/scalar agreement, and 3 and n clouds drawn as
+// one sprite batch vs vector clouds into the software backend
+static bool benchClouds(int n)
+{
+    // Sprites found in the asset cache are loaded, not baked: timed apart
+    double bakeMs = 0.0, loadMs = 0.0;
+    int baked = 0, loaded = 0;
+    for (int v = 0; v < CLOUD_VARIANTS; v++)
+        for (int th = 0; th < 2; th++)
+            for (int sc = 0; sc < CLOUD_SCALES; sc++)
+            {
+                int hits = gAssetCache.hits.load();
+                auto t0 = std::chrono::steady_clock::now();
+                cloudSprite(v, th != 0, sc);
+                double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+                bool hit = gAssetCache.hits.load() != hits;
+                (hit ? loadMs : bakeMs) += ms;
+                (hit ? loaded : baked)++;
+            }
+
+    // Row fBm (SIMD where available) against the scalar definition
+    bool same = true;
+    std::vector<float> row(257);
+    for (int y = 0; y < 64 && same; y++)
+    {
+        fbmRow(row.data(), (int)row.size(), 1000.5f, 0.071f, 1000.0f + y * 0.3f, 1234u + y);
+        for (int i = 0; i < (int)row.size() && same; i++)
+        {
+            float fx = 1000.5f + (float)i * 0.071f, fy = 1000.0f + y * 0.3f, sum = 0, amp = 1;
+            for (int o = 0; o < CLOUD_OCTAVES; o++)
+            {
+                sum += valueNoise(fx, fy, 1234u + y + 0x9e3779b9u * o) * amp;
+                fx += fx; fy += fy; amp *= 0.5f;
+            }
+            same = sum * (1.0f / (2.0f - 2.0f / (float)(1 << CLOUD_OCTAVES))) == row[i];
+        }
+    }
+
+    Sim sim;
+    initSim(sim);
+    std::vector<uint8_t> fb((size_t)W * H * 4);
+    SoftBackend soft;
+    soft.target(fb.data(), W, H, (size_t)W * 4);
+    RenderBackend* prev = gGfx;
+    gGfx = &soft;
+
+    // Random skies over the upper part of the scene; vector clouds one by
+    // one, sprites as the scene draws them (one batch). `submit` times the
+    // scene side alone (into the null backend): what a GPU target pays
+    auto timeSky = [&](int count, bool sprites, bool submit)
+    {
+        std::vector<CloudPlace> sky(count);
+        uint32_t r = 12345;
+        for (int i = 0; i < count; i++)
+        {
+            r = r * 1664525u + 1013904223u;
+            sky[i] = { (float)(r >> 8 & 1023), 300.0f + (float)(r >> 20 & 255), i, i % CLOUD_SCALES };
+        }
+        gGfx = submit ? (RenderBackend*)&gNullBackend : &soft;
+        if (sprites) drawClouds(sim, sky.data(), count);   // first batch builds the atlas masks
+        const int iters = submit ? 2000 : 20;
+        auto a = std::chrono::steady_clock::now();
+        for (int it = 0; it < iters; it++)
+        {
+            if (sprites) { drawClouds(sim, sky.data(), count); continue; }
+            for (auto &c : sky)
+            {
+                gfxPush();
+                gfxTranslate(c.x, c.y);
+                gfxScale(CLOUD_SCALE[c.scaleIdx], CLOUD_SCALE[c.scaleIdx]);
+                drawCloud(sim);
+                gfxPop();
+            }
+        }
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - a).count() / iters;
+    };
+    const CloudAtlas& atlas = cloudAtlas(false);
+    std::printf("clouds: %d sprites baked in %.2f ms, %d loaded from the asset cache in %.2f ms, "
+                "simd fbm %s scalar, atlas %dx%d\n", baked, bakeMs, loaded, loadMs, same ? "==" : "!=",
+                atlas.w, atlas.h);
+    const int counts[2] = { 3, n };
+    for (int k = 0; k < (n == 3 ? 1 : 2); k++)
+    {
+        double vecMs = timeSky(counts[k], false, false), spriteMs = timeSky(counts[k], true, false);
+        double submitUs = 1000.0 * timeSky(counts[k], true, true);
+        std::printf("%d clouds: vector %.3f ms, sprite batch %.3f ms per frame in software; "
+                    "batch submit %.2f us (one call)\n", counts[k], vecMs, spriteMs, submitUs);
+    }
+    gGfx = prev;
+    return same;
+}
+#endif
+
+// --------------------------- Layer Compositor ---------------------------
+// Each scene layer renders into its own cached surface at its own cadence:
+// only when its layerKey changes, i.e. when something in it moved a whole
+// pixel. Layers above the static one keep premultiplied colour over a
+// transparent background and remember the box they touched, so clearing
+// and blending stay inside it. A frame is the static surface copied out
+// with the others blended over it in order.
+static void (*const LAYER_DRAW[LAYER_COUNT])(const Sim&) =
+{
+    drawStaticLayer, drawSignalLayer, drawCloudLayer, drawDynamicLayer
+};
+
+struct LayerSurface
+{
+    std::vector<uint32_t> px;
+    int x0 = 0, y0 = 0, x1 = 0, y1 = 0;     // touched box
+    uint64_t key = 0;
+    bool valid = false;
+    int renders = 0;
+    double ms = 0.0;                        // total render time
+};
+
+struct Compositor
+{
+    int w = 0, h = 0;
+    bool bgra = false;
+    LayerSurface layers[LAYER_COUNT];
+    int frames = 0;
+    SoftBackend be;
+};
+
+// dst = src + dst * (1 - src alpha), premultiplied
+static inline void blendPixel(uint32_t& dst, uint32_t v)
+{
+    uint32_t a = v >> 24;                   // alpha is the top byte in memory order R,G,B,A
+    if (a == 0) return;
+    if (a == 255) { dst = v; return; }
+    const uint8_t* sc = (const uint8_t*)&v;
+    uint8_t* dc = (uint8_t*)&dst;
+    for (int c = 0; c < 3; c++) dc[c] = (uint8_t)(sc[c] + (dc[c] * (255 - a) + 127) / 255);
+}
+
+#ifndef METRO_LIBRARY
+// One layer over dst, inside the layer's box
+static void blendOver(uint32_t* dst, size_t dstStride, const LayerSurface& l, int w)
+{
+    for (int y = l.y0; y < l.y1; y++)
+    {
+        const uint32_t* s = l.px.data() + (size_t)y * w;
+        uint32_t* d = dst + (size_t)y * dstStride;
+        int x = l.x0;
+#ifdef METRO_SSE2
+        // Layers are mostly empty or opaque: settle four such pixels at once
+        const __m128i zero = _mm_setzero_si128(), full = _mm_set1_epi32(255);
+        for (; x + 4 <= l.x1; x += 4)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)(s + x));
+            __m128i a = _mm_srli_epi32(v, 24);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, zero)) == 0xffff) continue;
+            if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, full)) == 0xffff)
+                _mm_storeu_si128((__m128i*)(d + x), v);
+            else
+                for (int k = 0; k < 4; k++) blendPixel(d[x + k], s[x + k]);
+        }
+#endif
+        for (; x < l.x1; x++) blendPixel(d[x], s[x]);
+    }
+}
+
+// Re-render one layer if its key changed; true if it did
+static bool refreshLayer(Compositor& c, const Sim& sim, int i)
+{
+    LayerSurface& l = c.layers[i];
+    uint64_t key = layerKey(sim, i);
+    if (l.valid && l.key == key) return false;
+
+    for (int y = l.y0; y < l.y1; y++)
+        std::fill(l.px.begin() + (size_t)y * c.w + l.x0, l.px.begin() + (size_t)y * c.w + l.x1, 0u);
+    auto t0 = std::chrono::steady_clock::now();
+    RenderBackend* prev = gGfx;
+    c.be.target((uint8_t*)l.px.data(), c.w, c.h, (size_t)c.w * 4);
+    c.be.resetTouched();
+    gGfx = &c.be;
+    LAYER_DRAW[i](sim);
+    gGfx = prev;
+    l.x0 = c.be.tx0; l.y0 = c.be.ty0;
+    l.x1 = std::max(c.be.tx0, c.be.tx1); l.y1 = std::max(c.be.ty0, c.be.ty1);
+    l.key = key;
+    l.valid = true;
+    l.renders++;
+    l.ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    return true;
+}
+
+static void renderComposited(const Sim& sim, Compositor& c, bool bgra, uint8_t* rgba, int w, int h, size_t stride)
+{
+    if (c.w != w || c.h != h || c.bgra != bgra)
+    {
+        c.w = w; c.h = h; c.bgra = c.be.bgra = bgra;
+        for (auto &l : c.layers)
+        {
+            l.px.assign((size_t)w * h, 0u);
+            l.x0 = l.y0 = l.x1 = l.y1 = 0;
+            l.valid = false;
+        }
+    }
+
+    for (int i = 0; i < LAYER_COUNT; i++) refreshLayer(c, sim, i);
+    const uint32_t* bg = c.layers[LAYER_STATIC].px.data();
+    for (int y = 0; y < h; y++) std::memcpy(rgba + y * stride, bg + (size_t)y * w, 4 * (size_t)w);
+    for (int i = LAYER_STATIC + 1; i < LAYER_COUNT; i++) blendOver((uint32_t*)rgba, stride / 4, c.layers[i], w);
+    c.frames++;
+}
+
+static void printCompositor(const Compositor& c)
+{
+    std::printf("compositor %d frames, layer renders:", c.frames);
+    for (int i = 0; i < LAYER_COUNT; i++)
+        std::printf(" %s %d (%.3f ms)%s", LAYER_NAME[i], c.layers[i].renders,
+                    c.layers[i].renders ? c.layers[i].ms / c.layers[i].renders : 0.0, i + 1 < LAYER_COUNT ? "," : "\n");
+}
+
+// Headless: the same frames drawn directly and through the compositor,
+// with the day clock running and frozen
+static void benchCompositor(int frames)
+{
+    for (int pass = 0; pass < 2; pass++)
+    {
+        Sim sim;
+        initSim(sim);
+        if (pass) sim.clockRate = 0.0f;
+        std::vector<uint8_t> direct((size_t)W * H * 4), layered((size_t)W * H * 4);
+        SoftBackend soft;
+        Compositor comp;
+        double msDirect = 0, msLayered = 0;
+        int maxDiff = 0;
+        for (int f = 0; f < frames; f++)
+        {
+            stepSim(sim, DT);
+            auto t0 = std::chrono::steady_clock::now();
+            renderSoftware(sim, soft, direct.data(), W, H, (size_t)W * 4);
+            auto t1 = std::chrono::steady_clock::now();
+            renderComposited(sim, comp, false, layered.data(), W, H, (size_t)W * 4);
+            auto t2 = std::chrono::steady_clock::now();
+            msDirect += std::chrono::duration<double, std::milli>(t1 - t0).count();
+            msLayered += std::chrono::duration<double, std::milli>(t2 - t1).count();
+            for (size_t i = 0; i < direct.size(); i++)
+                maxDiff = std::max(maxDiff, std::abs((int)direct[i] - (int)layered[i]));
+        }
+        std::printf("%s: %d frames, direct %.3f ms, composited %.3f ms per frame; max channel difference %d\n",
+                    pass ? "clock frozen" : "clock running", frames, msDirect / frames, msLayered / frames, maxDiff);
+        printCompositor(comp);
+    }
 }
+#endif
+
+// --------------------------- Frame Task Graph ---------------------------
+// A frame as a dependency graph run on a small thread pool:
+//
+//   clouds -----------------------------> rec clouds  --+
+//   clock -+-> taps -> interior -> train -+-> rec signal --+--> submit
+//          |                              +-> crowd -> rec dynamic --+
+//          +-> static refresh (re-record when the lighting changed) -+
+//
+// Updates keep the serial order wherever they share data, so results match
+// stepSim exactly. Layers are recorded into TraceRecorders in parallel and
+// submitted in scene order. Per-task times give the critical path.
+struct TaskGraph
+{
+    struct Task
+    {
+        const char* name;
+        std::function<void()> fn;
+        std::vector<int> deps, succ;
+        std::atomic<int> pending{ 0 };
+        double start = 0, end = 0;     // ms since frame start
+    };
+
+    std::deque<Task> tasks;            // deque: Task holds an atomic
+    std::atomic<int> remaining{ 0 };
+    std::chrono::steady_clock::time_point t0;
+
+    // Dependencies must already exist, so insertion order is topological
+    int add(const char* name, std::function<void()> fn, std::initializer_list<int> deps = {})
+    {
+        tasks.emplace_back();
+        Task& t = tasks.back();
+        t.name = name;
+        t.fn = std::move(fn);
+        int id = (int)tasks.size() - 1;
+        for (int d : deps) { t.deps.push_back(d); tasks[d].succ.push_back(id); }
+        return id;
+    }
+
+    double now() const
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    }
+
+    void launch(ThreadPool& pool, int id)
+    {
+        pool.submit([this, &pool, id]()
+        {
+            Task& t = tasks[id];
+            t.start = now();
+            t.fn();
+            t.end = now();
+            for (int s : t.succ)
+                if (--tasks[s].pending == 0) launch(pool, s);
+            remaining--;
+        });
+    }
+
+    // Execute the whole graph; the calling thread helps until it is done
+    void run(ThreadPool& pool)
+    {
+        t0 = std::chrono::steady_clock::now();
+        remaining = (int)tasks.size();
+        for (auto &t : tasks) t.pending = (int)t.deps.size();
+        for (int i = 0; i < (int)tasks.size(); i++)
+            if (tasks[i].deps.empty()) launch(pool, i);
+        while (remaining > 0)
+            if (!pool.helpOne()) std::this_thread::yield();
+    }
+
+    // Longest chain of task durations through the last run
+    double criticalPath(std::vector<int>& path) const
+    {
+        int n = (int)tasks.size();
+        std::vector<double> len(n);
+        std::vector<int> prev(n, -1);
+        int best = -1;
+        for (int i = 0; i < n; i++)
+        {
+            double before = 0;
+            for (int d : tasks[i].deps)
+                if (len[d] > before) { before = len[d]; prev[i] = d; }
+            len[i] = before + (tasks[i].end - tasks[i].start);
+            if (best < 0 || len[i] > len[best]) best = i;
+        }
+        path.clear();
+        for (int i = best; i >= 0; i = prev[i]) path.insert(path.begin(), i);
+        return best >= 0 ? len[best] : 0.0;
+    }
+};
+
+// Recorded layers, submitted in scene order
+struct FrameLayers
+{
+    TraceRecorder staticLayer, signal, clouds, dynamic;
+    uint64_t staticKey = 0;           // lightKey the static layer was recorded for
+    bool staticValid = false;
+};
 
-static void spawnPassengers()
+static void recordLayer(TraceRecorder& rec, void (*draw)(const Sim&), const Sim& sim)
 {
-    // Put two passengers on platform near station
-    p1.active = true; p1.x = 760.0f; p1.y = 170.0f; p1.speed = 90.0f; p1.legPhase = 0.0f;
-    p2.active = true; p2.x = 820.0f; p2.y = 170.0f; p2.speed = 80.0f; p2.legPhase = 1.2f;
+    RenderBackend* prev = gGfx;
+    rec.bytes.clear();
+    gGfx = &rec;
+    draw(sim);
+    gGfx = prev;
 }
 
-// Draw passenger (simple body + head circle), walking legs by tiny rotation
-static void drawPassenger(const Passenger& p, float scale = 1.0f)
+#ifndef METRO_LIBRARY
+static void submitLayers(const FrameLayers& l, RenderBackend& be)
 {
-    if (!p.active) return;
+    be.clear();
+    for (const TraceRecorder* r : { &l.staticLayer, &l.signal, &l.clouds, &l.dynamic })
+        replayTrace(r->bytes.data(), r->bytes.size(), be);
+}
+#endif
 
-    glPushMatrix();
-    glTranslatef(p.x, p.y, 0);       // Translation (required)
-    glScalef(scale, scale, 1.0f);    // Scaling (required)
+// Builds the per-frame graph for `sim`; `submit` (may be empty) is the last task
+static void buildFrameGraph(TaskGraph& g, Sim& sim, FrameLayers& layers, float dt,
+                            std::function<void()> submit)
+{
+    Sim* s = &sim;
+    FrameLayers* l = &layers;
+
+    int clouds   = g.add("clouds",   [s, dt]() { stepClouds(*s, dt); });
+    int clock    = g.add("clock",    [s, dt]() { stepClock(*s, dt); });
+    int taps     = g.add("taps",     [s, dt]() { s->time += dt; updateTapSpawns(*s); }, { clock });
+    int interior = g.add("interior", [s]() { updateStationInterior(*s); }, { taps });
+    int train    = g.add("train",    [s, dt]() { updateStateMachine(*s, dt); }, { interior });
+    int crowd    = g.add("crowd",    [s]() { if (s->showCrowd) updateCrowd(*s); }, { train });
+    int statics  = g.add("static",   [s, l]()
+    {
+        uint64_t key = lightKey(*s);
+        if (!l->staticValid || l->staticKey != key)
+        {
+            recordLayer(l->staticLayer, drawStaticLayer, *s);
+            l->staticKey = key;
+            l->staticValid = true;
+        }
+    }, { clock });
+    int recSig   = g.add("rec signal",  [s, l]() { recordLayer(l->signal, drawSignalLayer, *s); }, { train });
+    int recCloud = g.add("rec clouds",  [s, l]() { recordLayer(l->clouds, drawCloudLayer, *s); }, { clouds, clock });
+    int recDyn   = g.add("rec dynamic", [s, l]() { recordLayer(l->dynamic, drawDynamicLayer, *s); }, { crowd });
+    g.add("submit", submit ? submit : []() {}, { statics, recSig, recCloud, recDyn });
+}
 
-    // Body
-    if (!gNight) setColor(0.20f, 0.35f, 0.85f);
-    else         setColor(0.35f, 0.55f, 0.95f);
-    rectFilled(-6, 0, 12, 26);
+#ifndef METRO_LIBRARY
+static void printFrameGraphStats(const TaskGraph& g, double wallMs)
+{
+    std::vector<int> path;
+    double cp = g.criticalPath(path);
+    double work = 0;
+    for (auto &t : g.tasks) work += t.end - t.start;
+    std::printf("frame %.3f ms, work %.3f ms, critical path %.3f ms:", wallMs, work, cp);
+    for (size_t i = 0; i < path.size(); i++)
+        std::printf("%s %s", i ? " ->" : "", g.tasks[path[i]].name);
+    std::printf("\n");
+}
 
-    // Head (midpoint circle)
-    glPointSize(2.0f);
-    glBegin(GL_POINTS);
-    if (!gNight) setColor(1.0f, 0.85f, 0.70f);
-    else         setColor(0.95f, 0.80f, 0.65f);
-    circleMidpoint(0, 34, 8);
-    glEnd();
+// Headless: run frames through the graph into the software backend
+static void benchFrameGraph(int frames, int threads)
+{
+    Sim sim;
+    initSim(sim);
+    FrameLayers layers;
+    std::vector<uint8_t> fb((size_t)W * H * 4);
+    SoftBackend soft;
+    soft.target(fb.data(), W, H, (size_t)W * 4);
+
+    ThreadPool pool(threads);
+    TaskGraph g;
+    buildFrameGraph(g, sim, layers, DT, [&]() { submitLayers(layers, soft); });
+
+    double wall = 0, work = 0, cp = 0;
+    for (int f = 0; f < frames; f++)
+    {
+        auto t0 = std::chrono::steady_clock::now();
+        g.run(pool);
+        wall += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        std::vector<int> path;
+        cp += g.criticalPath(path);
+        for (auto &t : g.tasks) work += t.end - t.start;
+    }
+    std::printf("%d frames, %d worker threads: frame %.3f ms, task work %.3f ms, critical path %.3f ms (avg)\n",
+                frames, threads, wall / frames, work / frames, cp / frames);
+    printFrameGraphStats(g, wall / frames);
+}
+#endif
+
+// --------------------------- Startup Warm-up ---------------------------
+// Cache construction runs as independent jobs on its own pool (not the
+// frame pool, whose helpers would otherwise pick up a long bake mid-frame).
+// Frames start immediately: while gWarmupRunning is set each draw path
+// falls back to direct drawing until its cache is ready, and every finished
+// job bumps gCacheGeneration so the next frame is redrawn with it.
+struct Warmup
+{
+    ThreadPool* pool = nullptr;
+    std::atomic<int> pending{ 0 };
+    std::atomic<int64_t> workUs{ 0 };     // summed job time
+    std::atomic<int64_t> doneUs{ 0 };     // wall time when the last job finished
+    std::chrono::steady_clock::time_point start;
+    int jobs = 0, threads = 0;
+};
 
-    // Legs (animated)
-    float a = std::sin(p.legPhase) * 22.0f; // +- degrees
-    if (!gNight) setColor(0.10f, 0.10f, 0.12f);
-    else         setColor(0.85f, 0.85f, 0.90f);
+#ifndef METRO_LIBRARY
+static void startWarmup(Warmup& w, int threads)
+{
+    std::vector<std::function<void()>> jobs;
+    jobs.push_back([]() { buildDayTable(); });
+    for (int night = 0; night < 2; night++)
+        jobs.push_back([night]()
+        {
+            for (int a = 0; a < AMBIENT_LEVELS; a++) sleeperTile(night * AMBIENT_LEVELS + a);
+        });
+    for (int v = 0; v < CLOUD_VARIANTS; v++)
+        jobs.push_back([v]()
+        {
+            for (int k = 0; k < 2 * CLOUD_SCALES; k++) bakeCloudEntry(v * 2 * CLOUD_SCALES + k);
+        });
+    // Queued last: packing waits on (or takes over) the bakes above
+    for (int night = 0; night < 2; night++)
+        jobs.push_back([night]() { cloudAtlas(night != 0); });
+
+    w.start = std::chrono::steady_clock::now();
+    w.jobs = (int)jobs.size();
+    w.threads = threads;
+    w.pending = w.jobs;
+    gWarmupRunning = true;
+    w.pool = new ThreadPool(threads);
+    Warmup* wp = &w;
+    for (auto &job : jobs)
+        w.pool->submit([wp, job]()
+        {
+            auto t0 = std::chrono::steady_clock::now();
+            job();
+            auto t1 = std::chrono::steady_clock::now();
+            wp->workUs += std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count();
+            gCacheGeneration++;
+            if (--wp->pending == 0)
+                wp->doneUs = std::chrono::duration_cast<std::chrono::microseconds>(t1 - wp->start).count();
+        });
+}
 
-    // Left leg
-    glPushMatrix();
-    glTranslatef(-3, 0, 0);
-    glRotatef(a, 0, 0, 1);
-    rectFilled(-2, -14, 4, 14);
-    glPopMatrix();
+static bool warmupDone(const Warmup& w) { return w.pending.load() == 0; }
 
-    // Right leg
-    glPushMatrix();
-    glTranslatef(3, 0, 0);
-    glRotatef(-a, 0, 0, 1);
-    rectFilled(-2, -14, 4, 14);
-    glPopMatrix();
+// Once done: join the pool and let draw paths build caches lazily again
+static void finishWarmup(Warmup& w)
+{
+    delete w.pool;
+    w.pool = nullptr;
+    gWarmupRunning = false;
+    gCacheGeneration++;
+}
 
-    glPopMatrix();
+// Headless: frames are stepped and rendered in software from the start;
+// reports time to the first (direct) frame and to the first fully cached one
+static void benchWarmup(int threads)
+{
+    auto t0 = std::chrono::steady_clock::now();
+    auto ms = [&]() { return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count(); };
+
+    Warmup w;
+    startWarmup(w, threads);
+    Sim sim;
+    initSim(sim);
+    std::vector<uint8_t> fb((size_t)W * H * 4);
+    SoftBackend soft;
+
+    double firstMs = -1.0, fullMs = 0.0, frameMs = 0.0;
+    int frames = 0;
+    for (;;)
+    {
+        bool cached = warmupDone(w);
+        stepSim(sim, DT);
+        double f0 = ms();
+        renderSoftware(sim, soft, fb.data(), W, H, (size_t)W * 4);
+        frames++;
+        if (firstMs < 0) { firstMs = ms(); frameMs = firstMs - f0; }
+        if (cached) { fullMs = ms(); break; }
+    }
+    finishWarmup(w);
+
+    std::printf("warm-up: %d cache jobs on %d threads, %.2f ms of work, done after %.2f ms\n",
+                w.jobs, w.threads, w.workUs / 1000.0, w.doneUs / 1000.0);
+    std::printf("asset cache: %d hits, %d misses (%s)\n", gAssetCache.hits.load(), gAssetCache.misses.load(),
+                gAssetCache.dir.empty() ? "disabled" : gAssetCache.dir.c_str());
+    std::printf("time to first frame %.2f ms (direct drawing, %.2f ms), time to full speed %.2f ms (%d frames)\n",
+                firstMs, frameMs, fullMs, frames);
+    std::printf("building serially before the first frame would delay it to about %.2f ms\n",
+                w.workUs / 1000.0 + frameMs);
 }
+#endif
+
+// --------------------------- Determinism Check ---------------------------
+// Parallel updates, SIMD kernels and the event engine must not change
+// results. Every entity (clock, train, signal, clouds, each passenger, the
+// station interior, each fleet train) hashes its exact bits each tick and a
+// tick's hash folds those together; only tick hashes are logged (8 bytes a
+// tick). The verifier runs two configurations, finds the first tick whose
+// hashes differ, then re-runs both to that tick and compares entity hashes
+// to name the culprit.
+// Hashing runs over every entity every tick, so it folds whole 32-bit words
+// (not TickHash's bytes) and the entity visitors are templates: the tick
+// hash inlines them, and only pinpoint goes through an EntityFn. On 2000
+// fleet trains it costs about as much as one fleet step.
+typedef std::function<void(const char* kind, int index, uint64_t h)> EntityFn;
+
+// FNV-1a over 32-bit words
+struct TickHash
+{
+    uint64_t h = 1469598103934665603ull;
+    void add(int32_t v) { h = (h ^ (uint32_t)v) * 1099511628211ull; }
+};
 
-// Draw wheels (rotation required)
-static void drawWheel(float cx, float cy, float r)
+static void hashBits(TickHash& s, float v) { int32_t b; std::memcpy(&b, &v, 4); s.add(b); }
+static void hashBits(TickHash& s, double v) { uint64_t b; std::memcpy(&b, &v, 8); s.add((int32_t)b); s.add((int32_t)(b >> 32)); }
+static void hashBits(TickHash& s, uint64_t v) { s.add((int32_t)v); s.add((int32_t)(v >> 32)); }
+
+// Emitter that folds entity hashes into a tick hash
+struct FoldEntity
 {
-    // Wheel outline via midpoint circle, spokes via DDA
-    glPushMatrix();
-    glTranslatef(cx, cy, 0);
-    glRotatef(gWheelAngle, 0, 0, 1);  // Rotation (required)
+    TickHash& s;
+    void operator()(const char*, int, uint64_t h) const { hashBits(s, h); }
+};
 
-    if (!gNight) setColor(0.05f, 0.05f, 0.05f);
-    else         setColor(0.90f, 0.90f, 0.95f);
+// Rider ids and event sequence numbers depend on allocation order, so
+// queued riders are identified by their tap time instead
+static uint64_t interiorHash(const Interior& in)
+{
+    TickHash s;
+    hashBits(s, in.rng); hashBits(s, in.processed); s.add(in.inside);
+    for (auto &n : in.nodes)
+    {
+        s.add(n.busy); hashBits(s, n.served); hashBits(s, n.waitSum);
+        for (int32_t id : n.queue) hashBits(s, in.pax[id].tapAt);
+    }
+    return s.h;
+}
 
-    glPointSize(2.0f);
-    glBegin(GL_POINTS);
-    circleMidpoint(0, 0, (int)r);
-    // Spokes (DDA)
-    lineDDA(0, 0, r, 0);
-    lineDDA(0, 0, -r, 0);
-    lineDDA(0, 0, 0, r);
-    lineDDA(0, 0, 0, -r);
-    glEnd();
+template <class Emit>
+static void simEntities(const Sim& sim, Emit&& emit)
+{
+    TickHash c;
+    hashBits(c, sim.time); hashBits(c, sim.clock);
+    emit("clock", 0, c.h);
+
+    TickHash t;
+    t.add(sim.state); hashBits(t, sim.stateTimer); hashBits(t, sim.trainX);
+    hashBits(t, sim.trainSpeed); hashBits(t, sim.wheelAngle); hashBits(t, sim.doorOpen); hashBits(t, sim.hold);
+    t.add(sim.cycle); hashBits(t, sim.boarded);
+    emit("train", 0, t.h);
+
+    TickHash sg;
+    sg.add(sim.signalGreen);
+    emit("signal", 0, sg.h);
+
+    TickHash cl;
+    hashBits(cl, sim.c1x); hashBits(cl, sim.c2x); hashBits(cl, sim.c3x);
+    emit("clouds", 0, cl.h);
+
+    for (size_t i = 0; i < sim.passengers.size(); i++)
+    {
+        const Passenger& p = sim.passengers[i];
+        TickHash s;
+        s.add(p.active); s.add(p.boarding);
+        hashBits(s, p.x); hashBits(s, p.y); hashBits(s, p.speed); hashBits(s, p.legPhase);
+        emit("passenger", (int)i, s.h);
+    }
+
+    emit("interior", 0, interiorHash(sim.station));
+    for (size_t i = 0; i < sim.arriving.size(); i++)
+    {
+        const Arriving& a = sim.arriving[i];
+        TickHash s;
+        hashBits(s, a.at); hashBits(s, a.x); hashBits(s, a.speed); hashBits(s, a.legPhase);
+        emit("arriving", (int)i, s.h);
+    }
 
-    glPopMatrix();
+    if (sim.showCrowd)
+    {
+        TickHash s;
+        s.add((int32_t)sim.crowd.version);
+        for (int32_t v : sim.crowd.counts) s.add(v);
+        emit("crowd", 0, s.h);
+    }
 }
 
-// Train drawing with multiple coaches + doors
-static void drawTrain()
+template <class Emit>
+static void fleetEntities(const Fleet& f, Emit&& emit)
 {
-    glPushMatrix();
-    glTranslatef(gTrainX, TRAIN_Y, 0); // Translation (required)
+    for (int i = 0; i < f.n; i++)
+    {
+        TickHash s;
+        s.add(f.state[i]); hashBits(s, f.timer[i]); hashBits(s, f.x[i]); hashBits(s, f.wheel[i]);
+        hashBits(s, f.door[i]); s.add(f.signal[i]); s.add(f.riders[i]); s.add(f.cycle[i]);
+        emit("fleet train", i, s.h);
+    }
+    TickHash b;
+    hashBits(b, f.boarded);
+    emit("fleet", 0, b.h);
+}
 
-    // Coaches
-    const int coaches = 3;
-    const float coachW = 170.0f;
-    const float coachH = 70.0f;
-    const float gap = 8.0f;
+// One side of a comparison
+struct VerifyRun
+{
+    virtual ~VerifyRun() {}
+    virtual void step() = 0;
+    virtual void entities(const EntityFn& emit) const = 0;
+    virtual uint64_t tickHash() const = 0;
+};
 
-    for (int i = 0; i < coaches; i++)
+// Scene sim: serial stepSim, or the frame task graph on `threads` workers
+struct SimRun : VerifyRun
+{
+    Sim sim;
+    ThreadPool* pool = nullptr;
+    TaskGraph graph;
+    FrameLayers layers;
+
+    explicit SimRun(int threads)
     {
-        float ox = i * (coachW + gap);
+        sim.showCrowd = true;
+        initSim(sim);
+        if (threads > 0)
+        {
+            pool = new ThreadPool(threads);
+            buildFrameGraph(graph, sim, layers, DT, nullptr);
+        }
+    }
+    ~SimRun() { delete pool; }
+    void step() override { if (pool) graph.run(*pool); else stepSim(sim, DT); }
+    void entities(const EntityFn& emit) const override { simEntities(sim, emit); }
+    uint64_t tickHash() const override { TickHash s; simEntities(sim, FoldEntity{ s }); return s.h; }
+};
 
-        // Body
-        if (!gNight) setColor(0.92f, 0.22f, 0.22f);
-        else         setColor(0.75f, 0.18f, 0.20f);
-        rectFilled(ox, 20, coachW, coachH);
+// SoA fleet: scalar or branch-free SSE2 step
+struct FleetRun : VerifyRun
+{
+    Fleet fleet;
+    bool masked;
+    FleetRun(int trains, bool simd) : masked(simd) { initFleet(fleet, trains); }
+    void step() override { if (masked) fleetStepMasked(fleet, DT); else fleetStepScalar(fleet, DT); }
+    void entities(const EntityFn& emit) const override { fleetEntities(fleet, emit); }
+    uint64_t tickHash() const override { TickHash s; fleetEntities(fleet, FoldEntity{ s }); return s.h; }
+};
 
-        // Roof
-        if (!gNight) setColor(0.80f, 0.15f, 0.15f);
-        else         setColor(0.60f, 0.12f, 0.14f);
-        rectFilled(ox, 85, coachW, 12);
+// Station interior under Poisson arrivals, advanced every tick or in
+// batches; the event engine must not care (compared at batch ends)
+struct InteriorRun : VerifyRun
+{
+    Interior in;
+    int batch;
+    int tick = 0;
+    uint64_t rng = 0x2545f4914f6cdd1dull;
+    double nextArrival = 0.0, rate = 20000.0 / 3600.0;
+    std::vector<double> pending;     // arrivals not yet handed to the engine
+    TickHash platform;              // everyone who reached the platform, in order
 
-        // Window strip
-        if (!gNight) setColor(0.55f, 0.75f, 0.95f);
-        else         setColor(0.95f, 0.85f, 0.40f);
-        rectFilled(ox + 15, 55, coachW - 30, 22);
+    explicit InteriorRun(int batchTicks) : batch(batchTicks) { buildInterior(in, 40, 16, 6); }
 
-        // Outline using Bresenham (required)
-        if (!gNight) setColor(0.20f, 0.20f, 0.22f);
-        else         setColor(0.85f, 0.85f, 0.90f);
-        glPointSize(2.0f);
-        rectOutlineBresenham((int)ox, 20, (int)coachW, (int)coachH + 12);
+    double uniform()
+    {
+        rng ^= rng >> 12; rng ^= rng << 25; rng ^= rng >> 27;
+        return ((rng * 2685821657736338717ull) >> 11) * (1.0 / 9007199254740992.0) + 1e-17;
+    }
 
-        // Doors on middle coach only (i==1)
-        if (i == 1)
+    void step() override
+    {
+        double end = (tick + 1) * (double)DT;
+        while (nextArrival <= end)
         {
-            float doorX = ox + 65;
-            float doorY = 22;
-            float doorW = 40;
-            float doorH = 65;
+            pending.push_back(nextArrival);
+            nextArrival += -std::log(uniform()) / rate;
+        }
+        if (++tick % batch) return;
+        for (double at : pending) interiorArrive(in, at, 80.0f, 0.0f, 0.0f);
+        pending.clear();
+        advanceInterior(in, end, [&](const QPax& p, float x, double at)
+        {
+            hashBits(platform, p.tapAt); hashBits(platform, x); hashBits(platform, at);
+        });
+    }
+
+    template <class Emit>
+    void visit(Emit&& emit) const
+    {
+        emit("interior", 0, interiorHash(in));
+        emit("platform", 0, platform.h);
+    }
+    void entities(const EntityFn& emit) const override { visit(emit); }
+    uint64_t tickHash() const override { TickHash s; visit(FoldEntity{ s }); return s.h; }
+};
+
+#ifndef METRO_LIBRARY
+static uint64_t simTickHash(const Sim& sim)
+{
+    TickHash s;
+    simEntities(sim, FoldEntity{ s });
+    return s.h;
+}
+#endif
+
+// Compact per-tick log: "MHSH", version, then one u64 per tick to the end
+static const uint32_t HASHLOG_MAGIC = 0x4853484d;   // "MHSH"
+static const uint32_t HASHLOG_VERSION = 2;   // 2: word-wise entity hashes
+#ifndef METRO_LIBRARY
+static FILE* gHashLog = nullptr;                    // --hash-log for the live loop
+
+static FILE* openHashLog(const char* path)
+{
+    FILE* f = std::fopen(path, "wb");
+    uint32_t hdr[2] = { HASHLOG_MAGIC, HASHLOG_VERSION };
+    if (f && std::fwrite(hdr, sizeof hdr, 1, f) != 1) { std::fclose(f); f = nullptr; }
+    return f;
+}
+
+static void logTick(const Sim& sim)
+{
+    if (!gHashLog) return;
+    uint64_t h = simTickHash(sim);
+    std::fwrite(&h, sizeof h, 1, gHashLog);
+}
+
+static bool saveHashLog(const char* path, const std::vector<uint64_t>& ticks)
+{
+    FILE* f = openHashLog(path);
+    if (!f) return false;
+    bool ok = std::fwrite(ticks.data(), sizeof(uint64_t), ticks.size(), f) == ticks.size();
+    return std::fclose(f) == 0 && ok;
+}
+
+static bool loadHashLog(const char* path, std::vector<uint64_t>& ticks)
+{
+    FILE* f = std::fopen(path, "rb");
+    if (!f) return false;
+    uint32_t hdr[2];
+    bool ok = std::fread(hdr, sizeof hdr, 1, f) == 1 && hdr[0] == HASHLOG_MAGIC && hdr[1] == HASHLOG_VERSION;
+    uint64_t h;
+    ticks.clear();
+    while (ok && std::fread(&h, sizeof h, 1, f) == 1) ticks.push_back(h);
+    std::fclose(f);
+    return ok;
+}
+
+// Tick hashes of a fresh run; ticks not divisible by `sync` are logged as 0
+static std::vector<uint64_t> recordHashes(const std::function<VerifyRun*()>& make, int ticks, int sync,
+                                          double* hashUs = nullptr)
+{
+    std::unique_ptr<VerifyRun> r(make());
+    std::vector<uint64_t> log(ticks, 0);
+    double us = 0;
+    for (int t = 0; t < ticks; t++)
+    {
+        r->step();
+        if ((t + 1) % sync) continue;
+        auto t0 = std::chrono::steady_clock::now();
+        log[t] = r->tickHash();
+        us += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+    }
+    if (hashUs) *hashUs = us / std::max(1, ticks / sync);
+    return log;
+}
+
+// First tick where the logs differ, or -1
+static int firstDivergence(const std::vector<uint64_t>& a, const std::vector<uint64_t>& b)
+{
+    size_t n = std::min(a.size(), b.size());
+    for (size_t t = 0; t < n; t++)
+        if (a[t] != b[t]) return (int)t;
+    return a.size() == b.size() ? -1 : (int)n;
+}
+
+// Re-run both sides to `tick` and print the entities that differ there
+static void pinpoint(const std::function<VerifyRun*()>& makeA, const std::function<VerifyRun*()>& makeB, int tick)
+{
+    struct E { std::string kind; int index; uint64_t h; };
+    auto collect = [&](const std::function<VerifyRun*()>& make)
+    {
+        std::unique_ptr<VerifyRun> r(make());
+        for (int t = 0; t <= tick; t++) r->step();
+        std::vector<E> out;
+        r->entities([&](const char* k, int i, uint64_t h) { out.push_back({ k, i, h }); });
+        return out;
+    };
+    std::vector<E> a = collect(makeA), b = collect(makeB);
+
+    int shown = 0;
+    for (size_t i = 0; i < std::max(a.size(), b.size()) && shown < 5; i++)
+    {
+        if (i < a.size() && i < b.size() && a[i].kind == b[i].kind && a[i].index == b[i].index && a[i].h == b[i].h)
+            continue;
+        const E& e = i < a.size() ? a[i] : b[i];
+        std::printf("  %s %s %d%s\n", shown ? "also" : "first divergent entity:", e.kind.c_str(), e.index,
+                    i >= a.size() || i >= b.size() ? " (only one side has it)" : "");
+        shown++;
+    }
+}
+
+static bool compareRuns(const char* what, const char* nameA, const std::function<VerifyRun*()>& makeA,
+                        const char* nameB, const std::function<VerifyRun*()>& makeB,
+                        int ticks, int sync, const char* logPath)
+{
+    double hashUs = 0;
+    std::vector<uint64_t> a = recordHashes(makeA, ticks, sync, &hashUs);
+    std::vector<uint64_t> b = recordHashes(makeB, ticks, sync);
+    if (logPath && !saveHashLog(logPath, a)) std::fprintf(stderr, "cannot write hash log %s\n", logPath);
+
+    int t = firstDivergence(a, b);
+    std::printf("%s: %s vs %s, %d ticks, hashing %.1f us/tick\n", what, nameA, nameB, ticks, hashUs);
+    if (t < 0)
+    {
+        std::printf("identical\n");
+        return true;
+    }
+    std::printf("DIVERGED at tick %d (t = %.3f s)\n", t, (t + 1) * (double)DT);
+    pinpoint(makeA, makeB, t);
+    return false;
+}
+
+// --verify threads|simd|events
+static bool verifyDeterminism(const char* mode, int ticks, int threads, const char* logPath)
+{
+    if (std::strcmp(mode, "threads") == 0)
+    {
+        char nb[32];
+        std::snprintf(nb, sizeof nb, "task graph x%d", threads);
+        return compareRuns("scene", "serial", []() { return new SimRun(0); },
+                           nb, [threads]() { return new SimRun(threads); }, ticks, 1, logPath);
+    }
+    if (std::strcmp(mode, "simd") == 0)
+        return compareRuns("fleet (2000 trains)", "scalar", []() { return new FleetRun(2000, false); },
+                           "sse2", []() { return new FleetRun(2000, true); }, ticks, 1, logPath);
+    if (std::strcmp(mode, "events") == 0)
+        return compareRuns("interior (20000 pax/h)", "every tick", []() { return new InteriorRun(1); },
+                           "1 s batches", []() { return new InteriorRun(60); }, ticks, 60, logPath);
+    std::fprintf(stderr, "unknown --verify mode %s (threads, simd, events)\n", mode);
+    return false;
+}
+
+// --compare-logs a b
+static bool compareHashLogs(const char* pathA, const char* pathB)
+{
+    std::vector<uint64_t> a, b;
+    if (!loadHashLog(pathA, a) || !loadHashLog(pathB, b))
+    {
+        std::fprintf(stderr, "cannot read hash logs\n");
+        return false;
+    }
+    int t = firstDivergence(a, b);
+    if (t < 0) std::printf("logs identical (%zu ticks)\n", a.size());
+    else       std::printf("logs diverge at tick %d\n", t);
+    return t < 0;
+}
+#endif
+
+// --------------------------- C API ---------------------------
+struct metro_sim
+{
+    Sim sim;
+    SoftBackend soft;
+    int aa = METRO_AA_OFF;
+    std::vector<uint8_t> supersampled;
+};
+
+extern "C" metro_sim* metro_sim_create(const char* taps_path)
+{
+    metro_sim* m = new metro_sim();
+    if (taps_path && !openTapStream(m->sim.taps, taps_path))
+    {
+        delete m;
+        return nullptr;
+    }
+    initSim(m->sim);
+    return m;
+}
+
+extern "C" void metro_sim_destroy(metro_sim* m)
+{
+    if (!m) return;
+    closeTapStream(m->sim.taps);
+    delete m;
+}
+
+extern "C" void metro_sim_step(metro_sim* m, int ticks)
+{
+    for (int i = 0; i < ticks; i++) stepSim(m->sim, DT);
+}
+
+extern "C" void metro_sim_set_night(metro_sim* m, int night)
+{
+    setClock(m->sim, night ? 22 * 60.0 : 10 * 60.0);
+}
+
+extern "C" void metro_sim_set_clock(metro_sim* m, double minute_of_day, double minutes_per_second)
+{
+    m->sim.clockRate = (float)minutes_per_second;
+    setClock(m->sim, minute_of_day);
+}
+
+extern "C" void metro_sim_set_crowd_overlay(metro_sim* m, int on)
+{
+    m->sim.showCrowd = on != 0;
+}
+
+extern "C" void metro_sim_set_antialias(metro_sim* m, int mode)
+{
+    m->aa = mode;
+    m->soft.aa = mode == METRO_AA_COVERAGE ? AA_COVERAGE : AA_OFF;
+}
+
+extern "C" void metro_sim_get_state(const metro_sim* m, metro_sim_state* out)
+{
+    const Sim& sim = m->sim;
+    out->time = sim.time;
+    out->train_state = (int)sim.state;
+    out->train_x = sim.trainX;
+    out->door_open = sim.doorOpen;
+    out->signal_green = sim.signalGreen ? 1 : 0;
+    out->cycle = sim.cycle;
+    out->passengers_waiting = 0;
+    for (auto &p : sim.passengers)
+        if (p.active) out->passengers_waiting++;
+    out->passengers_boarded = sim.boarded;
+    out->passengers_in_station = sim.station.inside + (int)sim.arriving.size();
+    out->night = sim.night ? 1 : 0;
+    out->clock_minutes = sim.clock;
+}
+
+extern "C" int metro_sim_render(metro_sim* m, uint8_t* rgba, int width, int height, int stride)
+{
+    if (!rgba || width <= 0 || height <= 0 || stride < width * 4) return -1;
+    if (m->aa == METRO_AA_SSAA4)
+        renderSupersampled(m->sim, m->soft, m->supersampled, rgba, width, height, (size_t)stride, 2, AA_OFF);
+    else
+        renderSoftware(m->sim, m->soft, rgba, width, height, (size_t)stride);
+    return 0;
+}
+
+extern "C" void metro_sim_asset_cache(const char* dir, uint64_t max_bytes)
+{
+    openAssetCache(dir, max_bytes);
+}
+
+#ifndef METRO_LIBRARY
+// --------------------------- Window (GLUT) ---------------------------
+static Sim gSim;
+
+static bool gAlwaysRedraw = false;
+static uint64_t gShownHash = 0;
+static bool gShownValid = false;
+static uint64_t gFramesDrawn = 0, gFramesSkipped = 0;
+
+static const char* gCapturePath = nullptr;   // capture the next frame here
+static WhatIfStudy gWhatIf;                  // W: branches running in the background
+
+// Optional task-graph frame (--task-graph)
+static ThreadPool* gPool = nullptr;
+static TaskGraph* gFrameGraph = nullptr;
+static FrameLayers gLayers;
+static int gGraphFrames = 0;
+static double gGraphWallMs = 0;
+
+// Startup cache warm-up and its two milestones
+static Warmup gWarmup;
+static std::chrono::steady_clock::time_point gStartTime;
+static bool gFirstFrameReported = false, gFullSpeedReported = false;
+
+static void pollWarmup()
+{
+    if (gWarmup.pool && warmupDone(gWarmup)) finishWarmup(gWarmup);
+}
+
+// After each presented frame
+static void reportStartup()
+{
+    if (gFullSpeedReported) return;
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - gStartTime).count();
+    if (!gFirstFrameReported)
+    {
+        std::printf("first frame after %.1f ms%s\n", ms, gWarmupRunning ? " (direct drawing, caches warming up)" : "");
+        gFirstFrameReported = true;
+    }
+    if (!gWarmupRunning)
+    {
+        if (gWarmup.jobs)
+            std::printf("full speed after %.1f ms (%d cache jobs, %.1f ms of work on %d threads, "
+                        "%d assets from disk)\n",
+                        ms, gWarmup.jobs, gWarmup.workUs / 1000.0, gWarmup.threads, gAssetCache.hits.load());
+        gFullSpeedReported = true;
+    }
+}
+
+static void display()
+{
+    TraceRecorder rec;
+    if (gCapturePath)
+    {
+        rec.forward = gGfx;
+        gGfx = &rec;
+    }
 
-            // Door frame
-            if (!gNight) setColor(0.18f, 0.18f, 0.20f);
-            else         setColor(0.90f, 0.90f, 0.95f);
-            rectOutline(doorX, doorY, doorW, doorH);
+    if (gFrameGraph) submitLayers(gLayers, *gGfx);
+    else
+    {
+        gGfx->clear();
+        drawScene(gSim);
+    }
 
-            // Sliding doors: left + right panels move outward as gDoorOpen increases
-            float slide = (doorW * 0.5f) * gDoorOpen;
+    if (gCapturePath)
+    {
+        gGfx = rec.forward;
+        if (saveTrace(gCapturePath, rec.bytes))
+            std::printf("captured %zu trace bytes to %s\n", rec.bytes.size(), gCapturePath);
+        else
+            std::fprintf(stderr, "cannot write trace %s\n", gCapturePath);
+        gCapturePath = nullptr;
+    }
 
-            // Left panel
-            if (!gNight) setColor(0.93f, 0.93f, 0.95f);
-            else         setColor(0.30f, 0.30f, 0.35f);
-            rectFilled(doorX, doorY, doorW * 0.5f - slide, doorH);
+    glutSwapBuffers();
+    reportStartup();
+}
 
-            // Right panel
-            rectFilled(doorX + doorW * 0.5f + slide, doorY,
-                       doorW * 0.5f - slide, doorH);
+// --------------------------- Timer / Animation ---------------------------
+static void timer(int)
+{
+    pollWarmup();
+    if (gFrameGraph)
+    {
+        auto t0 = std::chrono::steady_clock::now();
+        gFrameGraph->run(*gPool);
+        gGraphWallMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        if (++gGraphFrames == 300)
+        {
+            printFrameGraphStats(*gFrameGraph, gGraphWallMs / gGraphFrames);
+            gGraphFrames = 0;
+            gGraphWallMs = 0;
         }
     }
+    else stepSim(gSim, DT);
+    logTick(gSim);
+    pollWhatIf(gWhatIf);
 
-    // Front cabin (extra)
-    if (!gNight) setColor(0.85f, 0.20f, 0.20f);
-    else         setColor(0.65f, 0.16f, 0.18f);
-    rectFilled(coaches * (coachW + gap), 30, 70, 60);
-
-    // Cabin window
-    if (!gNight) setColor(0.55f, 0.75f, 0.95f);
-    else         setColor(0.95f, 0.85f, 0.40f);
-    rectFilled(coaches * (coachW + gap) + 20, 60, 35, 18);
-
-    // Wheels (under each coach)
-    for (int i = 0; i < coaches; i++)
+    uint64_t h = visibleStateHash(gSim);
+    if (gAlwaysRedraw || gCapturePath || !gShownValid || h != gShownHash)
     {
-        float ox = i * (coachW + gap);
-        drawWheel(ox + 35, 18, 12);
-        drawWheel(ox + coachW - 35, 18, 12);
+        gShownHash = h;
+        gShownValid = true;
+        gFramesDrawn++;
+        glutPostRedisplay();
     }
-    // Wheels under cabin
-    drawWheel(coaches * (coachW + gap) + 20, 18, 12);
-    drawWheel(coaches * (coachW + gap) + 55, 18, 12);
+    else gFramesSkipped++;
 
-    glPopMatrix();
+    glutTimerFunc(TIMER_MS, timer, 0);
 }
 
-// --------------------------- Cloud animation ---------------------------
-static float c1x = 120.0f, c2x = 520.0f, c3x = 860.0f;
-static float cloudSpeed = 25.0f;
-
-// --------------------------- State Machine Update ---------------------------
-static float stateTimer = 0.0f;
-
-static void updateStateMachine(float dt)
+// --------------------------- Input ---------------------------
+static void keyboard(unsigned char key, int, int)
 {
-    stateTimer += dt;
+    if (key == 27)
+    {
+        std::printf("frames drawn %llu, skipped as unchanged %llu\n",
+                    (unsigned long long)gFramesDrawn, (unsigned long long)gFramesSkipped);
+        if (gHashLog) std::fclose(gHashLog);
+        exit(0);
+    }
+    if (key == 'd' || key == 'D') setClock(gSim, 10 * 60.0);
+    if (key == 'n' || key == 'N') setClock(gSim, 22 * 60.0);
+    if (key == 'c' || key == 'C') gCapturePath = "frame.mtrace";
+    if (key == 'h' || key == 'H') gSim.showCrowd = !gSim.showCrowd;
+    if ((key == 'w' || key == 'W') && !gWhatIf.running)
+    {
+        // The task graph's workers are idle between frames, but warm-up
+        // jobs may be mid-bake holding cache locks: no fork until they end
+        std::printf("what-if: %d branches, next 30 min...\n", WHAT_IF_COUNT);
+        startWhatIf(gWhatIf, gSim, 30.0, gWarmup.pool == nullptr);
+        if (!gWhatIf.running) printWhatIf(gWhatIf);
+    }
+}
 
-    // Wheel rotation increases while moving
-    auto wheelAdvance = [&](float speedFactor)
+// --------------------------- Software Window (MIT-SHM) ---------------------------
+// The software rasterizer draws straight into one of two shared-memory
+// XImages and presenting is XShmPutImage: the X server blits from the shared
+// segment, nothing is copied on the client. A buffer is drawn into again only
+// after the server's ShmCompletion event says its last blit finished.
+// Servers that cannot share memory with us (remote, or a different IPC
+// namespace) refuse the attach; then frames go out with plain XPutImage.
+// Needs no GPU, so it runs under Xvfb. Build with -DMETRO_XSHM, link -lX11 -lXext.
+#ifdef METRO_XSHM
+// XShmAttach fails asynchronously (BadAccess), which would kill the process
+// under the default handler; this one just records it
+static bool gShmFailed = false;
+static int shmErrorHandler(Display*, XErrorEvent*) { gShmFailed = true; return 0; }
+
+struct ShmPresenter
+{
+    struct Buf
     {
-        gWheelAngle -= 360.0f * speedFactor * dt;  // negative for forward
-        if (gWheelAngle < -360.0f) gWheelAngle += 360.0f;
+        XImage* img = nullptr;
+        XShmSegmentInfo shm{};
+        bool shared = false;    // img->data is the shm segment
+        bool attached = false;
+        bool busy = false;      // server still reading it
     };
 
-    switch (gState)
+    Display* dpy = nullptr;
+    Window win = 0;
+    GC gc = nullptr;
+    Atom wmDelete = 0;
+    int completion = 0;         // ShmCompletion event type
+    int w = 0, h = 0;
+    bool bgra = false;          // visual wants B,G,R,X byte order
+    bool useShm = false;        // false: XPutImage from client memory
+    bool quit = false, exposed = false;
+    Buf buf[2];
+    int back = 0;
+
+    bool openShm(Visual* vis, int depth)
     {
-        case TS_MOVING_TO_STATION:
+        for (auto &b : buf)
         {
-            gSignalGreen = true;
-            gDoorOpen = 0.0f;
-
-            gTrainX += gTrainSpeed * dt;
-            wheelAdvance(1.2f);
+            b.img = XShmCreateImage(dpy, vis, depth, ZPixmap, nullptr, &b.shm, w, h);
+            if (!b.img || b.img->bits_per_pixel != 32) return false;
+            b.shm.shmid = shmget(IPC_PRIVATE, (size_t)b.img->bytes_per_line * h, IPC_CREAT | 0600);
+            if (b.shm.shmid < 0) return false;
+            b.shm.shmaddr = b.img->data = (char*)shmat(b.shm.shmid, nullptr, 0);
+            // Marked for removal now; it lives until both sides detach
+            shmctl(b.shm.shmid, IPC_RMID, nullptr);
+            if (b.shm.shmaddr == (char*)-1) { b.img->data = nullptr; return false; }
+            b.shared = true;
+            b.shm.readOnly = False;
+        }
+        gShmFailed = false;
+        XErrorHandler prev = XSetErrorHandler(shmErrorHandler);
+        for (auto &b : buf) b.attached = XShmAttach(dpy, &b.shm);
+        XSync(dpy, False);
+        XSetErrorHandler(prev);
+        if (gShmFailed) for (auto &b : buf) b.attached = false;   // nothing to detach
+        return !gShmFailed && buf[0].attached && buf[1].attached;
+    }
 
-            // When near station stop point -> arriving (slowdown)
-            if (gTrainX >= STATION_STOP_X)
+    void freeImages()
+    {
+        gShmFailed = false;
+        XErrorHandler prev = XSetErrorHandler(shmErrorHandler);
+        for (auto &b : buf)
+        {
+            if (b.attached) XShmDetach(dpy, &b.shm);
+            if (b.img)
             {
-                gTrainX = STATION_STOP_X;
-                gState = TS_ARRIVING;
-                stateTimer = 0.0f;
+                if (b.shared)
+                {
+                    shmdt(b.shm.shmaddr);
+                    b.img->data = nullptr;
+                }
+                XDestroyImage(b.img);    // frees client memory for plain images
             }
-        } break;
+            b = Buf();
+        }
+        XSync(dpy, False);
+        XSetErrorHandler(prev);
+    }
 
-        case TS_ARRIVING:
+    bool open(int width, int height, const char* title)
+    {
+        dpy = XOpenDisplay(nullptr);
+        if (!dpy) return false;
+
+        int scr = DefaultScreen(dpy);
+        Visual* vis = DefaultVisual(dpy, scr);
+        int depth = DefaultDepth(dpy, scr);
+        bgra = vis->red_mask == 0xff0000 && vis->blue_mask == 0xff;
+        if (depth < 24 || (!bgra && !(vis->red_mask == 0xff && vis->blue_mask == 0xff0000)))
         {
-            // Small pause to feel like arrival
-            gSignalGreen = true;
-            if (stateTimer > 0.35f)
-            {
-                gState = TS_STOPPED_SIGNAL_RED;
-                stateTimer = 0.0f;
-            }
-        } break;
+            std::fprintf(stderr, "unsupported visual (depth %d)\n", depth);
+            return false;
+        }
 
-        case TS_STOPPED_SIGNAL_RED:
+        w = width; h = height;
+        win = XCreateSimpleWindow(dpy, RootWindow(dpy, scr), 0, 0, w, h, 0,
+                                  BlackPixel(dpy, scr), BlackPixel(dpy, scr));
+        XStoreName(dpy, win, title);
+        XSelectInput(dpy, win, KeyPressMask | ExposureMask);
+        wmDelete = XInternAtom(dpy, "WM_DELETE_WINDOW", False);
+        XSetWMProtocols(dpy, win, &wmDelete, 1);
+        gc = XCreateGC(dpy, win, 0, nullptr);
+
+        useShm = XShmQueryExtension(dpy) && openShm(vis, depth);
+        if (useShm) completion = XShmGetEventBase(dpy) + ShmCompletion;
+        else
         {
-            gSignalGreen = false;
-            // Wait then open doors
-            if (stateTimer > 0.6f)
+            std::fprintf(stderr, "MIT-SHM unavailable, presenting with XPutImage\n");
+            freeImages();
+            for (auto &b : buf)
             {
-                gState = TS_DOORS_OPENING;
-                stateTimer = 0.0f;
+                char* px = (char*)std::malloc((size_t)w * h * 4);
+                b.img = px ? XCreateImage(dpy, vis, depth, ZPixmap, 0, px, w, h, 32, 0) : nullptr;
+                if (!b.img) { std::free(px); return false; }
+                if (b.img->bits_per_pixel != 32) return false;
             }
-        } break;
+        }
+        XMapWindow(dpy, win);
+        return true;
+    }
 
-        case TS_DOORS_OPENING:
-        {
-            gSignalGreen = false;
-            gDoorOpen = std::min(1.0f, gDoorOpen + 1.3f * dt);
+    void close()
+    {
+        if (!dpy) return;
+        freeImages();
+        if (gc) XFreeGC(dpy, gc);
+        if (win) XDestroyWindow(dpy, win);
+        XCloseDisplay(dpy);
+        dpy = nullptr;
+    }
 
-            if (gDoorOpen >= 1.0f && stateTimer > 0.2f)
-            {
-                gState = TS_PASSENGERS_BOARDING;
-                stateTimer = 0.0f;
-            }
-        } break;
+    void handle(XEvent& e, void (*onKey)(unsigned char, int, int))
+    {
+        if (useShm && e.type == completion)
+        {
+            const XShmCompletionEvent& c = (const XShmCompletionEvent&)e;
+            for (auto &b : buf)
+                if (b.shm.shmseg == c.shmseg) b.busy = false;
+        }
+        else if (e.type == KeyPress)
+        {
+            char txt[8];
+            KeySym ks;
+            int n = XLookupString(&e.xkey, txt, sizeof txt, &ks, nullptr);
+            if (ks == XK_Escape) onKey(27, 0, 0);
+            else if (n > 0) onKey((unsigned char)txt[0], 0, 0);
+        }
+        else if (e.type == Expose) exposed = true;
+        else if (e.type == ClientMessage && (Atom)e.xclient.data.l[0] == wmDelete) quit = true;
+    }
 
-        case TS_PASSENGERS_BOARDING:
+    void pump(void (*onKey)(unsigned char, int, int))
+    {
+        XEvent e;
+        while (XPending(dpy))
         {
-            gSignalGreen = false;
+            XNextEvent(dpy, &e);
+            handle(e, onKey);
+        }
+    }
 
-            float doorX = trainDoorWorldX() + 65.0f; // door frame-ish center
-            // Move passengers toward door; when inside => disappear
-            auto movePassenger = [&](Passenger& p)
-            {
-                if (!p.active) return;
-                float targetX = doorX;
-                float dx = targetX - p.x;
-                float step = p.speed * dt;
+    // Back buffer, once the server is done with it
+    uint8_t* acquire(void (*onKey)(unsigned char, int, int))
+    {
+        XEvent e;
+        while (buf[back].busy && !quit)
+        {
+            XNextEvent(dpy, &e);
+            handle(e, onKey);
+        }
+        return (uint8_t*)buf[back].img->data;
+    }
 
-                if (std::fabs(dx) <= step)
-                    p.x = targetX;
-                else
-                    p.x += (dx > 0 ? step : -step);
+    size_t stride() const { return (size_t)buf[back].img->bytes_per_line; }
 
-                p.legPhase += 8.0f * dt;
+    void present()
+    {
+        if (useShm)
+        {
+            XShmPutImage(dpy, win, gc, buf[back].img, 0, 0, 0, 0, w, h, True);
+            buf[back].busy = true;
+        }
+        else XPutImage(dpy, win, gc, buf[back].img, 0, 0, 0, 0, w, h);   // copied into the request
+        XFlush(dpy);
+        back ^= 1;
+    }
+};
 
-                // "Enter train" condition (near door + doors open)
-                if (std::fabs(p.x - targetX) < 2.0f && gDoorOpen > 0.95f)
-                {
-                    p.active = false; // disappears after boarding (required)
-                }
-            };
+// Paced like the GLUT timer; with frames > 0 runs that many frames
+// back to back (every frame drawn) and reports where the time went.
+static int runSoftWindow(int frames, bool layered, int aa)
+{
+    ShmPresenter sp;
+    if (!sp.open(W, H, "Metro Rail Simulation (software / MIT-SHM)"))
+    {
+        std::fprintf(stderr, "cannot open an MIT-SHM window\n");
+        sp.close();
+        return 1;
+    }
 
-            movePassenger(p1);
-            movePassenger(p2);
+    SoftBackend soft;
+    soft.bgra = sp.bgra;
+    soft.aa = aa == METRO_AA_COVERAGE ? AA_COVERAGE : AA_OFF;
+    Compositor comp;
+    comp.be.aa = soft.aa;
+    std::vector<uint8_t> supersampled;
+    double msWait = 0, msRender = 0, msPresent = 0;
+    auto ms = [](std::chrono::steady_clock::time_point a, std::chrono::steady_clock::time_point b)
+    {
+        return std::chrono::duration<double, std::milli>(b - a).count();
+    };
 
-            // When both boarded, close doors
-            if (!p1.active && !p2.active && stateTimer > 0.4f)
-            {
-                gState = TS_DOORS_CLOSING;
-                stateTimer = 0.0f;
-            }
-        } break;
+    auto next = std::chrono::steady_clock::now();
+    for (int f = 0; (frames == 0 || f < frames) && !sp.quit; f++)
+    {
+        sp.pump(keyboard);
+        pollWarmup();
+        stepSim(gSim, DT);
+        logTick(gSim);
+        pollWhatIf(gWhatIf);
+
+        uint64_t h = visibleStateHash(gSim);
+        if (frames || gAlwaysRedraw || sp.exposed || !gShownValid || h != gShownHash)
+        {
+            auto t0 = std::chrono::steady_clock::now();
+            uint8_t* px = sp.acquire(keyboard);
+            auto t1 = std::chrono::steady_clock::now();
+            if (aa == METRO_AA_SSAA4) renderSupersampled(gSim, soft, supersampled, px, W, H, sp.stride(), 2, AA_OFF);
+            else if (layered) renderComposited(gSim, comp, sp.bgra, px, W, H, sp.stride());
+            else renderSoftware(gSim, soft, px, W, H, sp.stride());
+            auto t2 = std::chrono::steady_clock::now();
+            sp.present();
+            auto t3 = std::chrono::steady_clock::now();
+            reportStartup();
+            msWait += ms(t0, t1); msRender += ms(t1, t2); msPresent += ms(t2, t3);
+
+            gShownHash = h;
+            gShownValid = true;
+            sp.exposed = false;
+            gFramesDrawn++;
+        }
+        else gFramesSkipped++;
 
-        case TS_DOORS_CLOSING:
+        if (!frames)
         {
-            gSignalGreen = false;
-            gDoorOpen = std::max(0.0f, gDoorOpen - 1.3f * dt);
+            next += std::chrono::milliseconds(TIMER_MS);
+            std::this_thread::sleep_until(next);
+        }
+    }
 
-            if (gDoorOpen <= 0.0f)
-            {
-                gState = TS_SIGNAL_GREEN_WAIT;
-                stateTimer = 0.0f;
-            }
-        } break;
+    if (gFramesDrawn)
+        std::printf("soft/shm frames %llu: wait %.3f ms, render %.3f ms, present %.3f ms per frame\n",
+                    (unsigned long long)gFramesDrawn, msWait / gFramesDrawn,
+                    msRender / gFramesDrawn, msPresent / gFramesDrawn);
+    if (layered) printCompositor(comp);
+    sp.close();
+    return 0;
+}
+#endif // METRO_XSHM
 
-        case TS_SIGNAL_GREEN_WAIT:
-        {
-            // Turn signal green, then depart
-            gSignalGreen = true;
-            if (stateTimer > 0.5f)
-            {
-                gState = TS_MOVING_AWAY;
-                stateTimer = 0.0f;
-            }
-        } break;
+// --------------------------- Init ---------------------------
+static void initGL()
+{
+    glClearColor(0, 0, 0, 1);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    gluOrtho2D(0, W, 0, H);
 
-        case TS_MOVING_AWAY:
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+
+    glDisable(GL_DEPTH_TEST);
+    glPointSize(2.0f);
+}
+
+// --------------------------- Main ---------------------------
+int main(int argc, char** argv)
+{
+    gStartTime = std::chrono::steady_clock::now();
+    const char* netPath = nullptr;
+    const char* tapsPath = nullptr;
+    const char* replayPath = nullptr;
+    int replayIters = 500;
+    int fleetTrains = 0, ticks = 2000;
+    double stationRate = 0.0;
+    double surrogateRate = 0.0;
+    int batchRuns = 0, workers = 0;
+    double batchRate = 5000.0, batchSeconds = 3600.0;
+    double batchTarget[BATCH_KPIS] = {}, confidence = 0.95;
+    int stressRuns = 0;
+    double whatIfMinutes = 0.0;
+    double capacity = 200.0, stressWindow = 300.0, stressTilt = 1.05, stressHold = 120.0;
+    bool surrogateCheck = false;
+    int crowdAgents = 0;
+    int cloudCount = 0;
+    bool taskGraph = false;
+    bool softWindow = false;
+    bool warmup = true, warmupBench = false;
+    double startClock = -1.0, dayLength = -1.0;
+    int softFrames = 0;
+    bool layered = false;
+    int compositorBench = 0;
+    int aaBench = 0;
+    int aa = METRO_AA_OFF;
+    int graphBench = 0;
+    int threads = (int)std::max(1u, std::thread::hardware_concurrency());
+    bool printTT = false;
+    int delayBench = 0;
+    bool circulation = false;
+    int fleetLimit = 0;
+    int32_t turnaround = 240;
+    std::string assetDir = defaultAssetCacheDir();
+    double assetMb = 64.0;
+    const char* verifyMode = nullptr;
+    const char* hashLogPath = nullptr;
+    const char* compareLogs[2] = { nullptr, nullptr };
+    std::vector<std::pair<int, uint32_t>> segEdits;
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::strcmp(argv[i], "--taps") == 0 && i + 1 < argc) tapsPath = argv[++i];
+        else if (std::strcmp(argv[i], "--network") == 0 && i + 1 < argc) netPath = argv[++i];
+        else if (std::strcmp(argv[i], "--travel-times") == 0) printTT = true;
+        else if (std::strcmp(argv[i], "--delay-bench") == 0 && i + 1 < argc) delayBench = std::max(1, std::atoi(argv[++i]));
+        else if (std::strcmp(argv[i], "--circulation") == 0) circulation = true;
+        else if (std::strcmp(argv[i], "--fleet-limit") == 0 && i + 1 < argc) fleetLimit = std::max(0, std::atoi(argv[++i]));
+        else if (std::strcmp(argv[i], "--turnaround") == 0 && i + 1 < argc) turnaround = std::max(0, std::atoi(argv[++i]));
+        else if (std::strcmp(argv[i], "--always-redraw") == 0) gAlwaysRedraw = true;
+        else if (std::strcmp(argv[i], "--capture-trace") == 0 && i + 1 < argc) gCapturePath = argv[++i];
+        else if (std::strcmp(argv[i], "--replay-trace") == 0 && i + 1 < argc) replayPath = argv[++i];
+        else if (std::strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) replayIters = std::max(1, std::atoi(argv[++i]));
+        else if (std::strcmp(argv[i], "--fleet-bench") == 0 && i + 1 < argc) fleetTrains = std::max(1, std::atoi(argv[++i]));
+        else if (std::strcmp(argv[i], "--station-bench") == 0 && i + 1 < argc) stationRate = std::atof(argv[++i]);
+        else if (std::strcmp(argv[i], "--surrogate") == 0 && i + 1 < argc) surrogateRate = std::atof(argv[++i]);
+        else if (std::strcmp(argv[i], "--surrogate-check") == 0) surrogateCheck = true;
+        else if (std::strcmp(argv[i], "--batch") == 0 && i + 1 < argc) batchRuns = std::max(1, std::atoi(argv[++i]));
+        else if (std::strcmp(argv[i], "--workers") == 0 && i + 1 < argc) workers = std::max(1, std::atoi(argv[++i]));
+        else if (std::strcmp(argv[i], "--batch-rate") == 0 && i + 1 < argc) batchRate = std::max(1.0, std::atof(argv[++i]));
+        else if (std::strcmp(argv[i], "--stress") == 0 && i + 1 < argc) stressRuns = std::max(2, std::atoi(argv[++i]));
+        else if (std::strcmp(argv[i], "--what-if") == 0 && i + 1 < argc) whatIfMinutes = std::max(0.1, std::atof(argv[++i]));
+        else if (std::strcmp(argv[i], "--capacity") == 0 && i + 1 < argc) capacity = std::atof(argv[++i]);
+        else if (std::strcmp(argv[i], "--stress-window") == 0 && i + 1 < argc) stressWindow = std::max(1.0, std::atof(argv[++i]));
+        else if (std::strcmp(argv[i], "--stress-demand") == 0 && i + 1 < argc) stressTilt = std::max(0.1, std::atof(argv[++i]));
+        else if (std::strcmp(argv[i], "--stress-hold") == 0 && i + 1 < argc) stressHold = std::max(1.0, std::atof(argv[++i]));
+        else if (std::strcmp(argv[i], "--precision") == 0 && i + 1 < argc)
         {
-            gSignalGreen = true;
-            gTrainX += gTrainSpeed * dt;
-            wheelAdvance(1.2f);
+            double pct = std::atof(argv[++i]);
+            for (double& t : batchTarget) t = pct / 100.0;
+        }
+        else if (std::strcmp(argv[i], "--target") == 0 && i + 1 < argc)
+        {
+            const char* eq = std::strchr(argv[++i], '=');
+            std::string key = eq ? std::string(argv[i], eq - argv[i]) : std::string();
+            int k = 0;
+            while (!key.empty() && k < BATCH_KPIS && key != BATCH_KPI_KEY[k]) k++;   // exact name only
+            if (!key.empty() && k < BATCH_KPIS) batchTarget[k] = std::atof(eq + 1) / 100.0;
+            else std::fprintf(stderr, "--target wants <kpi>=<percent>, kpi one of gate, escalator, "
+                                      "transit, headway, crowd, wait\n");
+        }
+        else if (std::strcmp(argv[i], "--confidence") == 0 && i + 1 < argc)
+            confidence = std::min(0.999, std::max(0.5, std::atof(argv[++i]) / 100.0));
+        else if (std::strcmp(argv[i], "--batch-seconds") == 0 && i + 1 < argc) batchSeconds = std::max(1.0, std::atof(argv[++i]));
+        else if (std::strcmp(argv[i], "--task-graph") == 0) taskGraph = true;
+        else if (std::strcmp(argv[i], "--soft-window") == 0) softWindow = true;
+        else if (std::strcmp(argv[i], "--layers") == 0) layered = true;
+        else if (std::strcmp(argv[i], "--compositor-bench") == 0 && i + 1 < argc) compositorBench = std::max(1, std::atoi(argv[++i]));
+        else if (std::strcmp(argv[i], "--aa-bench") == 0 && i + 1 < argc) aaBench = std::max(1, std::atoi(argv[++i]));
+        else if (std::strcmp(argv[i], "--aa") == 0 && i + 1 < argc)
+        {
+            const char* mode = argv[++i];
+            if (std::strcmp(mode, "coverage") == 0) aa = METRO_AA_COVERAGE;
+            else if (std::strcmp(mode, "ssaa4") == 0) aa = METRO_AA_SSAA4;
+            else if (std::strcmp(mode, "off") != 0) std::fprintf(stderr, "--aa wants off, coverage or ssaa4\n");
+        }
+        else if (std::strcmp(argv[i], "--no-warmup") == 0) warmup = false;
+        else if (std::strcmp(argv[i], "--warmup-bench") == 0) warmupBench = true;
+        else if (std::strcmp(argv[i], "--clock") == 0 && i + 1 < argc)
+        {
+            int hh = 0, mm = 0;
+            if (std::sscanf(argv[++i], "%d:%d", &hh, &mm) >= 1) startClock = hh * 60.0 + mm;
+        }
+        else if (std::strcmp(argv[i], "--day-length") == 0 && i + 1 < argc) dayLength = std::atof(argv[++i]);
+        else if (std::strcmp(argv[i], "--frames") == 0 && i + 1 < argc) softFrames = std::max(1, std::atoi(argv[++i]));
+        else if (std::strcmp(argv[i], "--task-graph-bench") == 0 && i + 1 < argc) graphBench = std::max(1, std::atoi(argv[++i]));
+        else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threads = std::max(1, std::atoi(argv[++i]));
+        else if (std::strcmp(argv[i], "--cloud-bench") == 0 && i + 1 < argc) cloudCount = std::max(1, std::atoi(argv[++i]));
+        else if (std::strcmp(argv[i], "--crowd-bench") == 0 && i + 1 < argc) crowdAgents = std::max(1, std::atoi(argv[++i]));
+        else if (std::strcmp(argv[i], "--asset-cache") == 0 && i + 1 < argc) assetDir = argv[++i];
+        else if (std::strcmp(argv[i], "--asset-cache-mb") == 0 && i + 1 < argc) assetMb = std::atof(argv[++i]);
+        else if (std::strcmp(argv[i], "--no-asset-cache") == 0) assetDir.clear();
+        else if (std::strcmp(argv[i], "--verify") == 0 && i + 1 < argc) verifyMode = argv[++i];
+        else if (std::strcmp(argv[i], "--hash-log") == 0 && i + 1 < argc) hashLogPath = argv[++i];
+        else if (std::strcmp(argv[i], "--compare-logs") == 0 && i + 2 < argc)
+        {
+            compareLogs[0] = argv[i + 1];
+            compareLogs[1] = argv[i + 2];
+            i += 2;
+        }
+        else if (std::strcmp(argv[i], "--ticks") == 0 && i + 1 < argc) ticks = std::max(1, std::atoi(argv[++i]));
+        else if (std::strcmp(argv[i], "--segment") == 0 && i + 2 < argc)
+        {
+            char *endE = nullptr, *endS = nullptr;
+            long e = std::strtol(argv[i + 1], &endE, 10);
+            unsigned long secs = std::strtoul(argv[i + 2], &endS, 10);
+            if (endE == argv[i + 1] || *endE || e < 0 || e > INT32_MAX)
+                std::fprintf(stderr, "--segment %s: bad segment index\n", argv[i + 1]);
+            else if (endS == argv[i + 2] || *endS || argv[i + 2][0] == '-' || secs > SEG_MAX_SECS)
+                std::fprintf(stderr, "--segment %s: time must be 0..%u seconds\n", argv[i + 2], SEG_MAX_SECS);
+            else
+                segEdits.push_back({ (int)e, (uint32_t)secs });
+            i += 2;
+        }
+    }
 
-            // Once fully off screen to right, reset cycle
-            if (gTrainX > (float)W + 50.0f)
-            {
-                gTrainX = -TRAIN_LENGTH;
-                gDoorOpen = 0.0f;
+    openAssetCache(assetDir.c_str(), (uint64_t)(std::max(0.0, assetMb) * 1048576.0));
 
-                // New passengers each cycle (required)
-                gCycle++;
-                spawnPassengers();
+    if (!netPath || !loadNetwork(gNet, netPath))
+    {
+        if (netPath) std::fprintf(stderr, "cannot load network %s, using built-in\n", netPath);
+        defaultNetwork(gNet);
+    }
+    buildTravelMatrix(gNet);
+    for (auto &ed : segEdits)
+    {
+        if (ed.first >= 0 && ed.first < (int)gNet.segs.size())
+            setSegmentTime(gNet, ed.first, ed.second);
+        else
+            std::fprintf(stderr, "--segment %d: no such segment (network has %zu)\n", ed.first, gNet.segs.size());
+    }
 
-                gState = TS_MOVING_TO_STATION;
-                stateTimer = 0.0f;
-            }
-        } break;
+    if (printTT)
+    {
+        printTravelTimes(gNet);
+        return 0;
     }
-}
 
-// --------------------------- Display ---------------------------
-static void drawSky()
-{
-    if (!gNight) setColor(0.55f, 0.80f, 0.98f);
-    else         setColor(0.08f, 0.10f, 0.16f);
-    rectFilled(0, 0, W, H);
+    if (delayBench > 0)
+    {
+        benchDelays(gNet, delayBench);
+        return 0;
+    }
 
-    // Ground
-    if (!gNight) setColor(0.45f, 0.75f, 0.45f);
-    else         setColor(0.10f, 0.18f, 0.10f);
-    rectFilled(0, 0, W, 150);
-}
+    if (circulation)
+    {
+        runCirculation(gNet, turnaround, fleetLimit);
+        return 0;
+    }
 
-static void display()
-{
-    glClear(GL_COLOR_BUFFER_BIT);
+    if (stationRate > 0.0)
+    {
+        benchInterior(stationRate);
+        return 0;
+    }
 
-    drawSky();
-    drawSunMoon();
-    drawBuildings();
-    drawStation();
-    drawTrack();
-    drawSignal(gSignalGreen);
+    if (surrogateRate > 0.0)
+    {
+        runSurrogate(surrogateRate);
+        return 0;
+    }
 
-    // Moving clouds (translation required)
-    glPushMatrix();
-    glTranslatef(c1x, 520.0f, 0); drawCloud();
-    glPopMatrix();
+    if (surrogateCheck)
+    {
+        checkSurrogate();
+        return 0;
+    }
 
-    glPushMatrix();
-    glTranslatef(c2x, 480.0f, 0); glScalef(1.1f, 1.1f, 1.0f); drawCloud(); // scaling
-    glPopMatrix();
+    if (stressRuns)
+        return runImportance(stressRuns, workers ? workers : threads, batchRate, stressWindow, capacity,
+                             stressTilt, stressHold) ? 0 : 1;
 
-    glPushMatrix();
-    glTranslatef(c3x, 540.0f, 0); glScalef(0.9f, 0.9f, 1.0f); drawCloud(); // scaling
-    glPopMatrix();
+    if (batchRuns)
+        return runBatch(batchRuns, workers ? workers : threads, batchRate, batchSeconds,
+                        batchTarget, confidence) ? 0 : 1;
 
-    // Passengers
-    drawPassenger(p1, 1.0f);
-    drawPassenger(p2, 1.0f);
+    if (cloudCount)
+        return benchClouds(cloudCount) ? 0 : 1;
 
-    // Train
-    drawTrain();
+    if (warmupBench)
+    {
+        benchWarmup(threads);
+        return 0;
+    }
 
-    glutSwapBuffers();
-}
+    if (crowdAgents)
+    {
+        benchCrowd(crowdAgents, ticks);
+        return 0;
+    }
 
-// --------------------------- Timer / Animation ---------------------------
-static void timer(int)
-{
-    // Clouds move
-    c1x += cloudSpeed * DT;
-    c2x += (cloudSpeed * 0.8f) * DT;
-    c3x += (cloudSpeed * 1.1f) * DT;
+    if (aaBench)
+    {
+        benchAntialias(aaBench);
+        return 0;
+    }
 
-    if (c1x > W + 60) c1x = -60;
-    if (c2x > W + 60) c2x = -60;
-    if (c3x > W + 60) c3x = -60;
+    if (compositorBench)
+    {
+        benchCompositor(compositorBench);
+        return 0;
+    }
 
-    // State machine update
-    updateStateMachine(DT);
+    if (graphBench)
+    {
+        benchFrameGraph(graphBench, threads);
+        return 0;
+    }
 
-    glutPostRedisplay();
-    glutTimerFunc(TIMER_MS, timer, 0);
-}
+    if (fleetTrains)
+        return benchFleet(fleetTrains, ticks) ? 0 : 1;
 
-// --------------------------- Input ---------------------------
-static void keyboard(unsigned char key, int, int)
-{
-    if (key == 27) exit(0);
-    if (key == 'd' || key == 'D') gNight = false;
-    if (key == 'n' || key == 'N') gNight = true;
-}
+    if (verifyMode)
+        return verifyDeterminism(verifyMode, ticks, threads, hashLogPath) ? 0 : 1;
 
-// --------------------------- Init ---------------------------
-static void initGL()
-{
-    glClearColor(0, 0, 0, 1);
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    gluOrtho2D(0, W, 0, H);
+    if (compareLogs[0])
+        return compareHashLogs(compareLogs[0], compareLogs[1]) ? 0 : 1;
 
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
+    if (replayPath)
+    {
+        std::vector<uint8_t> ops;
+        if (!loadTrace(replayPath, ops) || !replayTrace(ops.data(), ops.size(), gNullBackend))
+        {
+            std::fprintf(stderr, "cannot read trace %s\n", replayPath);
+            return 1;
+        }
+        std::printf("trace %s: %zu bytes\n", replayPath, ops.size());
+        benchReplay(ops, gNullBackend, replayIters);
+        {
+            std::vector<uint8_t> fb((size_t)W * H * 4);
+            SoftBackend soft;
+            soft.target(fb.data(), W, H, (size_t)W * 4);
+            benchReplay(ops, soft, replayIters);
+        }
 
-    glDisable(GL_DEPTH_TEST);
-    glPointSize(2.0f);
+#ifndef _WIN32
+        if (!std::getenv("DISPLAY"))
+        {
+            std::printf("gl       skipped (no DISPLAY)\n");
+            return 0;
+        }
+#endif
+        glutInit(&argc, argv);
+        glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB);
+        glutInitWindowSize(W, H);
+        glutCreateWindow("Metro trace replay");
+        initGL();
+        benchReplay(ops, gGlBackend, replayIters, []() { glFinish(); });
+        return 0;
+    }
 
-    // Start passengers for first cycle
-    spawnPassengers();
-    gState = TS_MOVING_TO_STATION;
-    stateTimer = 0.0f;
-}
+    if (tapsPath && !openTapStream(gSim.taps, tapsPath))
+        std::fprintf(stderr, "cannot open tap log %s\n", tapsPath);
+    if (startClock >= 0.0) gSim.clock = std::fmod(startClock, (double)DAY_MINUTES);
+    if (dayLength >= 0.0) gSim.clockRate = dayLength > 0.0 ? (float)(DAY_MINUTES / dayLength) : 0.0f;
+    // The headless what-if study forks, so no warm-up threads may be running
+    // (nor is there a frame to warm up for)
+    if (warmup && whatIfMinutes <= 0.0) startWarmup(gWarmup, threads);
+    initSim(gSim);
+    if (whatIfMinutes > 0.0)
+    {
+        runWhatIfStudy(gSim, ticks, whatIfMinutes);
+        return 0;
+    }
+    if (hashLogPath && !(gHashLog = openHashLog(hashLogPath)))
+        std::fprintf(stderr, "cannot write hash log %s\n", hashLogPath);
+    if (softWindow)
+    {
+#ifdef METRO_XSHM
+        return runSoftWindow(softFrames, layered, aa);
+#else
+        (void)softFrames;
+        (void)layered;
+        (void)aa;
+        std::fprintf(stderr, "--soft-window needs a build with -DMETRO_XSHM (-lX11 -lXext)\n");
+        return 1;
+#endif
+    }
+    gGfx = &gGlBackend;
+    if (taskGraph)
+    {
+        gPool = new ThreadPool(threads);
+        gFrameGraph = new TaskGraph();
+        buildFrameGraph(*gFrameGraph, gSim, gLayers, DT, nullptr);
+    }
 
-// --------------------------- Main ---------------------------
-int main(int argc, char** argv)
-{
     glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB);
     glutInitWindowSize(W, H);
@@ -857,3 +7722,4 @@ int main(int argc, char** argv)
     glutMainLoop();
     return 0;
 }
+#endif // METRO_LIBRARY
@@ -0,0 +1,93 @@
+/*
+   metro_sim.h - C API for embedding the metro simulation
+   ------------------------------------------------------
+   The simulation, raster algorithms and a software renderer built from
+   main.cpp with METRO_LIBRARY defined (no GLUT/OpenGL dependency):
+
+     g++ -std=c++17 -O2 -DMETRO_LIBRARY -c main.cpp -o metro_sim.o
+     ar rcs libmetro_sim.a metro_sim.o
+
+   Each instance is independent; different instances may be stepped and
+   rendered from different threads at the same time.
+*/
+
+#ifndef METRO_SIM_H
+#define METRO_SIM_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define METRO_SIM_WIDTH  1000   /* native scene size; render scales to any size */
+#define METRO_SIM_HEIGHT 600
+#define METRO_SIM_TICK   0.016  /* seconds per step tick */
+
+enum
+{
+    METRO_TS_MOVING_TO_STATION,
+    METRO_TS_ARRIVING,
+    METRO_TS_STOPPED_SIGNAL_RED,
+    METRO_TS_DOORS_OPENING,
+    METRO_TS_PASSENGERS_BOARDING,
+    METRO_TS_DOORS_CLOSING,
+    METRO_TS_SIGNAL_GREEN_WAIT,
+    METRO_TS_MOVING_AWAY
+};
+
+/* Anti-aliasing of metro_sim_render */
+enum
+{
+    METRO_AA_OFF,        /* the raster algorithms' 2 px points, as on screen */
+    METRO_AA_COVERAGE,   /* analytic per-pixel coverage, one pass */
+    METRO_AA_SSAA4       /* 4 samples per pixel (2x2 supersampling) */
+};
+
+typedef struct metro_sim metro_sim;
+
+typedef struct metro_sim_state
+{
+    double   time;                /* simulated seconds since create */
+    int      train_state;         /* METRO_TS_* */
+    float    train_x;             /* train origin, scene px */
+    float    door_open;           /* 0 closed .. 1 fully open */
+    int      signal_green;
+    int      cycle;               /* completed train cycles */
+    int      passengers_waiting;
+    uint64_t passengers_boarded;
+    int      night;               /* sun below the horizon (day clock) */
+    int      passengers_in_station; /* between fare gates and platform */
+    double   clock_minutes;       /* simulated minute of day, 0..1440 */
+} metro_sim_state;
+
+/* taps_path: optional tap-record CSV (see --taps); NULL spawns 0-4 riders
+   per cycle following the day clock's demand profile. Returns NULL if the
+   file cannot be opened. */
+metro_sim* metro_sim_create(const char* taps_path);
+void       metro_sim_destroy(metro_sim* sim);
+
+void metro_sim_step(metro_sim* sim, int ticks);
+/* Jumps the day clock to 22:00 / 10:00. Not sticky: the clock keeps running
+   at its speed, so set it to 0 with metro_sim_set_clock to hold the scene. */
+void metro_sim_set_night(metro_sim* sim, int night);
+/* Day clock: minute of day and speed (simulated minutes per second, 0 freezes) */
+void metro_sim_set_clock(metro_sim* sim, double minute_of_day, double minutes_per_second);
+void metro_sim_set_crowd_overlay(metro_sim* sim, int on);   /* platform heatmap */
+void metro_sim_set_antialias(metro_sim* sim, int mode);     /* METRO_AA_*, default off */
+void metro_sim_get_state(const metro_sim* sim, metro_sim_state* out);
+
+/* Draw the current frame into a caller-owned RGBA8 buffer (rows top-down,
+   stride in bytes >= width * 4). Returns 0 on success. */
+int metro_sim_render(metro_sim* sim, uint8_t* rgba, int width, int height, int stride);
+
+/* Process-wide: keep baked sprites in dir across runs, evicting least
+   recently used files beyond max_bytes. Off by default; NULL turns it off.
+   Call before the first render. */
+void metro_sim_asset_cache(const char* dir, uint64_t max_bytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* METRO_SIM_H */